@@ -0,0 +1,297 @@
+#include "autotune.h"
+
+#include <cjson/cJSON.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "linalg_utils.h"
+#include "omp.h"
+#include "utils.h"
+
+#define kCPUModelLength 256
+
+// Names used in the cache, indexed by MatrixLinearAlgebraLibrary
+static const char* kLibraryNames[kNumLinearAlgebraLibraries] = {"BLAS", "MKL", "Eigen",
+                                                                "Internal"};
+
+NdLqrKernelTuning ndlqr_DefaultKernelTuning() {
+  NdLqrKernelTuning tuning;
+  for (int op = 0; op < kNumLinearAlgebraOperations; ++op) {
+    tuning.libraries[op] = MatrixGetOperationLibrary(op);
+  }
+  tuning.valid = false;
+  return tuning;
+}
+
+int ndlqr_GetCPUModel(char* buf, int len) {
+  snprintf(buf, len, "unknown");
+  FILE* fp = fopen("/proc/cpuinfo", "r");
+  if (!fp) return -1;
+  char line[kCPUModelLength];
+  int out = -1;
+  while (fgets(line, sizeof(line), fp)) {
+    if (strncmp(line, "model name", 10) != 0) continue;
+    char* name = strchr(line, ':');
+    if (!name) break;
+    name += strspn(name, ": \t");
+    name[strcspn(name, "\n")] = '\0';
+    snprintf(buf, len, "%s", name);
+    out = 0;
+    break;
+  }
+  fclose(fp);
+  return out;
+}
+
+/*
+ * Benchmark data, sized like the blocks of an (nstates, ninputs) problem
+ */
+typedef struct {
+  Matrix A;  // (n,n)
+  Matrix B;  // (n,n)
+  Matrix C;  // (n,n)
+  Matrix S;  // (n,n) symmetric positive-definite
+  Matrix L;  // (n,n)
+  Matrix G;  // (n,m)
+  Matrix x;  // (n,1)
+  Matrix y;  // (n,1)
+} KernelBenchmark;
+
+static KernelBenchmark NewKernelBenchmark(int n, int m) {
+  KernelBenchmark bench = {NewMatrix(n, n), NewMatrix(n, n), NewMatrix(n, n),
+                           NewMatrix(n, n), NewMatrix(n, n), NewMatrix(n, m),
+                           NewMatrix(n, 1), NewMatrix(n, 1)};
+  for (int i = 0; i < n * n; ++i) {
+    bench.A.data[i] = sin(0.3 * i);
+    bench.B.data[i] = cos(0.7 * i);
+  }
+  for (int i = 0; i < n * m; ++i) bench.G.data[i] = sin(1.1 * i);
+  for (int i = 0; i < n; ++i) bench.x.data[i] = cos(0.5 * i);
+  MatrixMultiply(&bench.A, &bench.A, &bench.S, 1, 0, 1.0, 0.0);
+  for (int i = 0; i < n; ++i) *MatrixGetElement(&bench.S, i, i) += n;
+  return bench;
+}
+
+static void FreeKernelBenchmark(KernelBenchmark* bench) {
+  FreeMatrix(&bench->A);
+  FreeMatrix(&bench->B);
+  FreeMatrix(&bench->C);
+  FreeMatrix(&bench->S);
+  FreeMatrix(&bench->L);
+  FreeMatrix(&bench->G);
+  FreeMatrix(&bench->x);
+  FreeMatrix(&bench->y);
+}
+
+// The operations performed by the solver for each group of operations
+static void RunKernels(KernelBenchmark* bench, enum MatrixLinearAlgebraOperation op) {
+  switch (op) {
+    case laAddition:
+      MatrixAddition(&bench->A, &bench->C, 1.0);
+      break;
+    case laMultiply: {
+      Matrix lhs[2] = {bench->A, bench->B};
+      MatrixMultiply(&bench->A, &bench->B, &bench->C, 1, 0, 1.0, 0.0);
+      MatrixMultiply(&bench->A, &bench->B, &bench->C, 0, 0, -1.0, 1.0);
+      MatrixMultiply(&bench->G, &bench->G, &bench->C, 0, 1, 1.0, 1.0);
+      MatrixMultiply(&bench->A, &bench->x, &bench->y, 0, 0, 1.0, 0.0);
+      MatrixSymmetricTransposeMultiplySum(lhs, lhs, 2, &bench->C, 1.0, 0.0);
+      break;
+    }
+    case laSymmetricMultiply:
+      MatrixSymmetricMultiply(&bench->S, &bench->x, &bench->y, 1.0, 0.0);
+      break;
+    case laCholesky:
+      MatrixCopy(&bench->L, &bench->S);
+      MatrixCholeskyFactorize(&bench->L);
+      MatrixCopy(&bench->C, &bench->B);
+      MatrixCholeskySolve(&bench->L, &bench->C);
+      MatrixCopy(&bench->y, &bench->x);
+      MatrixCholeskySolve(&bench->L, &bench->y);
+      break;
+    default:
+      break;
+  }
+}
+
+// Best time out of a few trials, in seconds
+static double TimeKernels(KernelBenchmark* bench, enum MatrixLinearAlgebraOperation op) {
+  const int num_trials = 5;
+  int n = bench->A.rows;
+  int reps = 1 + 1000000 / (n * n * n);
+  RunKernels(bench, op);  // warm up
+  double t_best = INFINITY;
+  for (int trial = 0; trial < num_trials; ++trial) {
+    double t_start = omp_get_wtime();
+    for (int i = 0; i < reps; ++i) {
+      RunKernels(bench, op);
+    }
+    double t_elapsed = omp_get_wtime() - t_start;
+    if (t_elapsed < t_best) t_best = t_elapsed;
+  }
+  return t_best;
+}
+
+int ndlqr_BenchmarkKernels(int nstates, int ninputs, NdLqrKernelTuning* tuning) {
+  if (!tuning || nstates <= 0 || ninputs <= 0) return -1;
+  // Switch the libraries on this thread only, leaving the global setting untouched
+  NdLqrKernelTuning current = ndlqr_DefaultKernelTuning();
+  const enum MatrixLinearAlgebraLibrary* prev =
+      MatrixSetThreadOperationLibraries(current.libraries);
+  KernelBenchmark bench = NewKernelBenchmark(nstates, ninputs);
+  for (int op = 0; op < kNumLinearAlgebraOperations; ++op) {
+    enum MatrixLinearAlgebraLibrary lib_default = current.libraries[op];
+    double t_best = INFINITY;
+    for (int lib = 0; lib < kNumLinearAlgebraLibraries; ++lib) {
+      if (!MatrixHasLinearAlgebraLibrary(lib)) continue;
+      current.libraries[op] = lib;
+      double t_lib = TimeKernels(&bench, op);
+      if (t_lib < t_best) {
+        t_best = t_lib;
+        tuning->libraries[op] = lib;
+      }
+    }
+    current.libraries[op] = lib_default;
+  }
+  MatrixSetThreadOperationLibraries(prev);
+  tuning->valid = true;
+  FreeKernelBenchmark(&bench);
+  return 0;
+}
+
+static int GetLibraryFromName(const char* name, enum MatrixLinearAlgebraLibrary* lib) {
+  for (int i = 0; i < kNumLinearAlgebraLibraries; ++i) {
+    if (strcmp(name, kLibraryNames[i]) == 0) {
+      *lib = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Parse the cache file. Returns NULL if it doesn't exist or can't be parsed.
+static cJSON* ReadKernelTuningCache(const char* cachefile) {
+  FILE* fp = fopen(cachefile, "r");
+  if (!fp) return NULL;
+  fclose(fp);
+  char* buf = NULL;
+  int len = 0;
+  if (ReadFile(cachefile, &buf, &len) != 0) return NULL;
+  cJSON* cache = cJSON_Parse(buf);
+  free(buf);
+  return cache;
+}
+
+// Index of the entry for this CPU and problem size, or -1 if there isn't one
+static int FindKernelTuningEntry(cJSON* entries, const char* cpu, int nstates,
+                                 int ninputs) {
+  int index = 0;
+  cJSON* entry;
+  cJSON_ArrayForEach(entry, entries) {
+    cJSON* entry_cpu = cJSON_GetObjectItemCaseSensitive(entry, "cpu");
+    cJSON* entry_nstates = cJSON_GetObjectItemCaseSensitive(entry, "nstates");
+    cJSON* entry_ninputs = cJSON_GetObjectItemCaseSensitive(entry, "ninputs");
+    if (cJSON_IsString(entry_cpu) && cJSON_IsNumber(entry_nstates) &&
+        cJSON_IsNumber(entry_ninputs) && strcmp(entry_cpu->valuestring, cpu) == 0 &&
+        entry_nstates->valueint == nstates && entry_ninputs->valueint == ninputs) {
+      return index;
+    }
+    ++index;
+  }
+  return -1;
+}
+
+int ndlqr_LoadKernelTuning(const char* cachefile, int nstates, int ninputs,
+                           NdLqrKernelTuning* tuning) {
+  if (!cachefile || !tuning) return -1;
+  cJSON* cache = ReadKernelTuningCache(cachefile);
+  if (!cache) return -1;
+
+  char cpu[kCPUModelLength];
+  ndlqr_GetCPUModel(cpu, kCPUModelLength);
+  cJSON* entries = cJSON_GetObjectItemCaseSensitive(cache, "entries");
+  int index = FindKernelTuningEntry(entries, cpu, nstates, ninputs);
+  cJSON* libraries = NULL;
+  if (index >= 0) {
+    cJSON* entry = cJSON_GetArrayItem(entries, index);
+    libraries = cJSON_GetObjectItemCaseSensitive(entry, "libraries");
+  }
+  int out = -1;
+  if (cJSON_GetArraySize(libraries) == kNumLinearAlgebraOperations) {
+    NdLqrKernelTuning cached;
+    out = 0;
+    for (int op = 0; op < kNumLinearAlgebraOperations; ++op) {
+      cJSON* name = cJSON_GetArrayItem(libraries, op);
+      if (!cJSON_IsString(name) ||
+          GetLibraryFromName(name->valuestring, &cached.libraries[op]) != 0 ||
+          !MatrixHasLinearAlgebraLibrary(cached.libraries[op])) {
+        out = -1;
+        break;
+      }
+    }
+    if (out == 0) {
+      cached.valid = true;
+      *tuning = cached;
+    }
+  }
+  cJSON_Delete(cache);
+  return out;
+}
+
+int ndlqr_SaveKernelTuning(const char* cachefile, int nstates, int ninputs,
+                           const NdLqrKernelTuning* tuning) {
+  if (!cachefile || !tuning || !tuning->valid) return -1;
+  for (int op = 0; op < kNumLinearAlgebraOperations; ++op) {
+    int lib = tuning->libraries[op];
+    if (lib < 0 || lib >= kNumLinearAlgebraLibraries) return -1;
+  }
+  cJSON* cache = ReadKernelTuningCache(cachefile);
+  if (!cache) cache = cJSON_CreateObject();
+  cJSON* entries = cJSON_GetObjectItemCaseSensitive(cache, "entries");
+  if (!cJSON_IsArray(entries)) {
+    cJSON_DeleteItemFromObjectCaseSensitive(cache, "entries");
+    entries = cJSON_AddArrayToObject(cache, "entries");
+  }
+
+  // Replace the existing entry
+  char cpu[kCPUModelLength];
+  ndlqr_GetCPUModel(cpu, kCPUModelLength);
+  int index = FindKernelTuningEntry(entries, cpu, nstates, ninputs);
+  if (index >= 0) {
+    cJSON_DeleteItemFromArray(entries, index);
+  }
+  cJSON* entry = cJSON_CreateObject();
+  cJSON_AddStringToObject(entry, "cpu", cpu);
+  cJSON_AddNumberToObject(entry, "nstates", nstates);
+  cJSON_AddNumberToObject(entry, "ninputs", ninputs);
+  cJSON* libraries = cJSON_AddArrayToObject(entry, "libraries");
+  for (int op = 0; op < kNumLinearAlgebraOperations; ++op) {
+    const char* name = kLibraryNames[tuning->libraries[op]];
+    cJSON_AddItemToArray(libraries, cJSON_CreateString(name));
+  }
+  cJSON_AddItemToArray(entries, entry);
+
+  int out = -1;
+  char* str = cJSON_Print(cache);
+  FILE* fp = fopen(cachefile, "w");
+  if (fp && str) {
+    out = fputs(str, fp) < 0 ? -1 : 0;
+  }
+  if (fp) fclose(fp);
+  cJSON_free(str);
+  cJSON_Delete(cache);
+  return out;
+}
+
+NdLqrKernelTuning ndlqr_UseKernelTuning(const NdLqrKernelTuning* tuning) {
+  NdLqrKernelTuning prev = ndlqr_DefaultKernelTuning();
+  prev.valid = true;
+  if (tuning && tuning->valid) {
+    for (int op = 0; op < kNumLinearAlgebraOperations; ++op) {
+      MatrixSetOperationLibrary(op, tuning->libraries[op]);
+    }
+  }
+  return prev;
+}
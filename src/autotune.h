@@ -0,0 +1,122 @@
+/**
+ * @file autotune.h
+ * @brief Picks the fastest linear algebra library for the block sizes of a problem
+ *
+ * The fastest implementation of the block operations depends on the block sizes and
+ * the CPU. These methods benchmark every available library (see
+ * MatrixHasLinearAlgebraLibrary()) on the operations performed by the solver, and
+ * store the winners in a small JSON cache keyed by the CPU model and problem size, so
+ * the benchmark only needs to be run once per machine.
+ *
+ * ## Cache format
+ * ~~~~~{.json}
+ * {
+ *   "entries": [
+ *     {
+ *       "cpu": "<CPU model name>",
+ *       "nstates": <integer>,
+ *       "ninputs": <integer>,
+ *       "libraries": [<library name for each MatrixLinearAlgebraOperation>]
+ *     }
+ *   ]
+ * }
+ * ~~~~~
+ *
+ * @addtogroup rsLQR
+ * @{
+ */
+#pragma once
+
+#include <stdbool.h>
+
+#include "linalg.h"
+
+/**
+ * @brief Library used for each group of linear algebra operations
+ *
+ * ## Methods
+ * - ndlqr_DefaultKernelTuning()
+ * - ndlqr_BenchmarkKernels()
+ * - ndlqr_LoadKernelTuning()
+ * - ndlqr_SaveKernelTuning()
+ * - ndlqr_UseKernelTuning()
+ */
+typedef struct {
+  enum MatrixLinearAlgebraLibrary libraries[kNumLinearAlgebraOperations];
+  bool valid;  ///< false if no libraries have been chosen, e.g. before tuning
+} NdLqrKernelTuning;
+
+/**
+ * @brief A tuning that doesn't change the libraries currently in use
+ */
+NdLqrKernelTuning ndlqr_DefaultKernelTuning();
+
+/**
+ * @brief Get the model name of the CPU, used as the key for the tuning cache
+ *
+ * Reads `/proc/cpuinfo` on Linux. Returns "unknown" if the model can't be determined.
+ *
+ * @param[out] buf Storage for the null-terminated model name
+ * @param[in]  len Length of @p buf
+ * @return 0 if successful, -1 if the model is unknown.
+ */
+int ndlqr_GetCPUModel(char* buf, int len);
+
+/**
+ * @brief Time each available library on the block operations of a problem
+ *
+ * Benchmarks the products and Cholesky factorizations and solves performed by the
+ * solver for blocks of the given size, and picks the fastest library for each group
+ * of operations. Allocates memory for the benchmark, so it shouldn't be called
+ * during a real-time loop.
+ *
+ * @param[in]  nstates Number of states
+ * @param[in]  ninputs Number of inputs
+ * @param[out] tuning  Fastest library for each group of operations
+ * @return 0 if successful.
+ */
+int ndlqr_BenchmarkKernels(int nstates, int ninputs, NdLqrKernelTuning* tuning);
+
+/**
+ * @brief Load the tuning for this CPU and problem size from the cache
+ *
+ * @param[in]  cachefile Path to the JSON cache
+ * @param[in]  nstates   Number of states
+ * @param[in]  ninputs   Number of inputs
+ * @param[out] tuning    Cached tuning. Only modified if an entry is found.
+ * @return 0 if an entry was found, -1 otherwise (including if one of the cached
+ *         libraries isn't available in this build).
+ */
+int ndlqr_LoadKernelTuning(const char* cachefile, int nstates, int ninputs,
+                           NdLqrKernelTuning* tuning);
+
+/**
+ * @brief Store the tuning for this CPU and problem size in the cache
+ *
+ * Creates the file if it doesn't exist, and replaces any existing entry for the same
+ * CPU and problem size.
+ *
+ * @param cachefile Path to the JSON cache
+ * @param nstates   Number of states
+ * @param ninputs   Number of inputs
+ * @param tuning    Tuning to store
+ * @return 0 if successful, -1 otherwise.
+ */
+int ndlqr_SaveKernelTuning(const char* cachefile, int nstates, int ninputs,
+                           const NdLqrKernelTuning* tuning);
+
+/**
+ * @brief Switch the linear algebra libraries to the ones in @p tuning
+ *
+ * Does nothing if @p tuning isn't valid. The previous setting is returned so it
+ * can be restored afterwards by passing it back to this function. Like
+ * MatrixSetOperationLibrary(), this changes the global setting, so it shouldn't be
+ * called while a solve is running. The solver applies its own tuning to its threads
+ * only.
+ *
+ * @param tuning Libraries to use
+ * @return The libraries in use before the call
+ */
+NdLqrKernelTuning ndlqr_UseKernelTuning(const NdLqrKernelTuning* tuning);
+
+/**@} */
@@ -9,13 +9,11 @@ NdLqrCholeskyFactors* ndlqr_NewCholeskyFactors(int depth, int nhorizon) {
   NdLqrCholeskyFactors* cholfacts =
       (NdLqrCholeskyFactors*)malloc(sizeof(NdLqrCholeskyFactors));
   if (!cholfacts) return NULL;
-  int num_leaf_factors = 2 * nhorizon;
-  int num_S_factors = 0;
+  int numfacts = 0;
   for (int level = 0; level < depth; ++level) {
     int numleaves = PowerOfTwo(depth - level - 1);
-    num_S_factors += numleaves;
+    numfacts += numleaves;
   }
-  int numfacts = num_leaf_factors + num_S_factors;
   CholeskyInfo* cholinfo = (CholeskyInfo*)malloc(numfacts * sizeof(CholeskyInfo));
   if (!cholinfo) {
     free(cholfacts);
@@ -23,7 +21,6 @@ NdLqrCholeskyFactors* ndlqr_NewCholeskyFactors(int depth, int nhorizon) {
   }
   for (int i = 0; i < numfacts; ++i) {
     cholinfo[i].fact = NULL;
-    cholinfo[i].is_freed = true;
     cholinfo[i].lib = '\0';
     cholinfo[i].success = 1;
     cholinfo[i].uplo = '\0';
@@ -32,6 +29,9 @@ NdLqrCholeskyFactors* ndlqr_NewCholeskyFactors(int depth, int nhorizon) {
   cholfacts->nhorizon = nhorizon;
   cholfacts->cholinfo = cholinfo;
   cholfacts->numfacts = numfacts;
+  cholfacts->inverses = NULL;
+  cholfacts->workspace = NULL;
+  cholfacts->num_workspaces = 0;
   return cholfacts;
 }
 
@@ -40,43 +40,92 @@ int ndlqr_FreeCholeskyFactors(NdLqrCholeskyFactors* cholfacts) {
   for (int i = 0; i < cholfacts->numfacts; ++i) {
     FreeFactorization(cholfacts->cholinfo + i);
   }
+  ndlqr_DisableInverseCaching(cholfacts);
   free(cholfacts->cholinfo);
   free(cholfacts);
   cholfacts = NULL;
   return 0;
 }
 
-int ndlqr_GetQFactorizon(NdLqrCholeskyFactors* cholfacts, int index,
-                         CholeskyInfo** cholfact) {
+/*
+ * Index of the S block for the given leaf and level.
+ * Returns -1 if the leaf or level is out of range.
+ */
+static int ndlqr_GetSFactorIndex(NdLqrCholeskyFactors* cholfacts, int leaf, int level) {
+  if (level < 0 || level >= cholfacts->depth) return -1;
+  int numleaves = PowerOfTwo(cholfacts->depth - level - 1);
+  if (leaf < 0 || leaf >= numleaves) return -1;
+
+  int leaf_index = 0;
+  for (int lvl = 0; lvl < level; ++lvl) {
+    int numleaves = PowerOfTwo(cholfacts->depth - lvl - 1);
+    leaf_index += numleaves;
+  }
+  return leaf_index + leaf;
+}
+
+int ndlqr_GetSFactorization(NdLqrCholeskyFactors* cholfacts, int leaf, int level,
+                            CholeskyInfo** cholfact) {
   if (!cholfacts) return -1;
-  if (index < 0 || index >= cholfacts->nhorizon) return -1;
-  *cholfact = &cholfacts->cholinfo[2 * index];
+  int leaf_index = ndlqr_GetSFactorIndex(cholfacts, leaf, level);
+  if (leaf_index < 0) return -1;
+  *cholfact = &cholfacts->cholinfo[leaf_index];
   return 0;
 }
 
-int ndlqr_GetRFactorizon(NdLqrCholeskyFactors* cholfacts, int index,
-                         CholeskyInfo** cholfact) {
+int ndlqr_EnableInverseCaching(NdLqrCholeskyFactors* cholfacts, int n, int num_threads) {
   if (!cholfacts) return -1;
-  if (index < 0 || index >= cholfacts->nhorizon - 1) return -1;
-  *cholfact = &cholfacts->cholinfo[2 * index + 1];
+  if (n <= 0 || num_threads <= 0) return -1;
+  ndlqr_DisableInverseCaching(cholfacts);
+
+  int num_blocks = cholfacts->numfacts + num_threads;
+  Matrix* blocks = (Matrix*)malloc(num_blocks * sizeof(Matrix));
+  size_t blocksize = (size_t)n * n;
+  double* data = (double*)malloc(num_blocks * blocksize * sizeof(double));
+  if (!blocks || !data) {
+    free(blocks);
+    free(data);
+    return -1;
+  }
+  for (int i = 0; i < num_blocks; ++i) {
+    blocks[i].rows = n;
+    blocks[i].cols = n;
+    blocks[i].data = data + i * blocksize;
+    MatrixSetConst(blocks + i, 0.0);
+  }
+  cholfacts->inverses = blocks;
+  cholfacts->workspace = blocks + cholfacts->numfacts;
+  cholfacts->num_workspaces = num_threads;
   return 0;
 }
 
-int ndlqr_GetSFactorization(NdLqrCholeskyFactors* cholfacts, int leaf, int level,
-                            CholeskyInfo** cholfact) {
-  int numleaves = PowerOfTwo(cholfacts->depth - level - 1);
-  int num_leaf_factors = 2 * cholfacts->nhorizon;
+int ndlqr_DisableInverseCaching(NdLqrCholeskyFactors* cholfacts) {
+  if (!cholfacts) return -1;
+  if (cholfacts->inverses) {
+    free(cholfacts->inverses[0].data);
+    free(cholfacts->inverses);
+  }
+  cholfacts->inverses = NULL;
+  cholfacts->workspace = NULL;
+  cholfacts->num_workspaces = 0;
+  return 0;
+}
 
+int ndlqr_GetSInverse(NdLqrCholeskyFactors* cholfacts, int leaf, int level, Matrix** Sinv) {
   if (!cholfacts) return -1;
-  if (level < 0 || level >= cholfacts->depth) return -1;
-  if (leaf < 0 || leaf >= numleaves) return -1;
+  *Sinv = NULL;
+  if (!cholfacts->inverses) return -1;
+  int leaf_index = ndlqr_GetSFactorIndex(cholfacts, leaf, level);
+  if (leaf_index < 0) return -1;
+  *Sinv = cholfacts->inverses + leaf_index;
+  return 0;
+}
 
-  int leaf_index = 0;
-  for (int lvl = 0; lvl < level; ++lvl) {
-    int numleaves = PowerOfTwo(cholfacts->depth - lvl - 1);
-    leaf_index += numleaves;
-  }
-  leaf_index += leaf;
-  *cholfact = &cholfacts->cholinfo[num_leaf_factors + leaf_index];
+int ndlqr_GetInverseWorkspace(NdLqrCholeskyFactors* cholfacts, int threadid,
+                              Matrix** work) {
+  if (!cholfacts) return -1;
+  *work = NULL;
+  if (threadid < 0 || threadid >= cholfacts->num_workspaces) return -1;
+  *work = cholfacts->workspace + threadid;
   return 0;
 }
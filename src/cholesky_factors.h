@@ -23,15 +23,28 @@
  * ## Methods
  * - ndlqr_NewCholeskyFactors()
  * - ndlqr_FreeCholeskyFactors()
- * - ndlqr_GetQFactorization()
- * - ndlqr_GetRFactorization()
  * - ndlqr_GetSFactorization()
+ * - ndlqr_EnableInverseCaching()
+ * - ndlqr_DisableInverseCaching()
+ * - ndlqr_GetSInverse()
+ * - ndlqr_GetInverseWorkspace()
+ *
+ * ## Inverse caching
+ * The factorization of each \f$ \bar{\Lambda} \f$ block is applied to every upper level
+ * during the factorization and again to the right-hand side in the solution phase.
+ * With ndlqr_EnableInverseCaching(), the explicit inverse of each block is stored next to
+ * its factorization, so each of these applications becomes a matrix multiplication
+ * instead of a pair of triangular solves. Since the products can't be done in place,
+ * a scratch matrix is kept for each thread.
  */
 typedef struct {
   int depth;
   int nhorizon;
-  CholeskyInfo* cholinfo;
-  int numfacts;
+  CholeskyInfo* cholinfo;  ///< factorizations of the S blocks, ordered by level
+  int numfacts;            ///< number of S blocks
+  Matrix* inverses;    ///< explicit inverses of the S blocks, NULL if not cached
+  Matrix* workspace;   ///< per-thread scratch for applying the inverses
+  int num_workspaces;  ///< number of threads with a scratch matrix
 } NdLqrCholeskyFactors;
 
 /**
@@ -55,39 +68,62 @@ NdLqrCholeskyFactors* ndlqr_NewCholeskyFactors(int depth, int nhorizon);
 int ndlqr_FreeCholeskyFactors(NdLqrCholeskyFactors* cholfacts);
 
 /**
- * @brief Get the CholeskyInfo for the matrix Q at index @p index
+ * @brief Get the CholeskyInfo for the output of ndlqr_SolveCholeskyFactor().
+ *
+ * Gets the CholeskyInfo for \f$ \bar{B}_i^{(j)} \f$.
  *
  * @param[in]  cholfacts All the stored info for the Cholesky solves
- * @param[in]  index     Knot point index
+ * @param[in]  leaf      The leaf index for the desired factor
+ * @param[in]  level     The level of the binary tree for the factor
  * @param[out] cholfact  Location for the retrieved CholeskyInfo
  * @return               0 if successful
  */
-int ndlqr_GetQFactorizon(NdLqrCholeskyFactors* cholfacts, int index,
-                         CholeskyInfo** cholfact);
+int ndlqr_GetSFactorization(NdLqrCholeskyFactors* cholfacts, int leaf, int level,
+                            CholeskyInfo** cholfact);
 
 /**
- * @brief Get the CholeskyInfo for the matrix R at index @p index
+ * @brief Store the explicit inverses of the S blocks along with their factorizations
  *
- * @param[in]  cholfacts All the stored info for the Cholesky solves
- * @param[in]  index     Knot point index
- * @param[out] cholfact  Location for the retrieved CholeskyInfo
- * @return               0 if successful
+ * Allocates an (n,n) matrix for the inverse of every S block, plus an (n,n) scratch
+ * matrix for each of @p num_threads threads. Calling it again reallocates the storage.
+ * Must be paired with ndlqr_DisableInverseCaching() or ndlqr_FreeCholeskyFactors().
+ *
+ * @param cholfacts   All the stored info for the Cholesky solves
+ * @param n           Size of the S blocks (i.e. the number of states)
+ * @param num_threads Maximum number of threads that will apply the inverses
+ * @return            0 if successful
  */
-int ndlqr_GetRFactorizon(NdLqrCholeskyFactors* cholfacts, int index,
-                         CholeskyInfo** cholfact);
+int ndlqr_EnableInverseCaching(NdLqrCholeskyFactors* cholfacts, int n, int num_threads);
 
 /**
- * @brief Get the CholeskyInfo for the output of ndlqr_SolveCholeskyFactor().
+ * @brief Stop caching the inverses of the S blocks, freeing their storage
  *
- * Gets the CholeskyInfo for \f$ \bar{B}_i^{(j)} \f$.
+ * @param cholfacts All the stored info for the Cholesky solves
+ * @return          0 if successful
+ */
+int ndlqr_DisableInverseCaching(NdLqrCholeskyFactors* cholfacts);
+
+/**
+ * @brief Get the cached inverse for the same block as ndlqr_GetSFactorization().
  *
  * @param[in]  cholfacts All the stored info for the Cholesky solves
  * @param[in]  leaf      The leaf index for the desired factor
  * @param[in]  level     The level of the binary tree for the factor
- * @param[out] cholfact  Location for the retrieved CholeskyInfo
+ * @param[out] Sinv      Location for the inverse. Set to NULL if inverses aren't cached.
+ * @return               0 if successful, -1 if the inverses aren't cached.
+ */
+int ndlqr_GetSInverse(NdLqrCholeskyFactors* cholfacts, int leaf, int level, Matrix** Sinv);
+
+/**
+ * @brief Get the scratch matrix for applying the cached inverses on thread @p threadid
+ *
+ * @param[in]  cholfacts All the stored info for the Cholesky solves
+ * @param[in]  threadid  OpenMP thread number
+ * @param[out] work      Location for the (n,n) scratch matrix. Set to NULL if the
+ *                       inverses aren't cached or @p threadid doesn't have one.
  * @return               0 if successful
  */
-int ndlqr_GetSFactorization(NdLqrCholeskyFactors* cholfacts, int leaf, int level,
-                            CholeskyInfo** cholfact);
+int ndlqr_GetInverseWorkspace(NdLqrCholeskyFactors* cholfacts, int threadid,
+                              Matrix** work);
 
 /**@} */
@@ -1,7 +1,21 @@
 #include <Eigen/Dense>
 
+#include "eigen_c/eigen_c_fixed.h"
+#include "eigen_c_fixed_sizes.h"
+
 using MapMatrixXd = Eigen::Map<Eigen::MatrixXd>;
 
+// The kernels for each fixed size are compiled in a separate generated source file
+#define X(NX, NU)                                                                       \
+  extern template bool eigen_c::MultiplyBlocks<NX, NU>(const eigen_c::Product& p);      \
+  extern template bool eigen_c::FactorizeBlocks<NX, NU>(int n, double* a, int* info);   \
+  extern template bool eigen_c::SolveBlocks<NX, NU>(int n, int m, double* l, double* b, \
+                                                    bool transposed, bool both);
+EIGEN_C_FIXED_SIZES(X)
+#undef X
+
+using eigen_c::FixedMultiply;
+
 extern "C" {
 
 void eigen_SetNumThreads(int n) { Eigen::setNbThreads(n); }
@@ -23,38 +37,58 @@ void eigen_MatrixMultiply(int m, int n, int k, double* a, double* b, double* c,
   Eigen::Map<Eigen::MatrixXd> A(a, rowA, colA);
   Eigen::Map<Eigen::MatrixXd> B(b, rowB, colB);
   Eigen::Map<Eigen::MatrixXd> C(c, m, k);
+
+  // Scale C first so the product can be accumulated without a temporary
+  if (beta == 0.0) {
+    C.setZero();
+  } else if (beta != 1.0) {
+    C *= beta;
+  }
   if (!tA && !tB) {
-    C = (A * B) * alpha + beta * C;
+    C.noalias() += (alpha * A) * B;
   } else if (tA && !tB) {
-    C = (A.transpose() * B) * alpha + beta * C;
+    C.noalias() += (alpha * A.transpose()) * B;
   } else if (tA && tB) {
-    C = (A.transpose() * B.transpose()) * alpha + beta * C;
+    C.noalias() += (alpha * A.transpose()) * B.transpose();
   } else if (!tA && tB) {
-    C = (A * B.transpose()) * alpha + beta * C;
+    C.noalias() += (alpha * A) * B.transpose();
   }
 }
 
-int eigen_CholeskyFactorize(int n, double* a, void** fact) {
-  using LLT = Eigen::LLT<Eigen::Ref<MapMatrixXd>>;
-  MapMatrixXd A(a, n, n);
-  LLT* llt = new LLT(A);
-  *fact = static_cast<void*>(llt);
-  int info = static_cast<int>(llt->info());
-  return info;  // 0 is success
+void eigen_MatrixMultiplyLower(int n, int k, double* a, double* b, double* c, bool tA,
+                               bool tB, double alpha, double beta) {
+  Eigen::Map<Eigen::MatrixXd> A(a, tA ? k : n, tA ? n : k);
+  Eigen::Map<Eigen::MatrixXd> B(b, tB ? n : k, tB ? k : n);
+  Eigen::Map<Eigen::MatrixXd> C(c, n, n);
+  auto Cl = C.triangularView<Eigen::Lower>();
+  if (beta == 0.0) {
+    Cl.setZero();
+  } else if (beta != 1.0) {
+    Cl *= beta;
+  }
+  if (!tA && !tB) {
+    Cl += (alpha * A) * B;
+  } else if (tA && !tB) {
+    Cl += (alpha * A.transpose()) * B;
+  } else if (tA && tB) {
+    Cl += (alpha * A.transpose()) * B.transpose();
+  } else if (!tA && tB) {
+    Cl += (alpha * A) * B.transpose();
+  }
 }
 
-void eigen_FreeFactorization(void* achol) {
-  using LLT = Eigen::LLT<Eigen::Ref<MapMatrixXd>>;
-  LLT* llt = static_cast<LLT*>(achol);
-  delete llt;
+int eigen_CholeskyFactorize(int n, double* a) {
+  // Decomposing a Ref factors in place, so no storage needs to be allocated
+  MapMatrixXd A(a, n, n);
+  Eigen::LLT<Eigen::Ref<Eigen::MatrixXd>> llt(A);
+  return llt.info() == Eigen::Success ? 0 : 1;  // 0 is success
 }
 
-void eigen_CholeskySolve(int n, int m, void* achol, double* b) {
-  using LLT = Eigen::LLT<Eigen::Ref<MapMatrixXd>>;
+void eigen_CholeskySolve(int n, int m, double* achol, double* b) {
+  MapMatrixXd L(achol, n, n);
   MapMatrixXd B(b, n, m);
-
-  LLT* llt = static_cast<LLT*>(achol);
-  llt->solveInPlace(B);
+  L.triangularView<Eigen::Lower>().solveInPlace(B);
+  L.triangularView<Eigen::Lower>().transpose().solveInPlace(B);
 }
 
 void eigen_SymmetricMatrixMultiply(int n, int m, double* a, double* b,
@@ -62,28 +96,59 @@ void eigen_SymmetricMatrixMultiply(int n, int m, double* a, double* b,
   Eigen::Map<Eigen::MatrixXd> A(a, n, m);
   Eigen::Map<Eigen::MatrixXd> B(b, n, n);
   Eigen::Map<Eigen::MatrixXd> C(c, n, m);
-  C = A.selfadjointView<Eigen::Lower>() * B;
+  C.noalias() = A.selfadjointView<Eigen::Lower>() * B;
 }
 
 void eigen_MatrixMultiply8x8(double* a, double* b, double* c) {
-  Eigen::Map<Eigen::Matrix<double, 8, 8>> A(a);
-  Eigen::Map<Eigen::Matrix<double, 8, 8>> B(b);
-  Eigen::Map<Eigen::Matrix<double, 8, 8>> C(c);
-  C = A * B;
+  FixedMultiply<8, 8, 8>(a, b, c, false, false, 1.0, 0.0);
 }
 
 void eigen_MatrixMultiply6x6(double* a, double* b, double* c) {
-  Eigen::Map<Eigen::Matrix<double, 6, 6>> A(a);
-  Eigen::Map<Eigen::Matrix<double, 6, 6>> B(b);
-  Eigen::Map<Eigen::Matrix<double, 6, 6>> C(c);
-  C = A * B;
+  FixedMultiply<6, 6, 6>(a, b, c, false, false, 1.0, 0.0);
 }
 
 void eigen_MatrixMultiply6x3(double* a, double* b, double* c) {
-  Eigen::Map<Eigen::Matrix<double, 6, 6>> A(a);
-  Eigen::Map<Eigen::Matrix<double, 6, 6>> B(b);
-  Eigen::Map<Eigen::Matrix<double, 6, 6>> C(c);
-  C = A * B;
+  FixedMultiply<6, 6, 3>(a, b, c, false, false, 1.0, 0.0);
+}
+
+bool eigen_MatrixMultiplyFixed(int m, int n, int k, double* a, double* b, double* c,
+                               bool tA, bool tB, double alpha, double beta) {
+  const eigen_c::Product p = {m, n, k, a, b, c, tA, tB, alpha, beta};
+#define X(NX, NU) eigen_c::MultiplyBlocks<NX, NU>(p) ||
+  return EIGEN_C_FIXED_SIZES(X) false;
+#undef X
+}
+
+bool eigen_CholeskyFactorizeFixed(int n, double* a, int* info) {
+#define X(NX, NU) eigen_c::FactorizeBlocks<NX, NU>(n, a, info) ||
+  return EIGEN_C_FIXED_SIZES(X) false;
+#undef X
+}
+
+bool eigen_TriangularSolveFixed(int n, int m, double* l, double* b, bool transposed) {
+#define X(NX, NU) eigen_c::SolveBlocks<NX, NU>(n, m, l, b, transposed, false) ||
+  return EIGEN_C_FIXED_SIZES(X) false;
+#undef X
+}
+
+bool eigen_CholeskySolveFixed(int n, int m, double* achol, double* b) {
+#define X(NX, NU) eigen_c::SolveBlocks<NX, NU>(n, m, achol, b, false, true) ||
+  return EIGEN_C_FIXED_SIZES(X) false;
+#undef X
+}
+
+int eigen_GetFixedSizes(int* nstates, int* ninputs, int max) {
+  const int sizes[][2] = {
+#define X(NX, NU) {NX, NU},
+      EIGEN_C_FIXED_SIZES(X){0, 0}
+#undef X
+  };
+  int count = sizeof(sizes) / sizeof(sizes[0]) - 1;
+  for (int i = 0; i < count && i < max; ++i) {
+    nstates[i] = sizes[i][0];
+    ninputs[i] = sizes[i][1];
+  }
+  return count;
 }
 
 }  // extern "C"
\ No newline at end of file
@@ -1,3 +1,5 @@
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -23,15 +25,113 @@ void eigen_MatrixAddition(int n, double* a, double* b, double alpha);
 
 void eigen_MatrixMultiply(int m, int n, int k, double* a, double* b, double* c,
                           bool tA, bool tB, double alpha, double beta);
+/**
+ * @brief Matrix multiplication that only updates the lower triangle of the output
+ *
+ * `tril(C) = alpha * op(A) * op(B) + beta * tril(C)`
+ *
+ * Intended for products known to be symmetric. The strictly upper triangle of C is
+ * not modified.
+ *
+ * @param n Size of the square output C
+ * @param k Inner dimension of the product
+ */
+void eigen_MatrixMultiplyLower(int n, int k, double* a, double* b, double* c, bool tA,
+                               bool tB, double alpha, double beta);
 void eigen_SymmetricMatrixMultiply(int n, int m, double* a, double* b,
                                    double* c);
 void eigen_MatrixMultiply8x8(double* a, double* b, double* c);
 void eigen_MatrixMultiply6x6(double* a, double* b, double* c);
+
+/**
+ * @brief Multiply a (6,6) matrix by a (6,3) matrix
+ *
+ * `C = A * B`
+ */
 void eigen_MatrixMultiply6x3(double* a, double* b, double* c);
 
-int eigen_CholeskyFactorize(int n, double* a, void** fact);
-void eigen_CholeskySolve(int n, int m, void* achol, double* b);
-void eigen_FreeFactorization(void* achol);
+/**
+ * @brief Compute the Cholesky factorization in place
+ *
+ * Overwrites the lower triangle of @p a with the Cholesky factor, leaving the strictly
+ * upper triangle untouched. Doesn't allocate any memory.
+ *
+ * @param n Size of the matrix
+ * @param a Square, positive-definite matrix
+ * @return 0 if successful
+ */
+int eigen_CholeskyFactorize(int n, double* a);
+
+/**
+ * @brief Solve using a Cholesky factor computed by eigen_CholeskyFactorize()
+ *
+ * @param n     Size of the factored matrix
+ * @param m     Number of right-hand sides
+ * @param achol Factored matrix
+ * @param b     Right-hand side of size (n,m). Overwritten with the solution.
+ */
+void eigen_CholeskySolve(int n, int m, double* achol, double* b);
+
+/*
+ * Fixed-size kernels
+ *
+ * Fixed-size versions of the routines above are compiled for the block sizes listed in
+ * the RSLQR_EIGEN_FIXED_SIZES CMake option. For each (nstates, ninputs) pair this covers
+ * every product between (nstates,nstates), (nstates,ninputs), (ninputs,nstates) and
+ * (ninputs,ninputs) blocks, and between the blocks and vectors, along with the Cholesky
+ * factorization and triangular solves of the square blocks.
+ *
+ * Each routine returns false without modifying its arguments if the shape doesn't match
+ * one of the compiled sizes, in which case the dynamic-size version should be called.
+ */
+
+/**
+ * @brief Fixed-size version of eigen_MatrixMultiply()
+ *
+ * @return true if a fixed-size kernel was used
+ */
+bool eigen_MatrixMultiplyFixed(int m, int n, int k, double* a, double* b, double* c,
+                               bool tA, bool tB, double alpha, double beta);
+
+/**
+ * @brief Fixed-size version of eigen_CholeskyFactorize()
+ *
+ * @param[in]    n    Size of the matrix
+ * @param[inout] a    Square, positive-definite matrix
+ * @param[out]   info 0 if the factorization succeeded. Only set if the function
+ *                    returns true.
+ * @return true if a fixed-size kernel was used
+ */
+bool eigen_CholeskyFactorizeFixed(int n, double* a, int* info);
+
+/**
+ * @brief Solve `L X = B`, or `L' X = B` if @p transposed is true, in place
+ *
+ * @param n          Size of the lower-triangular matrix L
+ * @param m          Number of right-hand sides
+ * @param l          Lower-triangular matrix. The strictly upper triangle isn't read.
+ * @param b          Right-hand side of size (n,m). Overwritten with the solution.
+ * @param transposed Solve with the transpose of L
+ * @return true if a fixed-size kernel was used
+ */
+bool eigen_TriangularSolveFixed(int n, int m, double* l, double* b, bool transposed);
+
+/**
+ * @brief Fixed-size version of eigen_CholeskySolve()
+ *
+ * @return true if a fixed-size kernel was used
+ */
+bool eigen_CholeskySolveFixed(int n, int m, double* achol, double* b);
+
+/**
+ * @brief Get the (nstates, ninputs) pairs with fixed-size kernels
+ *
+ * @param[out] nstates Number of states for each pair
+ * @param[out] ninputs Number of inputs for each pair
+ * @param[in]  max     Capacity of @p nstates and @p ninputs
+ * @return The number of pairs, which may be more than @p max
+ */
+int eigen_GetFixedSizes(int* nstates, int* ninputs, int max);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,113 @@
+/**
+ * @file eigen_c_fixed.h
+ * @brief Fixed-size Eigen kernels for the blocks of an (nstates, ninputs) problem
+ *
+ * The kernels are explicitly instantiated for each size in RSLQR_EIGEN_FIXED_SIZES by a
+ * source file generated from eigen_c_fixed.cpp.in, so the sizes compile in parallel.
+ * The C interface in eigen_c.cpp dispatches to them when the shape matches.
+ *
+ * This header is internal to the Eigen bridge.
+ */
+#pragma once
+
+#include <Eigen/Dense>
+
+namespace eigen_c {
+
+// Map of a fixed-size matrix. Eigen requires row vectors to be stored row-wise.
+template <int Rows, int Cols>
+using FixedMap = Eigen::Map<Eigen::Matrix<double, Rows, Cols,
+                                          (Rows == 1 && Cols != 1) ? Eigen::RowMajor
+                                                                   : Eigen::ColMajor>>;
+
+// C = alpha * op(A) * op(B) + beta * C, where op(A) is (M,N) and op(B) is (N,K)
+template <int M, int N, int K>
+void FixedMultiply(double* a, double* b, double* c, bool tA, bool tB, double alpha,
+                   double beta) {
+  FixedMap<M, K> C(c);
+  if (beta == 0.0) {
+    C.setZero();
+  } else if (beta != 1.0) {
+    C *= beta;
+  }
+  if (!tA && !tB) {
+    C.noalias() += (alpha * FixedMap<M, N>(a)) * FixedMap<N, K>(b);
+  } else if (tA && !tB) {
+    C.noalias() += (alpha * FixedMap<N, M>(a).transpose()) * FixedMap<N, K>(b);
+  } else if (tA && tB) {
+    C.noalias() +=
+        (alpha * FixedMap<N, M>(a).transpose()) * FixedMap<K, N>(b).transpose();
+  } else if (!tA && tB) {
+    C.noalias() += (alpha * FixedMap<M, N>(a)) * FixedMap<K, N>(b).transpose();
+  }
+}
+
+// Arguments of eigen_MatrixMultiply()
+struct Product {
+  int m, n, k;
+  double *a, *b, *c;
+  bool tA, tB;
+  double alpha, beta;
+};
+
+template <int M, int N, int K>
+bool MultiplyIfShape(const Product& p) {
+  if (p.m != M || p.n != N || p.k != K) return false;
+  FixedMultiply<M, N, K>(p.a, p.b, p.c, p.tA, p.tB, p.alpha, p.beta);
+  return true;
+}
+
+// Every product of two blocks of an (NX,NU) problem, and of a block with a vector
+template <int NX, int NU>
+bool MultiplyBlocks(const Product& p) {
+  return MultiplyIfShape<NX, NX, NX>(p) || MultiplyIfShape<NX, NX, NU>(p) ||
+         MultiplyIfShape<NX, NU, NX>(p) || MultiplyIfShape<NX, NU, NU>(p) ||
+         MultiplyIfShape<NU, NX, NX>(p) || MultiplyIfShape<NU, NX, NU>(p) ||
+         MultiplyIfShape<NU, NU, NX>(p) || MultiplyIfShape<NU, NU, NU>(p) ||
+         MultiplyIfShape<NX, NX, 1>(p) || MultiplyIfShape<NX, NU, 1>(p) ||
+         MultiplyIfShape<NU, NX, 1>(p) || MultiplyIfShape<NU, NU, 1>(p);
+}
+
+template <int N>
+bool FactorizeIfShape(int n, double* a, int* info) {
+  if (n != N) return false;
+  FixedMap<N, N> A(a);
+  Eigen::LLT<Eigen::Ref<Eigen::Matrix<double, N, N>>> llt(A);
+  *info = llt.info() == Eigen::Success ? 0 : 1;
+  return true;
+}
+
+template <int NX, int NU>
+bool FactorizeBlocks(int n, double* a, int* info) {
+  return FactorizeIfShape<NX>(n, a, info) || FactorizeIfShape<NU>(n, a, info);
+}
+
+/*
+ * Solves L X = B, L' X = B if transposed is true, or L L' X = B if both is true, where
+ * L is (N,N) and B is (N,M)
+ */
+template <int N, int M>
+bool SolveIfShape(int n, int m, double* l, double* b, bool transposed, bool both) {
+  if (n != N || m != M) return false;
+  FixedMap<N, N> L(l);
+  FixedMap<N, M> B(b);
+  if (!transposed) {
+    L.template triangularView<Eigen::Lower>().solveInPlace(B);
+  }
+  if (transposed || both) {
+    L.template triangularView<Eigen::Lower>().transpose().solveInPlace(B);
+  }
+  return true;
+}
+
+template <int NX, int NU>
+bool SolveBlocks(int n, int m, double* l, double* b, bool transposed, bool both) {
+  return SolveIfShape<NX, NX>(n, m, l, b, transposed, both) ||
+         SolveIfShape<NX, NU>(n, m, l, b, transposed, both) ||
+         SolveIfShape<NX, 1>(n, m, l, b, transposed, both) ||
+         SolveIfShape<NU, NU>(n, m, l, b, transposed, both) ||
+         SolveIfShape<NU, NX>(n, m, l, b, transposed, both) ||
+         SolveIfShape<NU, 1>(n, m, l, b, transposed, both);
+}
+
+}  // namespace eigen_c
@@ -19,133 +19,646 @@
 #include "linalg_custom.h"
 #include "linalg_utils.h"
 
-CholeskyInfo DefaultCholeskyInfo() {
-  CholeskyInfo cholinfo = {'\0', 0, '\0', NULL, 1};
-  return cholinfo;
+#ifndef RSLQR_LINALG_DEFAULT
+#define RSLQR_LINALG_DEFAULT libInternal
+#endif
+
+// Batched operations are processed in chunks of this many blocks, so that any arrays of
+// arguments can live on the stack
+#define kMatrixBatchChunk 64
+
+/*
+ * Dispatch table with the implementation of each operation for a single library.
+ *
+ * Every library that was found at build time has its own table. The routines in this
+ * file look up the table for the library currently selected for that operation (see
+ * MatrixSetLinearAlgebraLibrary() and MatrixSetOperationLibrary()). Every library
+ * factorizes in place into the lower triangle, so the Cholesky factorization computed
+ * by one library can be used by any other.
+ */
+typedef struct {
+  char id;  // stored in CholeskyInfo::lib
+  int (*addition)(Matrix* A, Matrix* B, double alpha);
+  int (*cholesky_factorize)(Matrix* A);
+  int (*cholesky_solve)(Matrix* L, Matrix* b);
+  int (*cholesky_inverse)(Matrix* L, Matrix* Ainv, double alpha);
+  int (*multiply)(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB, double alpha,
+                  double beta);
+  int (*multiply_symmetric_result)(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB,
+                                   double alpha, double beta);
+  int (*multiply_stacked)(Matrix* A, Matrix* B, Matrix* C, int num_blocks, double alpha,
+                          double beta);
+  int (*transpose_multiply_sum)(Matrix* A, Matrix* B, int num_terms, Matrix* C,
+                                double alpha, double beta);
+  int (*symmetric_transpose_multiply_sum)(Matrix* A, Matrix* B, int num_terms, Matrix* C,
+                                          double alpha, double beta);
+  int (*symmetric_rank2k_update)(Matrix* A, Matrix* B, Matrix* C, double alpha,
+                                 double beta);
+  int (*symmetric_multiply)(Matrix* Asym, Matrix* B, Matrix* C, double alpha, double beta);
+  int (*cholesky_factorize_batched)(Matrix* A, int count, int* info);
+  int (*cholesky_solve_batched)(Matrix* L, Matrix* b, int count);
+  int (*multiply_batched)(Matrix* A, Matrix* B, Matrix* C, int count, bool tA, bool tB,
+                          double alpha, double beta);
+} MatrixBackend;
+
+/*
+ * Generic batched operations, which call the library's routine for a single block on
+ * each block of the batch. Used by the libraries without a batched interface.
+ */
+typedef int (*MatrixMultiplyFunction)(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB,
+                                      double alpha, double beta);
+
+static int MatrixCholeskyFactorizeBatchedGeneric(int (*factorize)(Matrix* A), Matrix* A,
+                                                 int count, int* info) {
+  int out = 0;
+  for (int i = 0; i < count; ++i) {
+    info[i] = factorize(A + i);
+    if (info[i] != 0) out = -1;
+  }
+  return out;
 }
 
-void FreeFactorization(CholeskyInfo* cholinfo) {
-#ifdef USE_EIGEN
-  if (cholinfo->lib == 'E' && !cholinfo->is_freed) {  // Eigen
-    eigen_FreeFactorization(cholinfo->fact);
-    cholinfo->is_freed = true;
+static int MatrixCholeskySolveBatchedGeneric(int (*solve)(Matrix* L, Matrix* b), Matrix* L,
+                                             Matrix* b, int count) {
+  int out = 0;
+  for (int i = 0; i < count; ++i) {
+    if (solve(L + i, b + i) != 0) out = -1;
   }
-#else
-  (void)cholinfo;
-#endif
+  return out;
 }
 
-int MatrixAddition(Matrix* A, Matrix* B, double alpha) {
-  if (!A || !B) return -1;
-  switch (MatrixGetLinearAlgebraLibrary()) {
+static int MatrixMultiplyBatchedGeneric(MatrixMultiplyFunction multiply, Matrix* A,
+                                        Matrix* B, Matrix* C, int count, bool tA, bool tB,
+                                        double alpha, double beta) {
+  for (int i = 0; i < count; ++i) {
+    multiply(A + i, B + i, C + i, tA, tB, alpha, beta);
+  }
+  return 0;
+}
+
+/*
+ * Internal routines
+ */
+static int clap_SymmetricRank2kUpdate(Matrix* A, Matrix* B, Matrix* C, double alpha,
+                                      double beta) {
+  // A'B + B'A as a two-term sum, so both products are fused into one kernel
+  Matrix lhs[2] = {*A, *B};
+  Matrix rhs[2] = {*B, *A};
+  return clap_MatrixSymmetricTransposeMultiplySum(lhs, rhs, 2, C, alpha, beta);
+}
+
+// The internal kernels have no per-call overhead to amortize, so the batched operations
+// just skip the dispatch and timing of each block
+static int clap_CholeskyFactorizeBatched(Matrix* A, int count, int* info) {
+  return MatrixCholeskyFactorizeBatchedGeneric(clap_CholeskyFactorize, A, count, info);
+}
+
+static int clap_CholeskySolveBatched(Matrix* L, Matrix* b, int count) {
+  return MatrixCholeskySolveBatchedGeneric(clap_CholeskySolve, L, b, count);
+}
+
+static int clap_MultiplyBatched(Matrix* A, Matrix* B, Matrix* C, int count, bool tA,
+                                bool tB, double alpha, double beta) {
+  return MatrixMultiplyBatchedGeneric(clap_MatrixMultiply, A, B, C, count, tA, tB, alpha,
+                                      beta);
+}
+
+static const MatrixBackend kInternalBackend = {
+    'I',
+    clap_MatrixAddition,
+    clap_CholeskyFactorize,
+    clap_CholeskySolve,
+    clap_CholeskyInverse,
+    clap_MatrixMultiply,
+    clap_MatrixMultiplySymmetricResult,
+    clap_MatrixMultiplyStacked,
+    clap_MatrixTransposeMultiplySum,
+    clap_MatrixSymmetricTransposeMultiplySum,
+    clap_SymmetricRank2kUpdate,
+    clap_SymmetricMatrixMultiply,
+    clap_CholeskyFactorizeBatched,
+    clap_CholeskySolveBatched,
+    clap_MultiplyBatched,
+};
+
+#if defined(USE_EIGEN) || defined(USE_BLAS) || defined(USE_MKL)
+/*
+ * Generic versions of the fused products for the external libraries, which compute the
+ * products one at a time using the library's own multiplication routines.
+ */
+static int MatrixMultiplyStackedGeneric(MatrixMultiplyFunction multiply, Matrix* A,
+                                        Matrix* B, Matrix* C, int num_blocks,
+                                        double alpha, double beta) {
+  for (int i = 0; i < num_blocks; ++i) {
+    multiply(A + i, B, C + i, false, false, alpha, beta);
+  }
+  return 0;
+}
+
+static int MatrixTransposeMultiplySumGeneric(MatrixMultiplyFunction multiply, Matrix* A,
+                                             Matrix* B, int num_terms, Matrix* C,
+                                             double alpha, double beta) {
+  if (num_terms <= 0) clap_MatrixScale(C, beta);
+  for (int i = 0; i < num_terms; ++i) {
+    multiply(A + i, B + i, C, true, false, alpha, i == 0 ? beta : 1.0);
+  }
+  return 0;
+}
+
+// Same as above, with a multiply that only updates the lower triangle of C
+static int MatrixSymmetricTransposeMultiplySumGeneric(MatrixMultiplyFunction multiply_lower,
+                                                      Matrix* A, Matrix* B, int num_terms,
+                                                      Matrix* C, double alpha,
+                                                      double beta) {
+  MatrixTransposeMultiplySumGeneric(multiply_lower, A, B, num_terms, C, alpha, beta);
+  return clap_CopyLowerToUpper(C);
+}
+#endif
+
+/*
+ * Eigen
+ */
 #ifdef USE_EIGEN
-    case libEigen: {
-      int n = MatrixNumElements(A);
-      eigen_MatrixAddition(n, A->data, B->data, alpha);
-    } break;
+static int eigen_Addition(Matrix* A, Matrix* B, double alpha) {
+  eigen_MatrixAddition(MatrixNumElements(A), A->data, B->data, alpha);
+  return 0;
+}
+
+/*
+ * Blocks whose shape matches one of the sizes in RSLQR_EIGEN_FIXED_SIZES use the
+ * fixed-size kernels, and all others fall back to the dynamic-size ones.
+ */
+static int eigen_Factorize(Matrix* A) {
+  int info;
+  if (eigen_CholeskyFactorizeFixed(A->rows, A->data, &info)) {
+    return info;
+  }
+  return eigen_CholeskyFactorize(A->rows, A->data);
+}
+
+static int eigen_Solve(Matrix* L, Matrix* b) {
+  if (!eigen_CholeskySolveFixed(L->rows, b->cols, L->data, b->data)) {
+    eigen_CholeskySolve(L->rows, b->cols, L->data, b->data);
+  }
+  return 0;
+}
+
+static int eigen_Inverse(Matrix* L, Matrix* Ainv, double alpha) {
+  int n = L->rows;
+  MatrixSetConst(Ainv, 0.0);
+  for (int i = 0; i < n; ++i) {
+    MatrixSetElement(Ainv, i, i, alpha);
+  }
+  return eigen_Solve(L, Ainv);
+}
+
+static int eigen_Multiply(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB, double alpha,
+                          double beta) {
+  int m = tA ? A->cols : A->rows;
+  int n = tA ? A->rows : A->cols;
+  int k = tB ? B->rows : B->cols;
+  if (!eigen_MatrixMultiplyFixed(m, n, k, A->data, B->data, C->data, tA, tB, alpha,
+                                 beta)) {
+    eigen_MatrixMultiply(m, n, k, A->data, B->data, C->data, tA, tB, alpha, beta);
+  }
+  return 0;
+}
+
+static int eigen_MultiplyLower(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB,
+                               double alpha, double beta) {
+  int k = tA ? A->rows : A->cols;
+  eigen_MatrixMultiplyLower(C->rows, k, A->data, B->data, C->data, tA, tB, alpha, beta);
+  return 0;
+}
+
+static int eigen_MultiplySymmetricResult(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB,
+                                         double alpha, double beta) {
+  // The full fixed-size product is cheaper than the dynamic-size lower triangle. Any
+  // garbage in the upper triangle is overwritten from the lower one below.
+  int n = C->rows;
+  int k = tA ? A->rows : A->cols;
+  if (!eigen_MatrixMultiplyFixed(n, k, n, A->data, B->data, C->data, tA, tB, alpha,
+                                 beta)) {
+    eigen_MultiplyLower(A, B, C, tA, tB, alpha, beta);
+  }
+  return clap_CopyLowerToUpper(C);
+}
+
+static int eigen_MultiplyStacked(Matrix* A, Matrix* B, Matrix* C, int num_blocks,
+                                 double alpha, double beta) {
+  return MatrixMultiplyStackedGeneric(eigen_Multiply, A, B, C, num_blocks, alpha, beta);
+}
+
+static int eigen_TransposeMultiplySum(Matrix* A, Matrix* B, int num_terms, Matrix* C,
+                                      double alpha, double beta) {
+  return MatrixTransposeMultiplySumGeneric(eigen_Multiply, A, B, num_terms, C, alpha, beta);
+}
+
+static int eigen_SymmetricTransposeMultiplySum(Matrix* A, Matrix* B, int num_terms,
+                                               Matrix* C, double alpha, double beta) {
+  return MatrixSymmetricTransposeMultiplySumGeneric(eigen_MultiplyLower, A, B, num_terms, C,
+                                                    alpha, beta);
+}
+
+static int eigen_SymmetricRank2kUpdate(Matrix* A, Matrix* B, Matrix* C, double alpha,
+                                       double beta) {
+  Matrix lhs[2] = {*A, *B};
+  Matrix rhs[2] = {*B, *A};
+  return eigen_SymmetricTransposeMultiplySum(lhs, rhs, 2, C, alpha, beta);
+}
+
+static int eigen_CholeskyFactorizeBatched(Matrix* A, int count, int* info) {
+  return MatrixCholeskyFactorizeBatchedGeneric(eigen_Factorize, A, count, info);
+}
+
+static int eigen_CholeskySolveBatched(Matrix* L, Matrix* b, int count) {
+  return MatrixCholeskySolveBatchedGeneric(eigen_Solve, L, b, count);
+}
+
+static int eigen_MultiplyBatched(Matrix* A, Matrix* B, Matrix* C, int count, bool tA,
+                                 bool tB, double alpha, double beta) {
+  return MatrixMultiplyBatchedGeneric(eigen_Multiply, A, B, C, count, tA, tB, alpha, beta);
+}
+
+static const MatrixBackend kEigenBackend = {
+    'E',
+    eigen_Addition,
+    eigen_Factorize,
+    eigen_Solve,
+    eigen_Inverse,
+    eigen_Multiply,
+    eigen_MultiplySymmetricResult,
+    eigen_MultiplyStacked,
+    eigen_TransposeMultiplySum,
+    eigen_SymmetricTransposeMultiplySum,
+    eigen_SymmetricRank2kUpdate,
+    clap_SymmetricMatrixMultiply,
+    eigen_CholeskyFactorizeBatched,
+    eigen_CholeskySolveBatched,
+    eigen_MultiplyBatched,
+};
 #endif
 
-    default:
-      clap_MatrixAddition(A, B, alpha);
-      break;
+/*
+ * BLAS and LAPACK. Used by both the open-source libraries and MKL, which share the same
+ * C interface.
+ */
+#if defined(USE_BLAS) || defined(USE_MKL)
+static int blas_Factorize(Matrix* A) {
+  return LAPACKE_dpotrf(LAPACK_COL_MAJOR, 'L', A->rows, A->data, A->rows);
+}
+
+static int blas_Solve(Matrix* L, Matrix* b) {
+  return LAPACKE_dpotrs(LAPACK_COL_MAJOR, 'L', L->rows, b->cols, L->data, L->rows, b->data,
+                        b->rows);
+}
+
+static int blas_Inverse(Matrix* L, Matrix* Ainv, double alpha) {
+  int n = L->rows;
+  MatrixCopy(Ainv, L);
+  int out = LAPACKE_dpotri(LAPACK_COL_MAJOR, 'L', n, Ainv->data, n);
+  for (int j = 0; j < n; ++j) {
+    for (int i = j; i < n; ++i) {
+      double aij = alpha * Ainv->data[i + j * n];
+      Ainv->data[i + j * n] = aij;
+      Ainv->data[j + i * n] = aij;
+    }
+  }
+  return out;
+}
+
+static int blas_Multiply(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB, double alpha,
+                         double beta) {
+  CBLAS_TRANSPOSE transA = tA ? CblasTrans : CblasNoTrans;
+  CBLAS_TRANSPOSE transB = tB ? CblasTrans : CblasNoTrans;
+  if (B->cols == 1) {
+    cblas_dgemv(CblasColMajor, transA, A->rows, A->cols, alpha, A->data, A->rows, B->data,
+                1, beta, C->data, 1);
+  } else {
+    int m = tA ? A->cols : A->rows;
+    int n = tB ? B->rows : B->cols;
+    int k = tA ? A->rows : A->cols;
+    cblas_dgemm(CblasColMajor, transA, transB, m, n, k, alpha, A->data, A->rows, B->data,
+                B->rows, beta, C->data, C->rows);
   }
   return 0;
 }
 
-int MatrixCholeskyFactorizeWithInfo(Matrix* mat, CholeskyInfo* cholinfo) {
-  MATRIX_LATIME_START;
-  int out = 0;
-  switch (MatrixGetLinearAlgebraLibrary()) {
-#ifdef USE_EIGEN
-    case libEigen:
-      FreeFactorization(cholinfo);  // free the previous factorization since the code below
-                                    // allocates a new one
-      out = eigen_CholeskyFactorize(mat->rows, mat->data, &cholinfo->fact);
-      cholinfo->lib = 'E';
-      cholinfo->is_freed = false;
-      break;
+static int blas_MultiplyLower(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB,
+                              double alpha, double beta) {
+  // GEMMT isn't part of the reference BLAS, so update one panel of columns at a time,
+  // starting at the diagonal
+  const int nb = 32;
+  int n = C->rows;
+  int k = tA ? A->rows : A->cols;
+  CBLAS_TRANSPOSE transA = tA ? CblasTrans : CblasNoTrans;
+  CBLAS_TRANSPOSE transB = tB ? CblasTrans : CblasNoTrans;
+  for (int j = 0; j < n; j += nb) {
+    int jb = n - j < nb ? n - j : nb;
+    const double* a = A->data + (tA ? j * A->rows : j);
+    const double* b = B->data + (tB ? j : j * B->rows);
+    cblas_dgemm(CblasColMajor, transA, transB, n - j, jb, k, alpha, a, A->rows, b, B->rows,
+                beta, C->data + j + j * n, n);
+  }
+  return 0;
+}
+
+static int blas_MultiplySymmetricResult(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB,
+                                        double alpha, double beta) {
+  blas_MultiplyLower(A, B, C, tA, tB, alpha, beta);
+  return clap_CopyLowerToUpper(C);
+}
+
+static int blas_MultiplyStacked(Matrix* A, Matrix* B, Matrix* C, int num_blocks,
+                                double alpha, double beta) {
+  return MatrixMultiplyStackedGeneric(blas_Multiply, A, B, C, num_blocks, alpha, beta);
+}
+
+static int blas_TransposeMultiplySum(Matrix* A, Matrix* B, int num_terms, Matrix* C,
+                                     double alpha, double beta) {
+  return MatrixTransposeMultiplySumGeneric(blas_Multiply, A, B, num_terms, C, alpha, beta);
+}
+
+static int blas_SymmetricTransposeMultiplySum(Matrix* A, Matrix* B, int num_terms,
+                                              Matrix* C, double alpha, double beta) {
+  return MatrixSymmetricTransposeMultiplySumGeneric(blas_MultiplyLower, A, B, num_terms, C,
+                                                    alpha, beta);
+}
+
+static int blas_SymmetricRank2kUpdate(Matrix* A, Matrix* B, Matrix* C, double alpha,
+                                      double beta) {
+  cblas_dsyr2k(CblasColMajor, CblasLower, CblasTrans, C->rows, A->rows, alpha, A->data,
+               A->rows, B->data, B->rows, beta, C->data, C->rows);
+  return clap_CopyLowerToUpper(C);
+}
+
+static int blas_SymmetricMultiply(Matrix* Asym, Matrix* B, Matrix* C, double alpha,
+                                  double beta) {
+  if (B->cols == 1) {
+    cblas_dsymv(CblasColMajor, CblasLower, Asym->rows, alpha, Asym->data, Asym->rows,
+                B->data, 1, beta, C->data, 1);
+  } else {
+    cblas_dsymm(CblasColMajor, CblasLeft, CblasLower, Asym->rows, C->cols, alpha,
+                Asym->data, Asym->rows, B->data, B->rows, beta, C->data, C->rows);
+  }
+  return 0;
+}
+
+/*
+ * Batched operations. The LAPACKE "work" routines skip the NaN checks of the high-level
+ * interface, which cost as much as the factorization itself for small blocks.
+ */
+static int blas_FactorizeNoCheck(Matrix* A) {
+  return LAPACKE_dpotrf_work(LAPACK_COL_MAJOR, 'L', A->rows, A->data, A->rows);
+}
+
+static int blas_CholeskyFactorizeBatched(Matrix* A, int count, int* info) {
+  return MatrixCholeskyFactorizeBatchedGeneric(blas_FactorizeNoCheck, A, count, info);
+}
+
+#ifdef USE_MKL
+/*
+ * MKL has grouped GEMM and TRSM routines, which process a whole batch in a single call.
+ * Consecutive blocks with the same shape are put in the same group.
+ */
+static int blas_TriangularSolveBatched(Matrix* L, Matrix* b, int count,
+                                       CBLAS_TRANSPOSE trans) {
+  CBLAS_SIDE side[kMatrixBatchChunk];
+  CBLAS_UPLO uplo[kMatrixBatchChunk];
+  CBLAS_TRANSPOSE transL[kMatrixBatchChunk];
+  CBLAS_DIAG diag[kMatrixBatchChunk];
+  MKL_INT m[kMatrixBatchChunk];
+  MKL_INT n[kMatrixBatchChunk];
+  double alpha[kMatrixBatchChunk];
+  MKL_INT group_size[kMatrixBatchChunk];
+  const double* l[kMatrixBatchChunk];
+  double* x[kMatrixBatchChunk];
+  for (int start = 0; start < count; start += kMatrixBatchChunk) {
+    int len = count - start < kMatrixBatchChunk ? count - start : kMatrixBatchChunk;
+    int num_groups = 0;
+    for (int i = 0; i < len; ++i) {
+      Matrix* Li = L + start + i;
+      Matrix* bi = b + start + i;
+      int g = num_groups - 1;
+      if (g < 0 || m[g] != bi->rows || n[g] != bi->cols) {
+        g = num_groups++;
+        side[g] = CblasLeft;
+        uplo[g] = CblasLower;
+        transL[g] = trans;
+        diag[g] = CblasNonUnit;
+        m[g] = bi->rows;
+        n[g] = bi->cols;
+        alpha[g] = 1.0;
+        group_size[g] = 0;
+      }
+      ++group_size[g];
+      l[i] = Li->data;
+      x[i] = bi->data;
+    }
+    // Every block in a group has the same size, so the leading dimensions equal m
+    cblas_dtrsm_batch(CblasColMajor, side, uplo, transL, diag, m, n, alpha, l, m, x, m,
+                      num_groups, group_size);
+  }
+  return 0;
+}
+
+static int blas_CholeskySolveBatched(Matrix* L, Matrix* b, int count) {
+  blas_TriangularSolveBatched(L, b, count, CblasNoTrans);
+  return blas_TriangularSolveBatched(L, b, count, CblasTrans);
+}
+
+static int blas_MultiplyBatched(Matrix* A, Matrix* B, Matrix* C, int count, bool tA,
+                                bool tB, double alpha, double beta) {
+  CBLAS_TRANSPOSE transA[kMatrixBatchChunk];
+  CBLAS_TRANSPOSE transB[kMatrixBatchChunk];
+  MKL_INT m[kMatrixBatchChunk];
+  MKL_INT n[kMatrixBatchChunk];
+  MKL_INT k[kMatrixBatchChunk];
+  MKL_INT lda[kMatrixBatchChunk];
+  MKL_INT ldb[kMatrixBatchChunk];
+  MKL_INT ldc[kMatrixBatchChunk];
+  double alphas[kMatrixBatchChunk];
+  double betas[kMatrixBatchChunk];
+  MKL_INT group_size[kMatrixBatchChunk];
+  const double* a[kMatrixBatchChunk];
+  const double* b[kMatrixBatchChunk];
+  double* c[kMatrixBatchChunk];
+  for (int start = 0; start < count; start += kMatrixBatchChunk) {
+    int len = count - start < kMatrixBatchChunk ? count - start : kMatrixBatchChunk;
+    int num_groups = 0;
+    for (int i = 0; i < len; ++i) {
+      Matrix* Ai = A + start + i;
+      Matrix* Bi = B + start + i;
+      Matrix* Ci = C + start + i;
+      int mi = tA ? Ai->cols : Ai->rows;
+      int ni = tB ? Bi->rows : Bi->cols;
+      int ki = tA ? Ai->rows : Ai->cols;
+      int g = num_groups - 1;
+      if (g < 0 || m[g] != mi || n[g] != ni || k[g] != ki || lda[g] != Ai->rows ||
+          ldb[g] != Bi->rows || ldc[g] != Ci->rows) {
+        g = num_groups++;
+        transA[g] = tA ? CblasTrans : CblasNoTrans;
+        transB[g] = tB ? CblasTrans : CblasNoTrans;
+        m[g] = mi;
+        n[g] = ni;
+        k[g] = ki;
+        lda[g] = Ai->rows;
+        ldb[g] = Bi->rows;
+        ldc[g] = Ci->rows;
+        alphas[g] = alpha;
+        betas[g] = beta;
+        group_size[g] = 0;
+      }
+      ++group_size[g];
+      a[i] = Ai->data;
+      b[i] = Bi->data;
+      c[i] = Ci->data;
+    }
+    cblas_dgemm_batch(CblasColMajor, transA, transB, m, n, k, alphas, a, lda, b, ldb, betas,
+                      c, ldc, num_groups, group_size);
+  }
+  return 0;
+}
+#else
+static int blas_SolveNoCheck(Matrix* L, Matrix* b) {
+  return LAPACKE_dpotrs_work(LAPACK_COL_MAJOR, 'L', L->rows, b->cols, L->data, L->rows,
+                             b->data, b->rows);
+}
+
+static int blas_CholeskySolveBatched(Matrix* L, Matrix* b, int count) {
+  return MatrixCholeskySolveBatchedGeneric(blas_SolveNoCheck, L, b, count);
+}
+
+// The reference CBLAS interface has no batched GEMM, so use the internal kernels, which
+// don't have the per-call overhead of the library
+static int blas_MultiplyBatched(Matrix* A, Matrix* B, Matrix* C, int count, bool tA,
+                                bool tB, double alpha, double beta) {
+  return clap_MultiplyBatched(A, B, C, count, tA, tB, alpha, beta);
+}
 #endif
 
+static const MatrixBackend kBLASBackend = {
+    'B',
+    clap_MatrixAddition,
+    blas_Factorize,
+    blas_Solve,
+    blas_Inverse,
+    blas_Multiply,
+    blas_MultiplySymmetricResult,
+    blas_MultiplyStacked,
+    blas_TransposeMultiplySum,
+    blas_SymmetricTransposeMultiplySum,
+    blas_SymmetricRank2kUpdate,
+    blas_SymmetricMultiply,
+    blas_CholeskyFactorizeBatched,
+    blas_CholeskySolveBatched,
+    blas_MultiplyBatched,
+};
+#endif
+
+/*
+ * Library selection
+ */
+
+// Tables for each library, indexed by MatrixLinearAlgebraLibrary. NULL if not available.
+static const MatrixBackend* const kBackends[kNumLinearAlgebraLibraries] = {
 #ifdef USE_BLAS
-    case libBLAS:
-      out = LAPACKE_dpotrf(LAPACK_COL_MAJOR, 'L', mat->rows, mat->data, mat->rows);
-      cholinfo->lib = 'B';
-      break;
+    [libBLAS] = &kBLASBackend,
+#endif
+#ifdef USE_MKL
+    [libMKL] = &kBLASBackend,
 #endif
+#ifdef USE_EIGEN
+    [libEigen] = &kEigenBackend,
+#endif
+    [libInternal] = &kInternalBackend,
+};
 
-    default:
-      cholinfo->lib = 'I';  // Internal
-      cholinfo->is_freed = true;
-      out = clap_CholeskyFactorize(mat);
-      cholinfo->success = out == 0;
-      break;
-  }
+static enum MatrixLinearAlgebraLibrary la_library = RSLQR_LINALG_DEFAULT;
+static enum MatrixLinearAlgebraLibrary la_operation_library[kNumLinearAlgebraOperations] = {
+    RSLQR_LINALG_DEFAULT, RSLQR_LINALG_DEFAULT, RSLQR_LINALG_DEFAULT, RSLQR_LINALG_DEFAULT};
+
+// Libraries selected for the calling thread, overriding la_operation_library if not NULL
+static _Thread_local const enum MatrixLinearAlgebraLibrary* la_thread_library = NULL;
+
+static inline const MatrixBackend* MatrixGetBackend(enum MatrixLinearAlgebraOperation op) {
+  if (la_thread_library) return kBackends[la_thread_library[op]];
+  return kBackends[la_operation_library[op]];
+}
+
+/*
+ * Public API
+ */
+CholeskyInfo DefaultCholeskyInfo() {
+  CholeskyInfo cholinfo = {'\0', 0, '\0', NULL};
+  return cholinfo;
+}
+
+void FreeFactorization(CholeskyInfo* cholinfo) {
+  // All of the libraries factorize in place, so there is nothing extra to free
+  cholinfo->fact = NULL;
+}
+
+int MatrixAddition(Matrix* A, Matrix* B, double alpha) {
+  if (!A || !B) return -1;
+  return MatrixGetBackend(laAddition)->addition(A, B, alpha);
+}
+
+int MatrixCholeskyFactorizeWithInfo(Matrix* mat, CholeskyInfo* cholinfo) {
+  MATRIX_LATIME_START;
+  const MatrixBackend* backend = MatrixGetBackend(laCholesky);
+  int out = backend->cholesky_factorize(mat);
   MATRIX_LATIME_STOP;
+  cholinfo->lib = backend->id;
   cholinfo->success = out;
   cholinfo->uplo = 'L';
   return out;
 }
 
-int MatrixCholeskySolveWithInfo(Matrix* A, Matrix* b, CholeskyInfo* cholinfo) {
-  MATRIX_LATIME_START;
-  int out = 0;
-  switch (MatrixGetLinearAlgebraLibrary()) {
-#ifdef USE_EIGEN
-    case libEigen:
-      eigen_CholeskySolve(A->rows, b->cols, cholinfo->fact, b->data);
-      break;
-#endif
+int MatrixCholeskyFactorizeParallel(Matrix* mat, CholeskyInfo* cholinfo) {
+  int out = clap_CholeskyFactorizeTeam(mat);
+#pragma omp single nowait
+  {
+    cholinfo->lib = kInternalBackend.id;
+    cholinfo->success = out;
+    cholinfo->uplo = 'L';
+  }
+  return out;
+}
 
-#ifdef USE_BLAS
-    case libBLAS:
-      (void)cholinfo;
-      out = LAPACKE_dpotrs(LAPACK_COL_MAJOR, 'L', A->rows, b->cols, A->data, A->rows,
-                           b->data, b->rows);
-      break;
-#endif
+int MatrixCholeskySolveWithInfo(Matrix* A, Matrix* b, CholeskyInfo* cholinfo) {
+  (void)cholinfo;
+  return MatrixCholeskySolve(A, b);
+}
 
-    default:
-      (void)cholinfo;
-      clap_CholeskySolve(A, b);
-      break;
-  }
+int MatrixCholeskyInverseWithInfo(Matrix* A, Matrix* Ainv, double alpha,
+                                  CholeskyInfo* cholinfo) {
+  if (cholinfo && cholinfo->success != 0) return -1;
+  MATRIX_LATIME_START;
+  int out = MatrixGetBackend(laCholesky)->cholesky_inverse(A, Ainv, alpha);
   MATRIX_LATIME_STOP;
   return out;
 }
 
+int MatrixInverseSolve(Matrix* Ainv, Matrix* b, Matrix* work) {
+  if (!Ainv || !b || !work) return -1;
+  if (MatrixNumElements(work) < MatrixNumElements(b)) return -1;
+  Matrix x = {b->rows, b->cols, work->data};
+  MatrixCopy(&x, b);
+  MatrixMultiply(Ainv, &x, b, false, false, 1.0, 0.0);
+  return 0;
+}
+
 int MatrixCholeskyFactorize(Matrix* mat) {
   MATRIX_LATIME_START;
-  int out = 0;
-  switch (MatrixGetLinearAlgebraLibrary()) {
-#ifdef USE_BLAS
-    case libBLAS:
-      out = LAPACKE_dpotrf(LAPACK_COL_MAJOR, 'L', mat->rows, mat->data, mat->rows);
-      break;
-#endif
-
-    default:
-      out = clap_CholeskyFactorize(mat);
-      break;
-  }
+  int out = MatrixGetBackend(laCholesky)->cholesky_factorize(mat);
   MATRIX_LATIME_STOP;
   return out;
 }
 
 int MatrixCholeskySolve(Matrix* A, Matrix* b) {
   MATRIX_LATIME_START;
-  int out = 0;
-  switch (MatrixGetLinearAlgebraLibrary()) {
-#ifdef USE_BLAS
-    case libBLAS:
-      out = LAPACKE_dpotrs(LAPACK_COL_MAJOR, 'L', A->rows, b->cols, A->data, A->rows,
-                           b->data, b->rows);
-      break;
-#endif
-
-    default:
-      out = clap_CholeskySolve(A, b);
-      break;
-  }
+  int out = MatrixGetBackend(laCholesky)->cholesky_solve(A, b);
   MATRIX_LATIME_STOP;
   return out;
 }
@@ -153,63 +666,88 @@ int MatrixCholeskySolve(Matrix* A, Matrix* b) {
 void MatrixMultiply(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB, double alpha,
                     double beta) {
   MATRIX_LATIME_START;
-  // printf("Multiplying matrices of size (%d, %d), (%d, %d), (%d, %d)\n", A->rows, A->cols,
-  // B->rows, B->cols, C->rows, C->cols);
-  switch (MatrixGetLinearAlgebraLibrary()) {
-#ifdef USE_EIGEN
-    case libEigen: {
-      int m = tA ? A->cols : A->rows;
-      int n = tA ? A->rows : A->cols;
-      int k = tB ? B->rows : B->cols;
-      eigen_MatrixMultiply(m, n, k, A->data, B->data, C->data, tA, tB, alpha, beta);
-    } break;
-#endif
+  MatrixGetBackend(laMultiply)->multiply(A, B, C, tA, tB, alpha, beta);
+  MATRIX_LATIME_STOP;
+}
 
-#ifdef USE_BLAS
-    case libBLAS: {
-      CBLAS_TRANSPOSE transA = tA ? CblasTrans : CblasNoTrans;
-      CBLAS_TRANSPOSE transB = tB ? CblasTrans : CblasNoTrans;
-      if (B->cols == 1) {
-        cblas_dgemv(CblasColMajor, transA, A->rows, A->cols, alpha, A->data, A->rows,
-                    B->data, 1, beta, C->data, 1);
-      } else {
-        int m = tA ? A->cols : A->rows;
-        int n = tB ? B->rows : B->cols;
-        int k = tA ? A->rows : A->cols;
-        cblas_dgemm(CblasColMajor, transA, transB, m, n, k, alpha, A->data, A->rows,
-                    B->data, B->rows, beta, C->data, C->rows);
-      }
-    } break;
-#endif
+void MatrixMultiplyStacked(Matrix* A, Matrix* B, Matrix* C, int num_blocks, double alpha,
+                           double beta) {
+  MATRIX_LATIME_START;
+  MatrixGetBackend(laMultiply)->multiply_stacked(A, B, C, num_blocks, alpha, beta);
+  MATRIX_LATIME_STOP;
+}
 
-    default: {
-      clap_MatrixMultiply(A, B, C, tA, tB, alpha, beta);
-    } break;
-  }
+void MatrixTransposeMultiplySum(Matrix* A, Matrix* B, int num_terms, Matrix* C,
+                                double alpha, double beta) {
+  MATRIX_LATIME_START;
+  MatrixGetBackend(laMultiply)->transpose_multiply_sum(A, B, num_terms, C, alpha, beta);
+  MATRIX_LATIME_STOP;
+}
+
+void MatrixMultiplySymmetricResult(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB,
+                                   double alpha, double beta) {
+  MATRIX_LATIME_START;
+  MatrixGetBackend(laMultiply)->multiply_symmetric_result(A, B, C, tA, tB, alpha, beta);
+  MATRIX_LATIME_STOP;
+}
+
+void MatrixSymmetricTransposeMultiplySum(Matrix* A, Matrix* B, int num_terms, Matrix* C,
+                                         double alpha, double beta) {
+  MATRIX_LATIME_START;
+  const MatrixBackend* backend = MatrixGetBackend(laMultiply);
+  backend->symmetric_transpose_multiply_sum(A, B, num_terms, C, alpha, beta);
+  MATRIX_LATIME_STOP;
+}
+
+void MatrixSymmetricRank2kUpdate(Matrix* A, Matrix* B, Matrix* C, double alpha,
+                                 double beta) {
+  MATRIX_LATIME_START;
+  MatrixGetBackend(laMultiply)->symmetric_rank2k_update(A, B, C, alpha, beta);
   MATRIX_LATIME_STOP;
 }
 
 void MatrixSymmetricMultiply(Matrix* Asym, Matrix* B, Matrix* C, double alpha,
                              double beta) {
   MATRIX_LATIME_START;
-  switch (MatrixGetLinearAlgebraLibrary()) {
-    case libBLAS: {
-#ifdef USE_BLAS
-      CBLAS_SIDE blasside = CblasLeft;
-      if (B->cols == 1) {
-        cblas_dsymv(CblasColMajor, CblasLower, Asym->rows, alpha, Asym->data, Asym->rows,
-                    B->data, 1.0, beta, C->data, 1.0);
-      } else {
-        cblas_dsymm(CblasColMajor, blasside, CblasLower, Asym->rows, C->cols, alpha,
-                    Asym->data, Asym->rows, B->data, B->rows, beta, C->data, C->rows);
-      }
-#endif
-    } break;
-    default: {
-      clap_SymmetricMatrixMultiply(Asym, B, C, alpha, beta);
-    } break;
+  MatrixGetBackend(laSymmetricMultiply)->symmetric_multiply(Asym, B, C, alpha, beta);
+  MATRIX_LATIME_STOP;
+}
+
+int MatrixCholeskyFactorizeBatched(Matrix* A, int count, CholeskyInfo** cholinfo) {
+  if (!A || count < 0) return -1;
+  int info[kMatrixBatchChunk];
+  const MatrixBackend* backend = MatrixGetBackend(laCholesky);
+  int out = 0;
+  MATRIX_LATIME_START;
+  for (int start = 0; start < count; start += kMatrixBatchChunk) {
+    int len = count - start < kMatrixBatchChunk ? count - start : kMatrixBatchChunk;
+    if (backend->cholesky_factorize_batched(A + start, len, info) != 0) out = -1;
+    for (int i = 0; cholinfo && i < len; ++i) {
+      CholeskyInfo* ci = cholinfo[start + i];
+      if (!ci) continue;
+      ci->lib = backend->id;
+      ci->success = info[i];
+      ci->uplo = 'L';
+    }
   }
   MATRIX_LATIME_STOP;
+  return out;
+}
+
+int MatrixCholeskySolveBatched(Matrix* L, Matrix* b, int count) {
+  if (!L || !b || count < 0) return -1;
+  MATRIX_LATIME_START;
+  int out = MatrixGetBackend(laCholesky)->cholesky_solve_batched(L, b, count);
+  MATRIX_LATIME_STOP;
+  return out;
+}
+
+void MatrixMultiplyBatched(Matrix* A, Matrix* B, Matrix* C, int count, bool tA, bool tB,
+                           double alpha, double beta) {
+  if (!A || !B || !C || count <= 0) return;
+  MATRIX_LATIME_START;
+  MatrixGetBackend(laMultiply)->multiply_batched(A, B, C, count, tA, tB, alpha, beta);
+  MATRIX_LATIME_STOP;
 }
 
 void MatrixCopyDiagonal(Matrix* dest, Matrix* src) {
@@ -220,37 +758,109 @@ void MatrixCopyDiagonal(Matrix* dest, Matrix* src) {
   }
 }
 
-enum MatrixLinearAlgebraLibrary MatrixGetLinearAlgebraLibrary() {
-  if (kUseClap) {
-    return libInternal;
-  } else if (kUseEigen) {
-    return libEigen;
-  } else if (kUseMKL) {
-    return libMKL;
-  } else if (kUseBLAS) {
-    return libBLAS;
-  } else {
-    return libInternal;
+int MatrixDiagonalSolve(Matrix* d, Matrix* b) {
+  if (!d || !b) return -1;
+  MATRIX_LATIME_START;
+  int n = b->rows;
+  int out = 0;
+  for (int i = 0; i < n; ++i) {
+    if (!(d->data[i] > 0.0)) out = -1;
+  }
+  for (int j = 0; j < b->cols; ++j) {
+    double* bj = b->data + j * n;
+    for (int i = 0; i < n; ++i) {
+      bj[i] /= d->data[i];
+    }
   }
+  MATRIX_LATIME_STOP;
+  return out;
 }
 
-void MatrixPrintLinearAlgebraLibrary() {
-  printf("Using ");
-  switch (MatrixGetLinearAlgebraLibrary()) {
+void MatrixDiagonalMultiply(Matrix* d, Matrix* B, Matrix* C, double alpha, double beta) {
+  if (!d || !B || !C) return;
+  MATRIX_LATIME_START;
+  int n = B->rows;
+  for (int j = 0; j < B->cols; ++j) {
+    double* bj = B->data + j * n;
+    double* cj = C->data + j * n;
+    for (int i = 0; i < n; ++i) {
+      cj[i] = alpha * d->data[i] * bj[i] + beta * cj[i];
+    }
+  }
+  MATRIX_LATIME_STOP;
+}
+
+bool MatrixHasLinearAlgebraLibrary(enum MatrixLinearAlgebraLibrary lib) {
+  if (lib < 0 || lib >= kNumLinearAlgebraLibraries) return false;
+  return kBackends[lib] != NULL;
+}
+
+int MatrixSetLinearAlgebraLibrary(enum MatrixLinearAlgebraLibrary lib) {
+  if (!MatrixHasLinearAlgebraLibrary(lib)) return -1;
+  la_library = lib;
+  for (int op = 0; op < kNumLinearAlgebraOperations; ++op) {
+    la_operation_library[op] = lib;
+  }
+  return 0;
+}
+
+int MatrixSetOperationLibrary(enum MatrixLinearAlgebraOperation op,
+                              enum MatrixLinearAlgebraLibrary lib) {
+  if (op < 0 || op >= kNumLinearAlgebraOperations) return -1;
+  if (!MatrixHasLinearAlgebraLibrary(lib)) return -1;
+  la_operation_library[op] = lib;
+  return 0;
+}
+
+enum MatrixLinearAlgebraLibrary MatrixGetLinearAlgebraLibrary() { return la_library; }
+
+enum MatrixLinearAlgebraLibrary MatrixGetOperationLibrary(
+    enum MatrixLinearAlgebraOperation op) {
+  if (op < 0 || op >= kNumLinearAlgebraOperations) return la_library;
+  if (la_thread_library) return la_thread_library[op];
+  return la_operation_library[op];
+}
+
+const enum MatrixLinearAlgebraLibrary* MatrixSetThreadOperationLibraries(
+    const enum MatrixLinearAlgebraLibrary* libraries) {
+  const enum MatrixLinearAlgebraLibrary* prev = la_thread_library;
+  if (libraries) {
+    for (int op = 0; op < kNumLinearAlgebraOperations; ++op) {
+      if (!MatrixHasLinearAlgebraLibrary(libraries[op])) return prev;
+    }
+  }
+  la_thread_library = libraries;
+  return prev;
+}
+
+const enum MatrixLinearAlgebraLibrary* MatrixGetThreadOperationLibraries() {
+  return la_thread_library;
+}
+
+static const char* MatrixGetLibraryName(enum MatrixLinearAlgebraLibrary lib) {
+  switch (lib) {
     case libEigen:
-      printf("C++ Eigen Library.\n");
-      break;
+      return "C++ Eigen Library";
     case libInternal:
-      printf("Internal Linear Algebra Library.\n");
-      break;
+      return "Internal Linear Algebra Library";
     case libMKL:
-      printf("Intel MKL Library.\n");
-      break;
+      return "Intel MKL Library";
     case libBLAS:
-      printf("Open-source BLAS library.\n");
-      break;
+      return "Open-source BLAS library";
     default:
-      printf("Not a recognized library.\n");
-      break;
+      return "Not a recognized library";
+  }
+}
+
+void MatrixPrintLinearAlgebraLibrary() {
+  printf("Using %s.\n", MatrixGetLibraryName(la_library));
+  const char* opnames[kNumLinearAlgebraOperations] = {"addition", "multiplication",
+                                                      "symmetric multiplication",
+                                                      "Cholesky factorization"};
+  for (int op = 0; op < kNumLinearAlgebraOperations; ++op) {
+    enum MatrixLinearAlgebraLibrary lib = MatrixGetOperationLibrary(op);
+    if (lib != la_library) {
+      printf("  Using %s for %s.\n", MatrixGetLibraryName(lib), opnames[op]);
+    }
   }
 }
@@ -14,48 +14,23 @@
 
 #include "matrix.h"
 
-#ifdef USE_MKL
-static const int kUseMKL = 1;
-#else
-static const int kUseMKL = 0;
-#endif
-
-#ifdef USE_EIGEN
-static const int kUseEigen = 1;
-#else
-static const int kUseEigen = 0;
-#endif
-
-#ifdef USE_CLAP
-static const int kUseClap = 1;
-#else
-static const int kUseClap = 0;
-#endif
-
-#ifdef USE_BLAS
-static const int kUseBLAS = 1;
-#else
-static const int kUseBLAS = 0;
-#endif
-
 /**
  * @brief Stores info about a Cholesky decomposition
  *
  * Thie provides information about a Cholesky decomposition, including which
  * trianglular portion the data is stored in, if the decomposition was successful,
- * which library was used to compute the decomposition, as well as a pointer to any
- * storage that library needed in addition to the matrix itself.
+ * and which library was used to compute the decomposition. All of the libraries
+ * factorize the matrix in place, so no storage is needed beyond the matrix itself.
  *
  * ## Methods
  * - DefaultCholeskyInfo()
  * - FreeFactorization()
  */
 typedef struct {
-  char uplo;     ///< 'L' or 'U'
-  int success;   ///< 0 if success, failure otherwise
-  char lib;      ///< 'B' for BLAS, 'E' for eigen, 'I' for internal
-  void* fact;    ///< pointer to Eigen data
-  int is_freed;  ///< has the Eigen data been freed
+  char uplo;    ///< 'L' or 'U'
+  int success;  ///< 0 if success, failure otherwise
+  char lib;     ///< 'B' for BLAS or MKL, 'E' for eigen, 'I' for internal
+  void* fact;   ///< pointer to any extra library storage. Currently always NULL.
 } CholeskyInfo;
 
 /**
@@ -68,8 +43,8 @@ CholeskyInfo DefaultCholeskyInfo();
 /**
  * @brief Frees any data stored by the external library.
  *
- * This should be called prior to creating a new factorization, which will
- * allocate new memory for the factorization.
+ * Since every library factorizes in place, this currently only resets the bookkeeping
+ * in @p cholinfo. Kept so that callers don't depend on how the factorization is stored.
  *
  * @param cholinfo
  */
@@ -78,12 +53,28 @@ void FreeFactorization(CholeskyInfo* cholinfo);
 /**
  * @brief List of supported linear algebra libraries
  *
+ * Which ones were built into the library can be checked with
+ * MatrixHasLinearAlgebraLibrary().
  */
 enum MatrixLinearAlgebraLibrary {
   libBLAS = 0,
   libMKL = 1,
   libEigen = 2,
   libInternal = 3,
+  kNumLinearAlgebraLibraries = 4,
+};
+
+/**
+ * @brief Groups of operations whose library can be selected independently
+ *
+ * @see MatrixSetOperationLibrary()
+ */
+enum MatrixLinearAlgebraOperation {
+  laAddition = 0,           ///< MatrixAddition()
+  laMultiply = 1,           ///< All general and symmetric-result matrix products
+  laSymmetricMultiply = 2,  ///< MatrixSymmetricMultiply()
+  laCholesky = 3,           ///< Cholesky factorization, solves, and inverses
+  kNumLinearAlgebraOperations = 4,
 };
 
 /**
@@ -123,6 +114,20 @@ int MatrixCholeskyFactorize(Matrix* mat);
  */
 int MatrixCholeskyFactorizeWithInfo(Matrix* mat, CholeskyInfo* cholinfo);
 
+/**
+ * @brief Compute the Cholesky decomposition of a large matrix using every thread of a team
+ *
+ * Splits the blocked factorization of @p mat between the threads of the enclosing OpenMP
+ * parallel region (see clap_CholeskyFactorizeTeam()), and must be called by all of them.
+ * Always uses the internal kernels. The factor is stored in the lower triangle of
+ * @p mat, like the other libraries, so it can be used with MatrixCholeskySolve().
+ *
+ * @param[inout] mat A square, positive-definite matrix
+ * @param cholinfo   CholeskyInfo object for storing info about the factorization
+ * @return           0 if successful
+ */
+int MatrixCholeskyFactorizeParallel(Matrix* mat, CholeskyInfo* cholinfo);
+
 /**
  * @brief Solve a linear system using a precomputed Cholesky factorization
  *
@@ -145,6 +150,39 @@ int MatrixCholeskySolve(Matrix* A, Matrix* b);
  */
 int MatrixCholeskySolveWithInfo(Matrix* A, Matrix* b, CholeskyInfo* cholinfo);
 
+/**
+ * @brief Compute a scaled inverse using a precomputed Cholesky factorization
+ *
+ * Computes \f$ \alpha A^{-1} \f$, which is equivalent to solving against
+ * \f$ \alpha I \f$ but avoids forming and solving against the identity when the
+ * library supports it.
+ *
+ * @param[in]  A        A square matrix whose Cholesky decomposition has already been
+ *                      computed.
+ * @param[out] Ainv     Output matrix of the same size as @p A. Must not alias @p A.
+ * @param[in]  alpha    Scaling applied to the inverse.
+ * @param[in]  cholinfo Information about the precomputed Cholesky factorization in @p A.
+ *                      May be NULL.
+ * @return 0 if successful, -1 if @p cholinfo reports that the factorization failed, in
+ *         which case @p Ainv is left unchanged.
+ */
+int MatrixCholeskyInverseWithInfo(Matrix* A, Matrix* Ainv, double alpha,
+                                  CholeskyInfo* cholinfo);
+
+/**
+ * @brief Solve a linear system using a precomputed inverse
+ *
+ * Overwrites @p b with \f$ A^{-1} b \f$, computed as a matrix multiplication with
+ * @p Ainv (e.g. from MatrixCholeskyInverseWithInfo()). Since the product can't be computed
+ * in place, @p b is first copied into @p work.
+ *
+ * @param[in]    Ainv Inverse of the (n,n) system matrix
+ * @param[inout] b    The (n,m) right-hand-side. Stores the solution upon completion.
+ * @param[in]    work Scratch storage with at least as many elements as @p b
+ * @return 0 if successful
+ */
+int MatrixInverseSolve(Matrix* Ainv, Matrix* b, Matrix* work);
+
 /**
  * @brief Matrix multiplication with scaling
  *
@@ -165,6 +203,111 @@ int MatrixCholeskySolveWithInfo(Matrix* A, Matrix* b, CholeskyInfo* cholinfo);
 void MatrixMultiply(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB, double alpha,
                     double beta);
 
+/**
+ * @brief Multiply a vertical stack of blocks by a common right-hand side
+ *
+ * Perform the computation
+ * \f[
+ * \begin{bmatrix} C_0 \\ \vdots \\ C_{N-1} \end{bmatrix} =
+ * \alpha \begin{bmatrix} A_0 \\ \vdots \\ A_{N-1} \end{bmatrix} B +
+ * \beta \begin{bmatrix} C_0 \\ \vdots \\ C_{N-1} \end{bmatrix}
+ * \f]
+ *
+ * where each block is stored as its own column-major matrix. The internal routines
+ * perform the whole update in a single call. Other libraries multiply the blocks one at
+ * a time.
+ *
+ * @param[in]    A          Array of @p num_blocks matrices of size (m_i,k)
+ * @param[in]    B          Right-hand side of size (k,n)
+ * @param[inout] C          Array of @p num_blocks output matrices of size (m_i,n)
+ * @param[in]    num_blocks Number of blocks \f$ N \f$ in the stack
+ * @param[in]    alpha      scalar on the product
+ * @param[in]    beta       scalar on the \f$ C \f$ term.
+ */
+void MatrixMultiplyStacked(Matrix* A, Matrix* B, Matrix* C, int num_blocks, double alpha,
+                           double beta);
+
+/**
+ * @brief Sum of transposed matrix products
+ *
+ * Perform the computation
+ * \f[
+ * C = \alpha \sum_{i=0}^{N-1} A_i^T B_i + \beta C
+ * \f]
+ *
+ * The internal routines fuse all of the products into a single kernel. Other libraries
+ * compute the products one at a time.
+ *
+ * @param[in]    A         Array of @p num_terms matrices of size (k_i,m)
+ * @param[in]    B         Array of @p num_terms matrices of size (k_i,n)
+ * @param[in]    num_terms Number of products \f$ N \f$ in the sum
+ * @param[inout] C         Output matrix of size (m,n)
+ * @param[in]    alpha     scalar on the sum of products
+ * @param[in]    beta      scalar on the \f$ C \f$ term.
+ */
+void MatrixTransposeMultiplySum(Matrix* A, Matrix* B, int num_terms, Matrix* C,
+                                double alpha, double beta);
+
+/**
+ * @brief Matrix multiplication with a symmetric result
+ *
+ * Perform the computation
+ * \f[
+ * C = \alpha \text{op}(A) \text{op}(B) + \beta C
+ * \f]
+ *
+ * where the product is known to be symmetric, such as \f$ B^T P B \f$ for a symmetric
+ * \f$ P \f$. Only the lower triangle is computed, after which it is copied to the upper
+ * triangle. The BLAS backend updates the lower triangle one panel of columns at a time,
+ * since GEMMT is not part of the reference BLAS.
+ *
+ * @param[in]    A     Matrix of size (n,k), or (k,n) if transposed
+ * @param[in]    B     Matrix of size (k,n), or (n,k) if transposed
+ * @param[inout] C     Symmetric output matrix of size (n,n)
+ * @param[in]    tA    Should @p A be transposed
+ * @param[in]    tB    Should @p B be transposed
+ * @param[in]    alpha scalar on the product
+ * @param[in]    beta  scalar on the \f$ C \f$ term.
+ */
+void MatrixMultiplySymmetricResult(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB,
+                                   double alpha, double beta);
+
+/**
+ * @brief Sum of transposed matrix products with a symmetric result
+ *
+ * Same as MatrixTransposeMultiplySum(), but only the lower triangle of @p C is computed
+ * and then copied to the upper triangle. The individual products do not need to be
+ * symmetric, as long as their sum is (e.g. the Schur complement of a symmetric system).
+ *
+ * @param[in]    A         Array of @p num_terms matrices of size (k_i,n)
+ * @param[in]    B         Array of @p num_terms matrices of size (k_i,n)
+ * @param[in]    num_terms Number of products \f$ N \f$ in the sum
+ * @param[inout] C         Symmetric output matrix of size (n,n)
+ * @param[in]    alpha     scalar on the sum of products
+ * @param[in]    beta      scalar on the \f$ C \f$ term.
+ */
+void MatrixSymmetricTransposeMultiplySum(Matrix* A, Matrix* B, int num_terms, Matrix* C,
+                                         double alpha, double beta);
+
+/**
+ * @brief Symmetric rank-2k update
+ *
+ * Perform the computation
+ * \f[
+ * C = \alpha (A^T B + B^T A) + \beta C
+ * \f]
+ *
+ * Equivalent to the BLAS syr2k routine, which is used for the BLAS backend.
+ *
+ * @param[in]    A     Matrix of size (k,n)
+ * @param[in]    B     Matrix of size (k,n)
+ * @param[inout] C     Symmetric output matrix of size (n,n)
+ * @param[in]    alpha scalar on the sum of products
+ * @param[in]    beta  scalar on the \f$ C \f$ term.
+ */
+void MatrixSymmetricRank2kUpdate(Matrix* A, Matrix* B, Matrix* C, double alpha,
+                                 double beta);
+
 /**
  * @brief Matrix multiplication with a symmetric matrix A
  *
@@ -182,6 +325,55 @@ void MatrixMultiply(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB, double al
  */
 void MatrixSymmetricMultiply(Matrix* Asym, Matrix* B, Matrix* C, double alpha, double beta);
 
+/**
+ * @brief Compute the Cholesky decomposition of a batch of matrices
+ *
+ * Equivalent to calling MatrixCholeskyFactorizeWithInfo() on each matrix, but issues
+ * the whole batch to the library at once, amortizing the per-call overhead of external
+ * libraries over many small blocks.
+ *
+ * @param[inout] A        Array of @p count square, positive-definite matrices
+ * @param[in]    count    Number of matrices in the batch
+ * @param[out]   cholinfo Optional array of @p count pointers, each of which (if not NULL)
+ *                        stores the info about the corresponding factorization
+ * @return 0 if every factorization was successful
+ */
+int MatrixCholeskyFactorizeBatched(Matrix* A, int count, CholeskyInfo** cholinfo);
+
+/**
+ * @brief Solve a batch of linear systems using precomputed Cholesky factorizations
+ *
+ * Equivalent to calling MatrixCholeskySolve() on each pair of matrices.
+ *
+ * @param[in]    L     Array of @p count factorized matrices
+ * @param[inout] b     Array of @p count right-hand sides. Stores the solutions.
+ * @param[in]    count Number of systems in the batch
+ * @return 0 if successful
+ */
+int MatrixCholeskySolveBatched(Matrix* L, Matrix* b, int count);
+
+/**
+ * @brief Matrix multiplication of a batch of independent blocks
+ *
+ * Performs \f$ C_i = \alpha A_i B_i + \beta C_i \f$ for each block in the batch,
+ * equivalent to calling MatrixMultiply() on each block. The blocks may have different
+ * sizes, but none of the outputs may alias another block in the batch.
+ *
+ * MKL processes the batch with a single grouped GEMM call. The open-source BLAS has no
+ * batched interface, so the internal routines are used instead.
+ *
+ * @param[in]    A     Array of @p count matrices
+ * @param[in]    B     Array of @p count matrices
+ * @param[inout] C     Array of @p count output matrices
+ * @param[in]    count Number of products in the batch
+ * @param[in]    tA    Whether to transpose each A
+ * @param[in]    tB    Whether to transpose each B
+ * @param[in]    alpha Scaling on the products
+ * @param[in]    beta  Scaling on the outputs
+ */
+void MatrixMultiplyBatched(Matrix* A, Matrix* B, Matrix* C, int count, bool tA, bool tB,
+                           double alpha, double beta);
+
 /**
  * @brief Copy just the diagonal element of @p src to the diagonal of @p dest
  *
@@ -190,15 +382,117 @@ void MatrixSymmetricMultiply(Matrix* Asym, Matrix* B, Matrix* C, double alpha, d
  */
 void MatrixCopyDiagonal(Matrix* dest, Matrix* src);
 
+/**
+ * @brief Solve a linear system with a diagonal matrix
+ *
+ * Scales row \f$ i \f$ of @p b by \f$ 1 / d_i \f$, overwriting @p b with the solution
+ * of \f$ \text{diag}(d) x = b \f$.
+ *
+ * @param[in]    d Diagonal of the matrix, stored as a vector of length n.
+ * @param[inout] b The (n,m) right-hand-side. Stores the solution upon completion.
+ * @return 0 if successful, -1 if any of the diagonal elements are not positive.
+ */
+int MatrixDiagonalSolve(Matrix* d, Matrix* b);
+
+/**
+ * @brief Matrix multiplication with a diagonal matrix
+ *
+ * \f[
+ * C = \alpha \text{diag}(d) B + \beta C
+ * \f]
+ *
+ * @param[in]    d     Diagonal of the matrix, stored as a vector of length n.
+ * @param[in]    B     (n,m) matrix
+ * @param[inout] C     (n,m) output matrix
+ * @param[in]    alpha scalar on the product
+ * @param[in]    beta  scalar on @p C
+ */
+void MatrixDiagonalMultiply(Matrix* d, Matrix* B, Matrix* C, double alpha, double beta);
+
+/**
+ * @brief Check if a linear algebra library was built into the library
+ *
+ * The internal library is always available. Eigen is available whenever it was found
+ * at build time, and BLAS or MKL when selected with `RSLQR_LINALG_LIBRARY`.
+ *
+ * @param lib Linear algebra library
+ * @return true if @p lib can be selected with MatrixSetLinearAlgebraLibrary()
+ */
+bool MatrixHasLinearAlgebraLibrary(enum MatrixLinearAlgebraLibrary lib);
+
+/**
+ * @brief Use a linear algebra library for all operations
+ *
+ * The default is the library selected by `RSLQR_LINALG_LIBRARY` at build time. This
+ * setting is global and isn't thread-safe: don't change it while a solve is running.
+ *
+ * @param lib Linear algebra library
+ * @return 0 if successful, -1 if @p lib isn't available.
+ */
+int MatrixSetLinearAlgebraLibrary(enum MatrixLinearAlgebraLibrary lib);
+
+/**
+ * @brief Use a linear algebra library for a single group of operations
+ *
+ * Overrides the library set by MatrixSetLinearAlgebraLibrary() for @p op, e.g. to use
+ * Eigen for the matrix products and the internal library for the Cholesky
+ * factorizations. All libraries store the Cholesky factor in place in the lower
+ * triangle, so they can be mixed freely.
+ *
+ * @param op  Group of operations
+ * @param lib Linear algebra library
+ * @return 0 if successful, -1 if @p op is invalid or @p lib isn't available.
+ */
+int MatrixSetOperationLibrary(enum MatrixLinearAlgebraOperation op,
+                              enum MatrixLinearAlgebraLibrary lib);
+
 /**
  * @brief Get the linear algebra library currently being used.
  *
- * Its value is determined by the build system and cannot be changed at runtime.
+ * This is the library last set with MatrixSetLinearAlgebraLibrary(). Individual
+ * operations may be overridden with MatrixSetOperationLibrary().
  *
  * @return The linear algebra library being used by the system.
  */
 enum MatrixLinearAlgebraLibrary MatrixGetLinearAlgebraLibrary();
 
+/**
+ * @brief Get the linear algebra library used for a group of operations
+ *
+ * Includes the libraries selected for the calling thread with
+ * MatrixSetThreadOperationLibraries().
+ *
+ * @param op Group of operations
+ * @return The linear algebra library used for @p op
+ */
+enum MatrixLinearAlgebraLibrary MatrixGetOperationLibrary(
+    enum MatrixLinearAlgebraOperation op);
+
+/**
+ * @brief Use a set of libraries for the operations called from the calling thread
+ *
+ * Overrides the libraries set with MatrixSetLinearAlgebraLibrary() and
+ * MatrixSetOperationLibrary() on the calling thread only, so solvers running at the
+ * same time can each use their own libraries without changing the global setting.
+ *
+ * The array isn't copied, so it must stay valid until it is replaced. Nothing is
+ * changed if one of the libraries isn't available.
+ *
+ * @param libraries Library for each MatrixLinearAlgebraOperation, or NULL to go back to
+ *                  the global setting
+ * @return The previous libraries of the calling thread, to restore them afterwards
+ */
+const enum MatrixLinearAlgebraLibrary* MatrixSetThreadOperationLibraries(
+    const enum MatrixLinearAlgebraLibrary* libraries);
+
+/**
+ * @brief Get the libraries selected for the calling thread
+ *
+ * @return The libraries set with MatrixSetThreadOperationLibraries() on the calling
+ *         thread, or NULL if it uses the global setting
+ */
+const enum MatrixLinearAlgebraLibrary* MatrixGetThreadOperationLibraries();
+
 /**
  * @brief Prints which linear algebra library is being used to stdout
  *
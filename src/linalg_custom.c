@@ -1,6 +1,8 @@
 #include "linalg_custom.h"
 
+#include "linalg_kernels.h"
 #include "math.h"
+#include "omp.h"
 #include "stdio.h"
 
 int clap_MatrixAddition(Matrix* A, Matrix* B, double alpha) {
@@ -17,26 +19,176 @@ int clap_MatrixScale(Matrix* A, double alpha) {
   return 0;
 }
 
+/*
+ * Kernel selection
+ *
+ * The matrix products and Cholesky routines are compiled once for each instruction set
+ * supported by the compiler (see linalg_kernels.h). The widest one supported by the host
+ * CPU is selected when the library is loaded.
+ */
+static const ClapKernels* const clap_kISAKernels[clap_kNumKernelISAs] = {
+    [clap_kISAGeneric] = &clap_kernels_generic,
+#ifdef CLAP_HAVE_AVX2
+    [clap_kISAAVX2] = &clap_kernels_avx2,
+#endif
+#ifdef CLAP_HAVE_AVX512
+    [clap_kISAAVX512] = &clap_kernels_avx512,
+#endif
+};
+
+static enum ClapKernelISA clap_kernel_isa = clap_kISAGeneric;
+static const ClapKernels* clap_kernels = &clap_kernels_generic;
+
+bool clap_IsKernelISASupported(enum ClapKernelISA isa) {
+  if (isa < 0 || isa >= clap_kNumKernelISAs || !clap_kISAKernels[isa]) return false;
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+  switch (isa) {
+    case clap_kISAAVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case clap_kISAAVX512:
+      return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") &&
+             __builtin_cpu_supports("fma");
+    default:
+      return true;
+  }
+#else
+  return isa == clap_kISAGeneric;
+#endif
+}
+
+int clap_SetKernelISA(enum ClapKernelISA isa) {
+  if (!clap_IsKernelISASupported(isa)) return -1;
+  clap_kernel_isa = isa;
+  clap_kernels = clap_kISAKernels[isa];
+  return 0;
+}
+
+enum ClapKernelISA clap_GetKernelISA() { return clap_kernel_isa; }
+
+const char* clap_GetKernelISAName(enum ClapKernelISA isa) {
+  switch (isa) {
+    case clap_kISAGeneric:
+      return "generic";
+    case clap_kISAAVX2:
+      return "AVX2";
+    case clap_kISAAVX512:
+      return "AVX-512";
+    default:
+      return "unknown";
+  }
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((constructor))
+#endif
+static void clap_SelectKernelISA() {
+  for (int isa = clap_kNumKernelISAs - 1; isa > clap_kISAGeneric; --isa) {
+    if (clap_SetKernelISA(isa) == 0) return;
+  }
+}
+
+static void clap_Gemm(bool tA, bool tB, int m, int n, int k, double alpha, const double* a,
+                      int lda, const double* b, int ldb, double* c, int ldc) {
+  clap_kernels->gemm(tA, tB, m, n, k, alpha, a, lda, b, ldb, c, ldc, false);
+}
+
 int clap_MatrixMultiply(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB, double alpha,
                         double beta) {
-  int n, m;
-  if (tA) {
-    n = A->cols;
-    m = A->rows;
-  } else {
-    n = A->rows;
-    m = A->cols;
+  int m = tA ? A->cols : A->rows;
+  int n = tB ? B->rows : B->cols;
+  int k = tA ? A->rows : A->cols;
+
+  // C = beta * C
+  if (beta == 0.0) {
+    for (int i = 0; i < m * n; ++i) C->data[i] = 0.0;
+  } else if (beta != 1.0) {
+    clap_MatrixScale(C, beta);
   }
-  int p = tB ? B->rows : B->cols;
-  for (int i = 0; i < n; ++i) {
-    for (int j = 0; j < p; ++j) {
-      double* Cij = MatrixGetElement(C, i, j);
-      *Cij *= beta;
-      for (int k = 0; k < m; ++k) {
-        double Aik = *MatrixGetElementTranspose(A, i, k, tA);
-        double Bkj = *MatrixGetElementTranspose(B, k, j, tB);
-        *Cij += alpha * Aik * Bkj;
-      }
+
+  // A single column or the transpose of a single row are both contiguous vectors
+  if (n == 1) tB = false;
+
+  // C = alpha * op(A) * op(B) + C
+  clap_Gemm(tA, tB, m, n, k, alpha, A->data, A->rows, B->data, B->rows, C->data, C->rows);
+  return 0;
+}
+
+int clap_MatrixMultiplySymmetricResult(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB,
+                                       double alpha, double beta) {
+  int n = C->rows;
+  int k = tA ? A->rows : A->cols;
+
+  // C = beta * C, only the lower triangle is read below
+  for (int j = 0; j < n; ++j) {
+    double* cj = C->data + j * n;
+    for (int i = j; i < n; ++i) cj[i] = beta == 0.0 ? 0.0 : beta * cj[i];
+  }
+  if (n == 1) tB = false;
+  clap_kernels->gemm(tA, tB, n, n, k, alpha, A->data, A->rows, B->data, B->rows, C->data, n,
+                     true);
+  return clap_CopyLowerToUpper(C);
+}
+
+int clap_MatrixMultiplyStacked(Matrix* A, Matrix* B, Matrix* C, int num_blocks,
+                               double alpha, double beta) {
+  int n = B->cols;
+  int k = B->rows;
+  for (int i = 0; i < num_blocks; ++i) {
+    Matrix* Ai = A + i;
+    Matrix* Ci = C + i;
+    int m = Ci->rows;
+    if (beta == 0.0) {
+      for (int j = 0; j < m * n; ++j) Ci->data[j] = 0.0;
+    } else if (beta != 1.0) {
+      clap_MatrixScale(Ci, beta);
+    }
+    clap_Gemm(false, false, m, n, k, alpha, Ai->data, Ai->rows, B->data, k, Ci->data, m);
+  }
+  return 0;
+}
+
+static void clap_TransposeMultiplySum(Matrix* A, Matrix* B, int num_terms, Matrix* C,
+                                      double alpha, double beta, bool lower) {
+  int m = C->rows;
+  int n = C->cols;
+  if (beta == 0.0) {
+    for (int i = 0; i < m * n; ++i) C->data[i] = 0.0;
+  } else if (beta != 1.0) {
+    clap_MatrixScale(C, beta);
+  }
+  if (alpha == 0.0 || num_terms <= 0) return;
+
+  ClapDotTerm terms[kClapMaxDotTerms];
+  for (int t0 = 0; t0 < num_terms; t0 += kClapMaxDotTerms) {
+    int nterms = num_terms - t0 < kClapMaxDotTerms ? num_terms - t0 : kClapMaxDotTerms;
+    for (int t = 0; t < nterms; ++t) {
+      Matrix* At = A + t0 + t;
+      Matrix* Bt = B + t0 + t;
+      ClapDotTerm term = {At->data, At->rows, Bt->data, Bt->rows, At->rows};
+      terms[t] = term;
+    }
+    clap_kernels->gemm_dot_sum(m, n, nterms, terms, C->data, C->rows, lower, alpha);
+  }
+}
+
+int clap_MatrixTransposeMultiplySum(Matrix* A, Matrix* B, int num_terms, Matrix* C,
+                                    double alpha, double beta) {
+  clap_TransposeMultiplySum(A, B, num_terms, C, alpha, beta, false);
+  return 0;
+}
+
+int clap_MatrixSymmetricTransposeMultiplySum(Matrix* A, Matrix* B, int num_terms,
+                                             Matrix* C, double alpha, double beta) {
+  clap_TransposeMultiplySum(A, B, num_terms, C, alpha, beta, true);
+  return clap_CopyLowerToUpper(C);
+}
+
+int clap_CopyLowerToUpper(Matrix* A) {
+  int n = A->rows;
+  for (int j = 0; j < n; ++j) {
+    for (int i = j + 1; i < n; ++i) {
+      A->data[j + i * n] = A->data[i + j * n];
     }
   }
   return 0;
@@ -86,48 +238,79 @@ int clap_AddDiagonal(Matrix* A, double alpha) {
 }
 
 int clap_CholeskyFactorize(Matrix* A) {
+  return clap_kernels->cholesky(A->rows, A->data, A->rows);
+}
+
+/*
+ * Block size of clap_CholeskyFactorizeTeam(). Each step factors one diagonal block on a
+ * single thread, then splits the panel below it by blocks of rows and the trailing
+ * update by tiles.
+ */
+#define kClapTeamNB 64
+
+int clap_CholeskyFactorizeTeam(Matrix* A) {
   int n = A->rows;
-  for (int j = 0; j < n; ++j) {
-    for (int k = 0; k < j; ++k) {
-      for (int i = j; i < n; ++i) {
-        double* Aij = MatrixGetElement(A, i, j);
-        double Aik = *MatrixGetElement(A, i, k);
-        double Ajk = *MatrixGetElement(A, j, k);
-        *Aij -= Aik * Ajk;
-      }
+  int lda = A->rows;
+  double* a = A->data;
+  int info = clap_kCholeskySuccess;
+  for (int j = 0; j < n; j += kClapTeamNB) {
+    int jb = n - j < kClapTeamNB ? n - j : kClapTeamNB;
+    double* ajj = a + j + j * lda;
+#pragma omp single copyprivate(info)
+    { info = clap_kernels->cholesky(jb, ajj, lda); }
+    if (info != clap_kCholeskySuccess) {
+      return info;
     }
-    double Ajj = *MatrixGetElement(A, j, j);
-    if (Ajj <= 0) {
-      return clap_kCholeskyFail;
+
+    // Panel below the diagonal block: P = P / Ljj'
+    int m = n - j - jb;
+    int nblocks = (m + kClapTeamNB - 1) / kClapTeamNB;
+#pragma omp for schedule(static)
+    for (int blk = 0; blk < nblocks; ++blk) {
+      int i = j + jb + blk * kClapTeamNB;
+      int ib = n - i < kClapTeamNB ? n - i : kClapTeamNB;
+      clap_kernels->tri_solve_right(ib, jb, ajj, lda, a + i + j * lda, lda);
     }
-    double ajj = sqrt(Ajj);
 
-    for (int i = j; i < n; ++i) {
-      double* Aij = MatrixGetElement(A, i, j);
-      *Aij /= ajj;
+    // Trailing matrix: A22 -= P P', by tiles of its lower triangle
+    int ntiles = nblocks * (nblocks + 1) / 2;
+#pragma omp for schedule(dynamic)
+    for (int tile = 0; tile < ntiles; ++tile) {
+      int r = 0;
+      while ((r + 1) * (r + 2) / 2 <= tile) ++r;
+      int c = tile - r * (r + 1) / 2;
+      int i = j + jb + r * kClapTeamNB;
+      int k = j + jb + c * kClapTeamNB;
+      int ib = n - i < kClapTeamNB ? n - i : kClapTeamNB;
+      int kb = n - k < kClapTeamNB ? n - k : kClapTeamNB;
+      if (r != c) {
+        clap_kernels->gemm(false, true, ib, kb, jb, -1.0, a + i + j * lda, lda,
+                           a + k + j * lda, lda, a + i + k * lda, lda, false);
+      } else {
+        // Leave the upper triangle of the diagonal tiles untouched
+        double work[kClapTeamNB * kClapTeamNB];
+        for (int e = 0; e < ib * ib; ++e) work[e] = 0.0;
+        clap_kernels->gemm(false, true, ib, ib, jb, 1.0, a + i + j * lda, lda,
+                           a + i + j * lda, lda, work, ib, true);
+        for (int col = 0; col < ib; ++col) {
+          for (int row = col; row < ib; ++row) {
+            a[(i + row) + (i + col) * lda] -= work[row + col * ib];
+          }
+        }
+      }
     }
   }
-  return clap_kCholeskySuccess;
+  return info;
 }
 
 int clap_LowerTriBackSub(Matrix* L, Matrix* b, bool istransposed) {
-  int n = b->rows;
-  int m = b->cols;
-  for (int j_ = 0; j_ < n; ++j_) {
-    int j = istransposed ? n - j_ - 1 : j_;
-    for (int k = 0; k < m; ++k) {
-      double* xjk = MatrixGetElement(b, j, k);
-      double Ljj = *MatrixGetElement(L, j, j);
-      *xjk /= Ljj;
-
-      for (int i_ = j_ + 1; i_ < n; ++i_) {
-        int i = istransposed ? i_ - (j_ + 1) : i_;
-        double* xik = MatrixGetElement(b, i, k);
-        double Lij = *MatrixGetElementTranspose(L, i, j, istransposed);
-        *xik -= Lij * (*xjk);
-      }
-    }
-  }
+  clap_kernels->tri_solve(istransposed, b->rows, b->cols, L->data, L->rows, b->data,
+                          b->rows);
+  return 0;
+}
+
+int clap_CholeskyInverse(Matrix* L, Matrix* Ainv, double alpha) {
+  clap_kernels->cholesky_inverse(L->rows, L->data, Ainv->data, alpha);
   return 0;
 }
 
@@ -11,6 +11,8 @@
  * @{
  *
  */
+#pragma once
+
 #include "matrix.h"
 
 /**
@@ -27,6 +29,19 @@ static const int clap_kCholeskySuccess = 0;
  */
 static const int clap_kCholeskyFail = -1;
 
+/**
+ * @brief Instruction sets the internal kernels are compiled for
+ *
+ * The widest one supported by the CPU is selected automatically when the library is
+ * loaded. See clap_SetKernelISA().
+ */
+enum ClapKernelISA {
+  clap_kISAGeneric = 0,  ///< Portable C, vectorized by the compiler for the baseline ISA
+  clap_kISAAVX2 = 1,     ///< AVX2 and FMA
+  clap_kISAAVX512 = 2,   ///< AVX-512F, AVX2 and FMA
+  clap_kNumKernelISAs = 3,
+};
+
 /**
  * @brief Add two matrices of the same size, storing the result in @p B
  *
@@ -59,6 +74,11 @@ int clap_MatrixScale(Matrix* A, double alpha);
  * C = \alpha A B + \beta C
  * \f]
  *
+ * Uses cache-blocked, register-blocked micro-kernels (vectorized with AVX2/FMA when
+ * available), with separate paths for each combination of @p tA and @p tB and a
+ * matrix-vector fast path when the right-hand side has a single column.
+ * If @p beta is zero, @p C is overwritten without being read.
+ *
  * @param[in]    A     Matrix of size (m,n)
  * @param[in]    B     Matrix of size (n,p)
  * @param[inout] C     Output matrix of size (m,p)
@@ -71,6 +91,94 @@ int clap_MatrixScale(Matrix* A, double alpha);
 int clap_MatrixMultiply(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB, double alpha,
                         double beta);
 
+/**
+ * @brief Matrix multiplication with a symmetric result
+ *
+ * \f[
+ * C = \alpha \text{op}(A) \text{op}(B) + \beta C
+ * \f]
+ *
+ * for a product that is known to be symmetric, such as \f$ B^T P B \f$. Only the tiles
+ * touching the lower triangle of @p C are computed, after which the lower triangle is
+ * copied to the upper triangle, roughly halving the work of a general product.
+ *
+ * @param[in]    A     Matrix of size (n,k), or (k,n) if transposed
+ * @param[in]    B     Matrix of size (k,n), or (n,k) if transposed
+ * @param[inout] C     Symmetric output matrix of size (n,n)
+ * @param[in]    tA    Should @p A be transposed
+ * @param[in]    tB    Should @p B be transposed
+ * @param[in]    alpha scalar on the product
+ * @param[in]    beta  scalar on @p C, which must also be symmetric
+ * @return 0 if successful
+ */
+int clap_MatrixMultiplySymmetricResult(Matrix* A, Matrix* B, Matrix* C, bool tA, bool tB,
+                                       double alpha, double beta);
+
+/**
+ * @brief Multiply a stack of blocks by a common right-hand side
+ *
+ * \f[
+ * C_i = \alpha A_i B + \beta C_i \quad i = 0, \dots, N-1
+ * \f]
+ *
+ * @param[in]    A          Array of @p num_blocks matrices of size (m_i,k)
+ * @param[in]    B          Right-hand side of size (k,n)
+ * @param[inout] C          Array of @p num_blocks output matrices of size (m_i,n)
+ * @param[in]    num_blocks Number of blocks \f$ N \f$
+ * @param[in]    alpha      scalar on the products
+ * @param[in]    beta       scalar on the outputs
+ * @return 0 if successful
+ */
+int clap_MatrixMultiplyStacked(Matrix* A, Matrix* B, Matrix* C, int num_blocks,
+                               double alpha, double beta);
+
+/**
+ * @brief Sum of transposed matrix products
+ *
+ * \f[
+ * C = \alpha \sum_{i} A_i^T B_i + \beta C
+ * \f]
+ *
+ * All of the products are accumulated in registers before @p C is written, so @p C is
+ * only read and written once, regardless of the number of terms.
+ *
+ * @param[in]    A         Array of @p num_terms matrices of size (k_i,m)
+ * @param[in]    B         Array of @p num_terms matrices of size (k_i,n)
+ * @param[in]    num_terms Number of products in the sum
+ * @param[inout] C         Output matrix of size (m,n)
+ * @param[in]    alpha     scalar on the sum of products
+ * @param[in]    beta      scalar on @p C
+ * @return 0 if successful
+ */
+int clap_MatrixTransposeMultiplySum(Matrix* A, Matrix* B, int num_terms, Matrix* C,
+                                    double alpha, double beta);
+
+/**
+ * @brief Sum of transposed matrix products with a symmetric result
+ *
+ * Same as clap_MatrixTransposeMultiplySum(), but only computes the lower triangle of
+ * @p C and copies it to the upper triangle. The individual products need not be
+ * symmetric, as long as the total is.
+ *
+ * @param[in]    A         Array of @p num_terms matrices of size (k_i,n)
+ * @param[in]    B         Array of @p num_terms matrices of size (k_i,n)
+ * @param[in]    num_terms Number of products in the sum
+ * @param[inout] C         Symmetric output matrix of size (n,n)
+ * @param[in]    alpha     scalar on the sum of products
+ * @param[in]    beta      scalar on @p C
+ * @return 0 if successful
+ */
+int clap_MatrixSymmetricTransposeMultiplySum(Matrix* A, Matrix* B, int num_terms,
+                                             Matrix* C, double alpha, double beta);
+
+/**
+ * @brief Copy the strictly lower triangle of a square matrix to its upper triangle
+ *
+ * @param[inout] A Square matrix
+ * @return 0 if successful
+ */
+int clap_CopyLowerToUpper(Matrix* A);
+
 /**
  * @brief A shortcut to perform transposed matrix multiplication
  *
@@ -126,6 +234,22 @@ int clap_AddDiagonal(Matrix* A, double alpha);
  */
 int clap_CholeskyFactorize(Matrix* A);
 
+/**
+ * @brief Perform a Cholesky decomposition using every thread of an OpenMP team
+ *
+ * Same as clap_CholeskyFactorize(), but splits the work of factorizing a single large
+ * matrix across threads using a blocked, right-looking factorization: each diagonal block
+ * is factored by one thread, and the triangular solves for the panel below it and the
+ * update of the trailing matrix are divided between all the threads.
+ *
+ * Must be called by every thread of the enclosing parallel region, or outside of one.
+ * Only the lower triangle of @p A is modified.
+ *
+ * @param  A a square symmetric matrix
+ * @return clap_kCholeskySuccess if successful, and clap_kCholeskyFail if not.
+ */
+int clap_CholeskyFactorizeTeam(Matrix* A);
+
 /**
  * @brief Solve a linear system of equation with a precomputed Cholesky decomposition.
  *
@@ -137,6 +261,21 @@ int clap_CholeskyFactorize(Matrix* A);
  */
 int clap_CholeskySolve(Matrix* A, Matrix* b);
 
+/**
+ * @brief Compute a scaled inverse from a precomputed Cholesky decomposition.
+ *
+ * Computes \f$ \alpha A^{-1} = \alpha L^{-T} L^{-1} \f$, using the triangular
+ * structure of \f$ L^{-1} \f$. This takes about a third of the flops of a Cholesky solve
+ * against the identity matrix.
+ *
+ * @param[in]  A     A square matrix whose Cholesky decomposition is stored in the lower
+ *                   triangular portion of the matrix
+ * @param[out] Ainv  Output matrix of the same size as @p A. Must not alias @p A.
+ * @param[in]  alpha Scaling applied to the inverse.
+ * @return 0 if successful
+ */
+int clap_CholeskyInverse(Matrix* A, Matrix* Ainv, double alpha);
+
 /**
  * @brief Solve a linear system of equation for a lower triangular matrix
  *
@@ -158,4 +297,33 @@ int clap_CholeskySolve(Matrix* A, Matrix* b);
  */
 int clap_LowerTriBackSub(Matrix* L, Matrix* b, bool istransposed);
 
+/**
+ * @brief Check if the kernels for an instruction set can be used on this machine
+ *
+ * @param isa Instruction set
+ * @return true if the kernels were compiled for @p isa and the CPU supports it
+ */
+bool clap_IsKernelISASupported(enum ClapKernelISA isa);
+
+/**
+ * @brief Use the kernels compiled for a given instruction set
+ *
+ * Overrides the instruction set picked automatically when the library is loaded,
+ * e.g. to compare the kernels. Not thread-safe.
+ *
+ * @param isa Instruction set
+ * @return 0 if successful, -1 if @p isa isn't supported (see clap_IsKernelISASupported())
+ */
+int clap_SetKernelISA(enum ClapKernelISA isa);
+
+/**
+ * @brief Get the instruction set of the kernels currently being used
+ */
+enum ClapKernelISA clap_GetKernelISA();
+
+/**
+ * @brief Get a human-readable name for an instruction set, e.g. "AVX2"
+ */
+const char* clap_GetKernelISAName(enum ClapKernelISA isa);
+
 /**@} */
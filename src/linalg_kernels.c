@@ -0,0 +1,784 @@
+#include "linalg_kernels.h"
+
+#include <math.h>
+#include <stdint.h>
+
+#include "linalg_custom.h"
+
+/*
+ * This file is compiled once per instruction set (see src/CMakeLists.txt), with
+ * CLAP_KERNEL_ISA set to the suffix of the kernel table it defines. The AVX2 and
+ * AVX-512 builds use hand-written intrinsics, while the generic build relies on the
+ * compiler to vectorize the plain loops.
+ */
+#ifndef CLAP_KERNEL_ISA
+#define CLAP_KERNEL_ISA generic
+#endif
+
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__))
+#include <immintrin.h>
+#endif
+#if defined(__AVX512F__)
+#define CLAP_USE_AVX512
+#endif
+#if defined(__AVX2__) && defined(__FMA__)
+#define CLAP_USE_AVX2
+#endif
+
+/*
+ * General matrix multiplication
+ *
+ * The product is computed in cache blocks of kClapGemmKC along the inner dimension, each
+ * of which is broken into register blocks handled by one of two micro-kernels:
+ *
+ * - an "axpy" kernel that accumulates an (MR,NR) block of C from columns of the left
+ *   operand and broadcasted elements of the right operand. Used when the rows of the
+ *   left operand are contiguous (A*B, A*B', and B*A for A'*B').
+ * - a "dot" kernel that computes a (4,2) block of C from inner products of contiguous
+ *   columns. Used for A'*B, which is the most common product in the rsLQR solver.
+ *
+ * Both kernels have AVX-512 and AVX2/FMA versions, and fall back to plain loops
+ * otherwise.
+ */
+#define kClapGemmMR 8
+#define kClapGemmNR 4
+#define kClapGemmKC 256
+
+#ifdef CLAP_USE_AVX2
+static inline __m256i clap_RowMask(int nrows) {
+  static const int64_t masks[5][4] = {
+      {0, 0, 0, 0}, {-1, 0, 0, 0}, {-1, -1, 0, 0}, {-1, -1, -1, 0}, {-1, -1, -1, -1}};
+  if (nrows < 0) nrows = 0;
+  if (nrows > 4) nrows = 4;
+  return _mm256_loadu_si256((const __m256i*)masks[nrows]);
+}
+
+// Horizontal sum of 4 vectors: returns [sum(v0), sum(v1), sum(v2), sum(v3)]
+static inline __m256d clap_HorizontalSum4(__m256d v0, __m256d v1, __m256d v2, __m256d v3) {
+  __m256d s01 = _mm256_hadd_pd(v0, v1);
+  __m256d s23 = _mm256_hadd_pd(v2, v3);
+  __m256d lo = _mm256_permute2f128_pd(s01, s23, 0x20);
+  __m256d hi = _mm256_permute2f128_pd(s01, s23, 0x31);
+  return _mm256_add_pd(lo, hi);
+}
+
+// Adds alpha * [acc0; acc1] to the first mr elements of c
+static inline void clap_StoreColumn(__m256d acc0, __m256d acc1, int mr, double* c,
+                                    double alpha) {
+  __m256d valpha = _mm256_set1_pd(alpha);
+  __m256i m0 = clap_RowMask(mr);
+  __m256d c0 = _mm256_maskload_pd(c, m0);
+  _mm256_maskstore_pd(c, m0, _mm256_fmadd_pd(valpha, acc0, c0));
+  if (mr > 4) {
+    __m256i m1 = clap_RowMask(mr - 4);
+    __m256d c1 = _mm256_maskload_pd(c + 4, m1);
+    _mm256_maskstore_pd(c + 4, m1, _mm256_fmadd_pd(valpha, acc1, c1));
+  }
+}
+
+// Adds alpha * [acc0; acc1] to the first mr elements of a row of C, with stride ldc
+static inline void clap_StoreRow(__m256d acc0, __m256d acc1, int mr, double* c, int ldc,
+                                 double alpha) {
+  double buf[kClapGemmMR];
+  _mm256_storeu_pd(buf, acc0);
+  _mm256_storeu_pd(buf + 4, acc1);
+  for (int r = 0; r < mr; ++r) {
+    c[r * ldc] += alpha * buf[r];
+  }
+}
+#endif
+
+#ifdef CLAP_USE_AVX512
+// Mask for the first n of 8 lanes
+static inline __mmask8 clap_LaneMask(int n) {
+  if (n <= 0) return 0;
+  if (n >= 8) return 0xFF;
+  return (__mmask8)((1u << n) - 1);
+}
+
+// Adds alpha * acc to the first mr elements of c
+static inline void clap_StoreColumn512(__m512d acc, __mmask8 mask, double* c,
+                                       double alpha) {
+  __m512d c0 = _mm512_maskz_loadu_pd(mask, c);
+  _mm512_mask_storeu_pd(c, mask, _mm512_fmadd_pd(_mm512_set1_pd(alpha), acc, c0));
+}
+
+// Adds alpha * acc to the first mr elements of a row of C, with stride ldc
+static inline void clap_StoreRow512(__m512d acc, int mr, double* c, int ldc,
+                                    double alpha) {
+  double buf[kClapGemmMR];
+  _mm512_storeu_pd(buf, acc);
+  for (int r = 0; r < mr; ++r) {
+    c[r * ldc] += alpha * buf[r];
+  }
+}
+#endif
+
+/*
+ * Computes the (mr,nr) block of L*R, where L(r,k) = a[r + k * lda] and
+ * R(k,j) = b[k * bsk + j * bsj], and adds alpha times the result to C.
+ * If tC is true, the block is added to the transpose of C.
+ */
+static void clap_GemmKernelAxpy(int mr, int nr, int kc, const double* a, int lda,
+                                const double* b, int bsk, int bsj, double* c, int ldc,
+                                bool tC, double alpha) {
+#if defined(CLAP_USE_AVX512)
+  // All kClapGemmMR rows fit in a single register
+  __mmask8 m = clap_LaneMask(mr);
+  if (nr == kClapGemmNR) {
+    __m512d c0 = _mm512_setzero_pd();
+    __m512d c1 = _mm512_setzero_pd();
+    __m512d c2 = _mm512_setzero_pd();
+    __m512d c3 = _mm512_setzero_pd();
+    for (int k = 0; k < kc; ++k) {
+      const double* bk = b + k * bsk;
+      __m512d ak = _mm512_maskz_loadu_pd(m, a + k * lda);
+      c0 = _mm512_fmadd_pd(ak, _mm512_set1_pd(bk[0]), c0);
+      c1 = _mm512_fmadd_pd(ak, _mm512_set1_pd(bk[bsj]), c1);
+      c2 = _mm512_fmadd_pd(ak, _mm512_set1_pd(bk[2 * bsj]), c2);
+      c3 = _mm512_fmadd_pd(ak, _mm512_set1_pd(bk[3 * bsj]), c3);
+    }
+    if (tC) {
+      clap_StoreRow512(c0, mr, c + 0, ldc, alpha);
+      clap_StoreRow512(c1, mr, c + 1, ldc, alpha);
+      clap_StoreRow512(c2, mr, c + 2, ldc, alpha);
+      clap_StoreRow512(c3, mr, c + 3, ldc, alpha);
+    } else {
+      clap_StoreColumn512(c0, m, c + 0 * ldc, alpha);
+      clap_StoreColumn512(c1, m, c + 1 * ldc, alpha);
+      clap_StoreColumn512(c2, m, c + 2 * ldc, alpha);
+      clap_StoreColumn512(c3, m, c + 3 * ldc, alpha);
+    }
+  } else {
+    // Column tail: one column at a time
+    for (int j = 0; j < nr; ++j) {
+      __m512d cj = _mm512_setzero_pd();
+      const double* bj = b + j * bsj;
+      for (int k = 0; k < kc; ++k) {
+        __m512d ak = _mm512_maskz_loadu_pd(m, a + k * lda);
+        cj = _mm512_fmadd_pd(ak, _mm512_set1_pd(bj[k * bsk]), cj);
+      }
+      if (tC) {
+        clap_StoreRow512(cj, mr, c + j, ldc, alpha);
+      } else {
+        clap_StoreColumn512(cj, m, c + j * ldc, alpha);
+      }
+    }
+  }
+#elif defined(CLAP_USE_AVX2)
+  __m256i m0 = clap_RowMask(mr);
+  __m256i m1 = clap_RowMask(mr - 4);
+  if (nr == kClapGemmNR) {
+    __m256d c00 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd();
+    __m256d c01 = _mm256_setzero_pd();
+    __m256d c11 = _mm256_setzero_pd();
+    __m256d c02 = _mm256_setzero_pd();
+    __m256d c12 = _mm256_setzero_pd();
+    __m256d c03 = _mm256_setzero_pd();
+    __m256d c13 = _mm256_setzero_pd();
+    for (int k = 0; k < kc; ++k) {
+      const double* ak = a + k * lda;
+      const double* bk = b + k * bsk;
+      __m256d a0 = _mm256_maskload_pd(ak, m0);
+      __m256d a1 = _mm256_maskload_pd(ak + 4, m1);
+      __m256d bj = _mm256_broadcast_sd(bk);
+      c00 = _mm256_fmadd_pd(a0, bj, c00);
+      c10 = _mm256_fmadd_pd(a1, bj, c10);
+      bj = _mm256_broadcast_sd(bk + bsj);
+      c01 = _mm256_fmadd_pd(a0, bj, c01);
+      c11 = _mm256_fmadd_pd(a1, bj, c11);
+      bj = _mm256_broadcast_sd(bk + 2 * bsj);
+      c02 = _mm256_fmadd_pd(a0, bj, c02);
+      c12 = _mm256_fmadd_pd(a1, bj, c12);
+      bj = _mm256_broadcast_sd(bk + 3 * bsj);
+      c03 = _mm256_fmadd_pd(a0, bj, c03);
+      c13 = _mm256_fmadd_pd(a1, bj, c13);
+    }
+    if (tC) {
+      clap_StoreRow(c00, c10, mr, c + 0, ldc, alpha);
+      clap_StoreRow(c01, c11, mr, c + 1, ldc, alpha);
+      clap_StoreRow(c02, c12, mr, c + 2, ldc, alpha);
+      clap_StoreRow(c03, c13, mr, c + 3, ldc, alpha);
+    } else {
+      clap_StoreColumn(c00, c10, mr, c + 0 * ldc, alpha);
+      clap_StoreColumn(c01, c11, mr, c + 1 * ldc, alpha);
+      clap_StoreColumn(c02, c12, mr, c + 2 * ldc, alpha);
+      clap_StoreColumn(c03, c13, mr, c + 3 * ldc, alpha);
+    }
+  } else {
+    // Column tail: one column at a time
+    for (int j = 0; j < nr; ++j) {
+      __m256d c0 = _mm256_setzero_pd();
+      __m256d c1 = _mm256_setzero_pd();
+      const double* bj = b + j * bsj;
+      for (int k = 0; k < kc; ++k) {
+        const double* ak = a + k * lda;
+        __m256d bkj = _mm256_broadcast_sd(bj + k * bsk);
+        c0 = _mm256_fmadd_pd(_mm256_maskload_pd(ak, m0), bkj, c0);
+        c1 = _mm256_fmadd_pd(_mm256_maskload_pd(ak + 4, m1), bkj, c1);
+      }
+      if (tC) {
+        clap_StoreRow(c0, c1, mr, c + j, ldc, alpha);
+      } else {
+        clap_StoreColumn(c0, c1, mr, c + j * ldc, alpha);
+      }
+    }
+  }
+#else
+  double acc[kClapGemmMR * kClapGemmNR] = {0};
+  for (int k = 0; k < kc; ++k) {
+    for (int j = 0; j < nr; ++j) {
+      double bkj = b[k * bsk + j * bsj];
+      for (int r = 0; r < mr; ++r) {
+        acc[r + j * kClapGemmMR] += a[r + k * lda] * bkj;
+      }
+    }
+  }
+  for (int j = 0; j < nr; ++j) {
+    for (int r = 0; r < mr; ++r) {
+      double* cij = tC ? c + j + r * ldc : c + r + j * ldc;
+      *cij += alpha * acc[r + j * kClapGemmMR];
+    }
+  }
+#endif
+}
+
+/*
+ * Computes the (mr,nr) block starting at (i,j) of the sum of L'*R over all terms, for
+ * mr <= 4 and nr <= 2, and adds alpha times the result to C. All the terms are
+ * accumulated in registers before C is touched.
+ */
+static void clap_GemmKernelDot(int mr, int nr, int nterms, const ClapDotTerm* terms, int i,
+                               int j, double* c, int ldc, double alpha) {
+#if defined(CLAP_USE_AVX512)
+  __m512d c00 = _mm512_setzero_pd();
+  __m512d c10 = _mm512_setzero_pd();
+  __m512d c20 = _mm512_setzero_pd();
+  __m512d c30 = _mm512_setzero_pd();
+  __m512d c01 = _mm512_setzero_pd();
+  __m512d c11 = _mm512_setzero_pd();
+  __m512d c21 = _mm512_setzero_pd();
+  __m512d c31 = _mm512_setzero_pd();
+  for (int t = 0; t < nterms; ++t) {
+    // Point any unused columns at the first one and discard the result
+    int lda = terms[t].lda;
+    int ldb = terms[t].ldb;
+    int kc = terms[t].k;
+    const double* a0 = terms[t].a + i * lda;
+    const double* a1 = mr > 1 ? a0 + lda : a0;
+    const double* a2 = mr > 2 ? a0 + 2 * lda : a0;
+    const double* a3 = mr > 3 ? a0 + 3 * lda : a0;
+    const double* b0 = terms[t].b + j * ldb;
+    const double* b1 = nr > 1 ? b0 + ldb : b0;
+    for (int k = 0; k < kc; k += 8) {
+      __mmask8 mk = clap_LaneMask(kc - k);
+      __m512d vb0 = _mm512_maskz_loadu_pd(mk, b0 + k);
+      __m512d vb1 = _mm512_maskz_loadu_pd(mk, b1 + k);
+      __m512d va = _mm512_maskz_loadu_pd(mk, a0 + k);
+      c00 = _mm512_fmadd_pd(va, vb0, c00);
+      c01 = _mm512_fmadd_pd(va, vb1, c01);
+      va = _mm512_maskz_loadu_pd(mk, a1 + k);
+      c10 = _mm512_fmadd_pd(va, vb0, c10);
+      c11 = _mm512_fmadd_pd(va, vb1, c11);
+      va = _mm512_maskz_loadu_pd(mk, a2 + k);
+      c20 = _mm512_fmadd_pd(va, vb0, c20);
+      c21 = _mm512_fmadd_pd(va, vb1, c21);
+      va = _mm512_maskz_loadu_pd(mk, a3 + k);
+      c30 = _mm512_fmadd_pd(va, vb0, c30);
+      c31 = _mm512_fmadd_pd(va, vb1, c31);
+    }
+  }
+  double sum0[4] = {_mm512_reduce_add_pd(c00), _mm512_reduce_add_pd(c10),
+                    _mm512_reduce_add_pd(c20), _mm512_reduce_add_pd(c30)};
+  for (int r = 0; r < mr; ++r) c[r] += alpha * sum0[r];
+  if (nr > 1) {
+    double sum1[4] = {_mm512_reduce_add_pd(c01), _mm512_reduce_add_pd(c11),
+                      _mm512_reduce_add_pd(c21), _mm512_reduce_add_pd(c31)};
+    for (int r = 0; r < mr; ++r) c[r + ldc] += alpha * sum1[r];
+  }
+#elif defined(CLAP_USE_AVX2)
+  __m256d c00 = _mm256_setzero_pd();
+  __m256d c10 = _mm256_setzero_pd();
+  __m256d c20 = _mm256_setzero_pd();
+  __m256d c30 = _mm256_setzero_pd();
+  __m256d c01 = _mm256_setzero_pd();
+  __m256d c11 = _mm256_setzero_pd();
+  __m256d c21 = _mm256_setzero_pd();
+  __m256d c31 = _mm256_setzero_pd();
+  for (int t = 0; t < nterms; ++t) {
+    // Point any unused columns at the first one and discard the result
+    int lda = terms[t].lda;
+    int ldb = terms[t].ldb;
+    int kc = terms[t].k;
+    const double* a0 = terms[t].a + i * lda;
+    const double* a1 = mr > 1 ? a0 + lda : a0;
+    const double* a2 = mr > 2 ? a0 + 2 * lda : a0;
+    const double* a3 = mr > 3 ? a0 + 3 * lda : a0;
+    const double* b0 = terms[t].b + j * ldb;
+    const double* b1 = nr > 1 ? b0 + ldb : b0;
+    int k = 0;
+    for (; k + 4 <= kc; k += 4) {
+      __m256d vb0 = _mm256_loadu_pd(b0 + k);
+      __m256d vb1 = _mm256_loadu_pd(b1 + k);
+      __m256d va = _mm256_loadu_pd(a0 + k);
+      c00 = _mm256_fmadd_pd(va, vb0, c00);
+      c01 = _mm256_fmadd_pd(va, vb1, c01);
+      va = _mm256_loadu_pd(a1 + k);
+      c10 = _mm256_fmadd_pd(va, vb0, c10);
+      c11 = _mm256_fmadd_pd(va, vb1, c11);
+      va = _mm256_loadu_pd(a2 + k);
+      c20 = _mm256_fmadd_pd(va, vb0, c20);
+      c21 = _mm256_fmadd_pd(va, vb1, c21);
+      va = _mm256_loadu_pd(a3 + k);
+      c30 = _mm256_fmadd_pd(va, vb0, c30);
+      c31 = _mm256_fmadd_pd(va, vb1, c31);
+    }
+    if (k < kc) {
+      __m256i mk = clap_RowMask(kc - k);
+      __m256d vb0 = _mm256_maskload_pd(b0 + k, mk);
+      __m256d vb1 = _mm256_maskload_pd(b1 + k, mk);
+      __m256d va = _mm256_maskload_pd(a0 + k, mk);
+      c00 = _mm256_fmadd_pd(va, vb0, c00);
+      c01 = _mm256_fmadd_pd(va, vb1, c01);
+      va = _mm256_maskload_pd(a1 + k, mk);
+      c10 = _mm256_fmadd_pd(va, vb0, c10);
+      c11 = _mm256_fmadd_pd(va, vb1, c11);
+      va = _mm256_maskload_pd(a2 + k, mk);
+      c20 = _mm256_fmadd_pd(va, vb0, c20);
+      c21 = _mm256_fmadd_pd(va, vb1, c21);
+      va = _mm256_maskload_pd(a3 + k, mk);
+      c30 = _mm256_fmadd_pd(va, vb0, c30);
+      c31 = _mm256_fmadd_pd(va, vb1, c31);
+    }
+  }
+  __m256d zero = _mm256_setzero_pd();
+  clap_StoreColumn(clap_HorizontalSum4(c00, c10, c20, c30), zero, mr, c, alpha);
+  if (nr > 1) {
+    clap_StoreColumn(clap_HorizontalSum4(c01, c11, c21, c31), zero, mr, c + ldc, alpha);
+  }
+#else
+  for (int jj = 0; jj < nr; ++jj) {
+    for (int r = 0; r < mr; ++r) {
+      double sum = 0.0;
+      for (int t = 0; t < nterms; ++t) {
+        const double* ar = terms[t].a + (i + r) * terms[t].lda;
+        const double* bj = terms[t].b + (j + jj) * terms[t].ldb;
+        for (int k = 0; k < terms[t].k; ++k) {
+          sum += ar[k] * bj[k];
+        }
+      }
+      c[r + jj * ldc] += alpha * sum;
+    }
+  }
+#endif
+}
+
+/*
+ * Returns true if the (mr,nr) tile of the product starting at (i,j) can be skipped when
+ * only the lower triangle of C is needed. If tC is true the tile is stored transposed,
+ * so it is the upper triangle of the product that is needed.
+ */
+static inline bool clap_SkipTile(int i, int j, int mr, int nr, bool tC, bool lower) {
+  if (!lower) return false;
+  return tC ? i >= j + nr : i + mr <= j;
+}
+
+/*
+ * Adds alpha * L * R to C (or its transpose if tC is true), where L is (m,k) with
+ * L(r,k) = a[r + k * lda] and R is (k,n) with R(k,j) = b[k * bsk + j * bsj].
+ * If lower is true, tiles that lie strictly above the diagonal of C are skipped.
+ */
+static void clap_GemmAxpy(int m, int n, int k, const double* a, int lda, const double* b,
+                          int bsk, int bsj, double* c, int ldc, bool tC, bool lower,
+                          double alpha) {
+  for (int kk = 0; kk < k; kk += kClapGemmKC) {
+    int kc = k - kk < kClapGemmKC ? k - kk : kClapGemmKC;
+    const double* ak = a + kk * lda;
+    const double* bk = b + kk * bsk;
+    for (int j = 0; j < n; j += kClapGemmNR) {
+      int nr = n - j < kClapGemmNR ? n - j : kClapGemmNR;
+      for (int i = 0; i < m; i += kClapGemmMR) {
+        int mr = m - i < kClapGemmMR ? m - i : kClapGemmMR;
+        if (clap_SkipTile(i, j, mr, nr, tC, lower)) continue;
+        double* cij = tC ? c + j + i * ldc : c + i + j * ldc;
+        clap_GemmKernelAxpy(mr, nr, kc, ak + i, lda, bk + j * bsj, bsk, bsj, cij, ldc, tC,
+                            alpha);
+      }
+    }
+  }
+}
+
+/*
+ * Adds alpha times the sum of L'*R over all terms to the (m,n) matrix C.
+ * If lower is true, tiles that lie strictly above the diagonal of C are skipped.
+ */
+static void clap_GemmDotSum(int m, int n, int nterms, const ClapDotTerm* terms, double* c,
+                            int ldc, bool lower, double alpha) {
+  for (int j = 0; j < n; j += 2) {
+    int nr = n - j < 2 ? n - j : 2;
+    for (int i = 0; i < m; i += 4) {
+      int mr = m - i < 4 ? m - i : 4;
+      if (clap_SkipTile(i, j, mr, nr, false, lower)) continue;
+      clap_GemmKernelDot(mr, nr, nterms, terms, i, j, c + i + j * ldc, ldc, alpha);
+    }
+  }
+}
+
+/*
+ * Adds alpha * L' * R to C, where L is (k,m) and R is (k,n), both stored column-wise.
+ */
+static void clap_GemmDot(int m, int n, int k, const double* a, int lda, const double* b,
+                         int ldb, double* c, int ldc, bool lower, double alpha) {
+  ClapDotTerm term = {a, lda, b, ldb, k};
+  clap_GemmDotSum(m, n, 1, &term, c, ldc, lower, alpha);
+}
+
+/*
+ * Matrix-vector product y = alpha * op(A) * x + y, used when the right operand has a
+ * single column (e.g. the right-hand-side vector in the solution phase).
+ * A is (rows,cols) with leading dimension lda.
+ */
+static void clap_Gemv(bool tA, int rows, int cols, const double* a, int lda,
+                      const double* x, double* y, double alpha) {
+  if (tA) {
+    // y[i] += alpha * dot(A[:,i], x)
+    clap_GemmDot(cols, 1, rows, a, lda, x, rows, y, cols, false, alpha);
+    return;
+  }
+#if defined(CLAP_USE_AVX512)
+  // y += alpha * sum_k A[:,k] * x[k], processing 4 columns of A per pass over y
+  int k = 0;
+  for (; k + 4 <= cols; k += 4) {
+    __m512d x0 = _mm512_set1_pd(alpha * x[k + 0]);
+    __m512d x1 = _mm512_set1_pd(alpha * x[k + 1]);
+    __m512d x2 = _mm512_set1_pd(alpha * x[k + 2]);
+    __m512d x3 = _mm512_set1_pd(alpha * x[k + 3]);
+    const double* a0 = a + (k + 0) * lda;
+    const double* a1 = a + (k + 1) * lda;
+    const double* a2 = a + (k + 2) * lda;
+    const double* a3 = a + (k + 3) * lda;
+    for (int i = 0; i < rows; i += 8) {
+      __mmask8 mi = clap_LaneMask(rows - i);
+      __m512d yi = _mm512_maskz_loadu_pd(mi, y + i);
+      yi = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mi, a0 + i), x0, yi);
+      yi = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mi, a1 + i), x1, yi);
+      yi = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mi, a2 + i), x2, yi);
+      yi = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mi, a3 + i), x3, yi);
+      _mm512_mask_storeu_pd(y + i, mi, yi);
+    }
+  }
+  for (; k < cols; ++k) {
+    __m512d xk = _mm512_set1_pd(alpha * x[k]);
+    const double* ak = a + k * lda;
+    for (int i = 0; i < rows; i += 8) {
+      __mmask8 mi = clap_LaneMask(rows - i);
+      __m512d yi = _mm512_maskz_loadu_pd(mi, y + i);
+      yi = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mi, ak + i), xk, yi);
+      _mm512_mask_storeu_pd(y + i, mi, yi);
+    }
+  }
+#elif defined(CLAP_USE_AVX2)
+  // y += alpha * sum_k A[:,k] * x[k], processing 4 columns of A per pass over y
+  int k = 0;
+  for (; k + 4 <= cols; k += 4) {
+    __m256d x0 = _mm256_set1_pd(alpha * x[k + 0]);
+    __m256d x1 = _mm256_set1_pd(alpha * x[k + 1]);
+    __m256d x2 = _mm256_set1_pd(alpha * x[k + 2]);
+    __m256d x3 = _mm256_set1_pd(alpha * x[k + 3]);
+    const double* a0 = a + (k + 0) * lda;
+    const double* a1 = a + (k + 1) * lda;
+    const double* a2 = a + (k + 2) * lda;
+    const double* a3 = a + (k + 3) * lda;
+    for (int i = 0; i < rows; i += 4) {
+      __m256i mi = clap_RowMask(rows - i);
+      __m256d yi = _mm256_maskload_pd(y + i, mi);
+      yi = _mm256_fmadd_pd(_mm256_maskload_pd(a0 + i, mi), x0, yi);
+      yi = _mm256_fmadd_pd(_mm256_maskload_pd(a1 + i, mi), x1, yi);
+      yi = _mm256_fmadd_pd(_mm256_maskload_pd(a2 + i, mi), x2, yi);
+      yi = _mm256_fmadd_pd(_mm256_maskload_pd(a3 + i, mi), x3, yi);
+      _mm256_maskstore_pd(y + i, mi, yi);
+    }
+  }
+  for (; k < cols; ++k) {
+    __m256d xk = _mm256_set1_pd(alpha * x[k]);
+    const double* ak = a + k * lda;
+    for (int i = 0; i < rows; i += 4) {
+      __m256i mi = clap_RowMask(rows - i);
+      __m256d yi = _mm256_maskload_pd(y + i, mi);
+      yi = _mm256_fmadd_pd(_mm256_maskload_pd(ak + i, mi), xk, yi);
+      _mm256_maskstore_pd(y + i, mi, yi);
+    }
+  }
+#else
+  for (int k = 0; k < cols; ++k) {
+    double xk = alpha * x[k];
+    const double* ak = a + k * lda;
+    for (int i = 0; i < rows; ++i) {
+      y[i] += ak[i] * xk;
+    }
+  }
+#endif
+}
+
+/*
+ * Adds alpha * op(A) * op(B) to C, where op(A) is (m,k), op(B) is (k,n), and all
+ * matrices are stored column-wise with the given leading dimensions.
+ * If lower is true, only the tiles of C touching its lower triangle are updated.
+ */
+static void clap_GemmTri(bool tA, bool tB, int m, int n, int k, double alpha,
+                         const double* a, int lda, const double* b, int ldb, double* c,
+                         int ldc, bool lower) {
+  if (alpha == 0.0 || k == 0) return;
+  if (n == 1 && !tB) {
+    int rows = tA ? k : m;
+    int cols = tA ? m : k;
+    clap_Gemv(tA, rows, cols, a, lda, b, c, alpha);
+  } else if (!tA) {
+    int bsk = tB ? ldb : 1;
+    int bsj = tB ? 1 : ldb;
+    clap_GemmAxpy(m, n, k, a, lda, b, bsk, bsj, c, ldc, false, lower, alpha);
+  } else if (!tB) {
+    clap_GemmDot(m, n, k, a, lda, b, ldb, c, ldc, lower, alpha);
+  } else {
+    // C' = B * A, computed with the rows of B as the contiguous operand
+    clap_GemmAxpy(n, m, k, b, ldb, a, 1, lda, c, ldc, true, lower, alpha);
+  }
+}
+
+/*
+ * Cholesky factorization and triangular solves
+ *
+ * Both are blocked with a block size of kClapCholNB. The bulk of the work is done in the
+ * off-diagonal updates using the GEMM kernels above, while the small diagonal blocks are
+ * handled with vectorized column operations.
+ */
+#define kClapCholNB 32
+
+// y = y + alpha * x
+static void clap_Axpy(int n, double alpha, const double* x, double* y) {
+  int i = 0;
+#ifdef CLAP_USE_AVX512
+  __m512d va8 = _mm512_set1_pd(alpha);
+  for (; i + 8 <= n; i += 8) {
+    __m512d yi = _mm512_loadu_pd(y + i);
+    _mm512_storeu_pd(y + i, _mm512_fmadd_pd(va8, _mm512_loadu_pd(x + i), yi));
+  }
+#endif
+#ifdef CLAP_USE_AVX2
+  __m256d va = _mm256_set1_pd(alpha);
+  for (; i + 4 <= n; i += 4) {
+    __m256d yi = _mm256_loadu_pd(y + i);
+    _mm256_storeu_pd(y + i, _mm256_fmadd_pd(va, _mm256_loadu_pd(x + i), yi));
+  }
+#endif
+  for (; i < n; ++i) {
+    y[i] += alpha * x[i];
+  }
+}
+
+// x' * y
+static double clap_Dot(int n, const double* x, const double* y) {
+  double sum = 0.0;
+  int i = 0;
+#ifdef CLAP_USE_AVX512
+  if (n >= 8) {
+    __m512d acc8 = _mm512_setzero_pd();
+    for (; i + 8 <= n; i += 8) {
+      acc8 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i), acc8);
+    }
+    sum = _mm512_reduce_add_pd(acc8);
+  }
+#endif
+#ifdef CLAP_USE_AVX2
+  __m256d acc = _mm256_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+    acc = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), acc);
+  }
+  double buf[4];
+  _mm256_storeu_pd(buf, acc);
+  sum += (buf[0] + buf[1]) + (buf[2] + buf[3]);
+#endif
+  for (; i < n; ++i) {
+    sum += x[i] * y[i];
+  }
+  return sum;
+}
+
+/*
+ * Unblocked, left-looking Cholesky factorization of the (n,n) block at a, assuming the
+ * contributions from all columns to the left of the block have already been removed.
+ */
+static int clap_CholeskyFactorizeBlock(int n, double* a, int lda) {
+  for (int j = 0; j < n; ++j) {
+    double* aj = a + j * lda;
+    for (int k = 0; k < j; ++k) {
+      const double* ak = a + k * lda;
+      clap_Axpy(n - j, -ak[j], ak + j, aj + j);
+    }
+    double ajj = aj[j];
+    if (!(ajj > 0.0)) {
+      return clap_kCholeskyFail;
+    }
+    ajj = sqrt(ajj);
+    aj[j] = ajj;
+    double scale = 1.0 / ajj;
+    for (int i = j + 1; i < n; ++i) {
+      aj[i] *= scale;
+    }
+  }
+  return clap_kCholeskySuccess;
+}
+
+/*
+ * Solves X L' = B for X, where L is an (n,n) lower-triangular block and B is (m,n).
+ * Used to compute the sub-diagonal panel of the Cholesky factor.
+ */
+static void clap_TriSolveRightLowerTranspose(int m, int n, const double* l, int ldl,
+                                             double* b, int ldb) {
+  for (int j = 0; j < n; ++j) {
+    double* bj = b + j * ldb;
+    for (int k = 0; k < j; ++k) {
+      clap_Axpy(m, -l[j + k * ldl], b + k * ldb, bj);
+    }
+    double scale = 1.0 / l[j + j * ldl];
+    for (int i = 0; i < m; ++i) {
+      bj[i] *= scale;
+    }
+  }
+}
+
+// Blocked, in-place Cholesky factorization of the lower triangle of the (n,n) matrix a
+static int clap_CholeskyKernel(int n, double* a, int lda) {
+  double work[kClapCholNB * kClapCholNB];
+  for (int j = 0; j < n; j += kClapCholNB) {
+    int jb = n - j < kClapCholNB ? n - j : kClapCholNB;
+    double* ajj = a + j + j * lda;
+
+    // Diagonal block: Ajj -= Lj * Lj', only updating the lower triangle
+    if (j > 0) {
+      for (int i = 0; i < jb * jb; ++i) work[i] = 0.0;
+      clap_GemmTri(false, true, jb, jb, j, 1.0, a + j, lda, a + j, lda, work, jb, false);
+      for (int c = 0; c < jb; ++c) {
+        for (int r = c; r < jb; ++r) {
+          ajj[r + c * lda] -= work[r + c * jb];
+        }
+      }
+    }
+    int info = clap_CholeskyFactorizeBlock(jb, ajj, lda);
+    if (info != clap_kCholeskySuccess) {
+      return info;
+    }
+
+    // Panel below the diagonal block: P = (P - L2 * Lj') / Ljj'
+    int m = n - j - jb;
+    if (m > 0) {
+      double* panel = ajj + jb;
+      clap_GemmTri(false, true, m, jb, j, -1.0, a + j + jb, lda, a + j, lda, panel, lda,
+                   false);
+      clap_TriSolveRightLowerTranspose(m, jb, ajj, lda, panel, lda);
+    }
+  }
+  return clap_kCholeskySuccess;
+}
+
+/*
+ * Solves L X = B in place for the (n,n) lower-triangular block L, using column-oriented
+ * forward substitution on each column of B.
+ */
+static void clap_TriSolveLowerBlock(int n, int nrhs, const double* l, int ldl, double* b,
+                                    int ldb) {
+  for (int c = 0; c < nrhs; ++c) {
+    double* x = b + c * ldb;
+    for (int j = 0; j < n; ++j) {
+      const double* lj = l + j * ldl;
+      x[j] /= lj[j];
+      clap_Axpy(n - j - 1, -x[j], lj + j + 1, x + j + 1);
+    }
+  }
+}
+
+/*
+ * Solves L' X = B in place for the (n,n) lower-triangular block L, using inner products
+ * with the columns of L for each column of B.
+ */
+static void clap_TriSolveLowerTransposeBlock(int n, int nrhs, const double* l, int ldl,
+                                             double* b, int ldb) {
+  for (int c = 0; c < nrhs; ++c) {
+    double* x = b + c * ldb;
+    for (int j = n - 1; j >= 0; --j) {
+      const double* lj = l + j * ldl;
+      x[j] = (x[j] - clap_Dot(n - j - 1, lj + j + 1, x + j + 1)) / lj[j];
+    }
+  }
+}
+
+/*
+ * Solves L X = B, or L' X = B if istransposed is true, in place for the (n,n)
+ * lower-triangular matrix L and the (n,nrhs) matrix B.
+ */
+static void clap_TriSolveKernel(bool istransposed, int n, int nrhs, const double* l,
+                                int ldl, double* x, int ldb) {
+  if (!istransposed) {
+    // Forward substitution by block rows: Xi = Lii \ (Bi - Li0 * X0)
+    for (int i = 0; i < n; i += kClapCholNB) {
+      int ib = n - i < kClapCholNB ? n - i : kClapCholNB;
+      clap_GemmTri(false, false, ib, nrhs, i, -1.0, l + i, ldl, x, ldb, x + i, ldb, false);
+      clap_TriSolveLowerBlock(ib, nrhs, l + i + i * ldl, ldl, x + i, ldb);
+    }
+  } else {
+    // Backward substitution by block rows: Xi = Lii' \ (Bi - L1i' * X1)
+    int nblocks = (n + kClapCholNB - 1) / kClapCholNB;
+    for (int blk = nblocks - 1; blk >= 0; --blk) {
+      int i = blk * kClapCholNB;
+      int ib = n - i < kClapCholNB ? n - i : kClapCholNB;
+      int below = n - i - ib;
+      clap_GemmTri(true, false, ib, nrhs, below, -1.0, l + (i + ib) + i * ldl, ldl,
+                   x + i + ib, ldb, x + i, ldb, false);
+      clap_TriSolveLowerTransposeBlock(ib, nrhs, l + i + i * ldl, ldl, x + i, ldb);
+    }
+  }
+}
+
+// Sets the (n,n) matrix x to alpha * inv(L L'), given the Cholesky factor L
+static void clap_CholeskyInverseKernel(int n, const double* l, double* x, double alpha) {
+  // X = inv(L) by forward substitution on the columns of I. Column j of X is zero above
+  // the diagonal, so each substitution starts at row j.
+  for (int j = 0; j < n; ++j) {
+    double* xj = x + j * n;
+    for (int i = 0; i < n; ++i) xj[i] = 0.0;
+    xj[j] = 1.0;
+    for (int p = j; p < n; ++p) {
+      xj[p] /= l[p + p * n];
+      clap_Axpy(n - p - 1, -xj[p], l + (p + 1) + p * n, xj + p + 1);
+    }
+  }
+
+  // Lower triangle of alpha * X'X, in place. Entry (i,j) only reads rows >= i of columns
+  // i and j, which haven't been overwritten yet.
+  for (int j = 0; j < n; ++j) {
+    for (int i = j; i < n; ++i) {
+      x[i + j * n] = alpha * clap_Dot(n - i, x + i + i * n, x + i + j * n);
+    }
+  }
+  for (int j = 0; j < n; ++j) {
+    for (int i = j + 1; i < n; ++i) {
+      x[j + i * n] = x[i + j * n];
+    }
+  }
+}
+
+#define CLAP_CONCAT_(a, b) a##b
+#define CLAP_CONCAT(a, b) CLAP_CONCAT_(a, b)
+#define CLAP_STRING_(a) #a
+#define CLAP_STRING(a) CLAP_STRING_(a)
+
+const ClapKernels CLAP_CONCAT(clap_kernels_, CLAP_KERNEL_ISA) = {
+    CLAP_STRING(CLAP_KERNEL_ISA),
+    clap_GemmTri,
+    clap_GemmDotSum,
+    clap_CholeskyKernel,
+    clap_TriSolveKernel,
+    clap_TriSolveRightLowerTranspose,
+    clap_CholeskyInverseKernel,
+};
@@ -0,0 +1,71 @@
+/**
+ * @file linalg_kernels.h
+ * @brief SIMD kernels for the internal linear algebra routines
+ *
+ * linalg_kernels.c is compiled once for each supported instruction set, and each build
+ * provides a ClapKernels table named `clap_kernels_<isa>`. The routines in
+ * linalg_custom.c call the kernels through the table selected for the host CPU at
+ * startup (see clap_SetKernelISA()).
+ *
+ * This header is internal to the matrix library.
+ */
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * One term L'*R in a sum of inner products, where L is (k,m) and R is (k,n), both stored
+ * column-wise with leading dimensions lda and ldb.
+ */
+typedef struct {
+  const double* a;
+  int lda;
+  const double* b;
+  int ldb;
+  int k;
+} ClapDotTerm;
+
+#define kClapMaxDotTerms 8
+
+typedef struct {
+  const char* name;
+
+  /*
+   * Adds alpha * op(A) * op(B) to C, where op(A) is (m,k), op(B) is (k,n), and all
+   * matrices are stored column-wise with the given leading dimensions.
+   * If lower is true, only the tiles of C touching its lower triangle are updated.
+   */
+  void (*gemm)(bool tA, bool tB, int m, int n, int k, double alpha, const double* a,
+               int lda, const double* b, int ldb, double* c, int ldc, bool lower);
+
+  /*
+   * Adds alpha times the sum of L'*R over all terms to the (m,n) matrix C, for at most
+   * kClapMaxDotTerms terms. If lower is true, tiles that lie strictly above the diagonal
+   * of C are skipped.
+   */
+  void (*gemm_dot_sum)(int m, int n, int nterms, const ClapDotTerm* terms, double* c,
+                       int ldc, bool lower, double alpha);
+
+  // Blocked, in-place Cholesky factorization of the lower triangle of the (n,n) matrix a.
+  // Returns clap_kCholeskySuccess or clap_kCholeskyFail.
+  int (*cholesky)(int n, double* a, int lda);
+
+  // Solves L X = B, or L' X = B if istransposed is true, in place, where L is (n,n)
+  // and lower-triangular and B is (n,nrhs)
+  void (*tri_solve)(bool istransposed, int n, int nrhs, const double* l, int ldl,
+                    double* x, int ldb);
+
+  // Solves X L' = B in place, where L is (n,n) and lower-triangular and B is (m,n)
+  void (*tri_solve_right)(int m, int n, const double* l, int ldl, double* b, int ldb);
+
+  // Sets the (n,n) matrix x to alpha * inv(L L'), given the Cholesky factor L
+  void (*cholesky_inverse)(int n, const double* l, double* x, double alpha);
+} ClapKernels;
+
+extern const ClapKernels clap_kernels_generic;
+#ifdef CLAP_HAVE_AVX2
+extern const ClapKernels clap_kernels_avx2;
+#endif
+#ifdef CLAP_HAVE_AVX512
+extern const ClapKernels clap_kernels_avx512;
+#endif
@@ -1,5 +1,7 @@
 #include "lqr_problem.h"
 
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,3 +52,9 @@ int ndlqr_FreeLQRProblem(LQRProblem* lqrprob) {
   lqrprob = NULL;
   return 0;
 }
+
+int ndlqr_GetNumVariables(int nstates, int ninputs, int nhorizon) {
+  int64_t nvars = (int64_t)(2 * nstates + ninputs) * nhorizon - ninputs;
+  if (nvars > INT_MAX) return -1;
+  return (int)nvars;
+}
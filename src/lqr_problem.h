@@ -67,4 +67,16 @@ LQRProblem* ndlqr_NewLQRProblem(int nstates, int ninputs, int nhorizon);
  */
 int ndlqr_FreeLQRProblem(LQRProblem* lqrprob);
 
+/**
+ * @brief Number of decision variables of an LQR problem, including the dual variables
+ *
+ * The solvers index their solution vector with an int, so larger problems are rejected.
+ *
+ * @param nstates Length of the state vector
+ * @param ninputs Number of control inputs
+ * @param nhorizon Length of the horizon (i.e. number of knot points)
+ * @return The number of variables, or -1 if it doesn't fit in an int
+ */
+int ndlqr_GetNumVariables(int nstates, int ninputs, int nhorizon);
+
 /**@} */
@@ -11,7 +11,7 @@
 #include <string.h>
 
 Matrix NewMatrix(int rows, int cols) {
-  double* data = (double*)malloc(rows * cols * sizeof(double));
+  double* data = (double*)malloc((size_t)rows * cols * sizeof(double));
   Matrix mat = {rows, cols, data};
   return mat;
 }
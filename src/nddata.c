@@ -13,6 +13,11 @@ Matrix ndlqr_GetStateFactor(NdFactor* factor) { return factor->state; }
 Matrix ndlqr_GetInputFactor(NdFactor* factor) { return factor->input; }
 
 NdData* ndlqr_NewNdData(int nstates, int ninputs, int nhorizon, int width) {
+  return ndlqr_NewCompactNdData(nstates, ninputs, nhorizon, width, NULL);
+}
+
+NdData* ndlqr_NewCompactNdData(int nstates, int ninputs, int nhorizon, int width,
+                               const bool* stored) {
   int nsegments = nhorizon - 1;
   if (nstates <= 0 || ninputs <= 0 || nsegments <= 0) return NULL;
   if (!IsPowerOfTwo(nhorizon)) {
@@ -28,19 +33,35 @@ NdData* ndlqr_NewNdData(int nstates, int ninputs, int nhorizon, int width) {
     depth = LogOfTwo(nhorizon);
   }
 
+  // Map each (index, level) pair to the factors that are actually stored
+  int numslots = nhorizon * depth;
+  int numfactors = numslots;
+  int* slots = NULL;
+  if (stored) {
+    slots = (int*)malloc(numslots * sizeof(int));
+    if (slots == NULL) {
+      fprintf(stderr, "ERROR: Failed to allocate memory for NdData.\n");
+      return NULL;
+    }
+    numfactors = 0;
+    for (int i = 0; i < numslots; ++i) {
+      slots[i] = stored[i] ? numfactors++ : -1;
+    }
+  }
+
   // Allocate one large block of memory for the data
-  int numfactors = nhorizon * depth;
-  int factorsize = (2 * nstates + ninputs) * width;
-  double* data = (double*)calloc(numfactors * factorsize, sizeof(double));
+  size_t datasize = ndlqr_GetNdDataOffset(nstates, ninputs, width, numfactors);
+  double* data = (double*)calloc(datasize, sizeof(double));
   if (data == NULL) {
     fprintf(stderr, "ERROR: Failed to allocate memory for NdData.\n");
+    free(slots);
     return NULL;
   }
 
   // Create the factors using the allocated memory
   NdFactor* factors = (NdFactor*)malloc(numfactors * sizeof(NdFactor));
   for (int i = 0; i < numfactors; ++i) {
-    double* factordata = data + i * factorsize;
+    double* factordata = data + ndlqr_GetNdDataOffset(nstates, ninputs, width, i);
     factors[i].lambda.rows = nstates;
     factors[i].lambda.cols = width;
     factors[i].lambda.data = factordata;
@@ -59,22 +80,33 @@ NdData* ndlqr_NewNdData(int nstates, int ninputs, int nhorizon, int width) {
   nddata->nsegments = nsegments;
   nddata->depth = depth;
   nddata->width = width;
+  nddata->numfactors = numfactors;
   nddata->data = data;
   nddata->factors = factors;
+  nddata->slots = slots;
+  nddata->coupling_state = ndlqr_kDenseBlock;
+  nddata->coupling_input = ndlqr_kDenseBlock;
+  nddata->nonzero_step = NULL;
   return nddata;
 }
 
+size_t ndlqr_GetNdDataOffset(int nstates, int ninputs, int width, int index) {
+  // Computed in size_t, since it can exceed the range of an int for long horizons
+  return (size_t)index * (2 * nstates + ninputs) * width;
+}
+
 void ndlqr_ResetNdData(NdData* nddata) {
-  int nhorizon = nddata->nsegments + 1;
-  int numfactors = nhorizon * nddata->depth;
-  int factorsize = (2 * nddata->nstates + nddata->ninputs) * nddata->width;
-  memset(nddata->data, 0, numfactors * factorsize * sizeof(double));
+  size_t datasize = ndlqr_GetNdDataOffset(nddata->nstates, nddata->ninputs, nddata->width,
+                                          nddata->numfactors);
+  memset(nddata->data, 0, datasize * sizeof(double));
 }
 
 int ndlqr_FreeNdData(NdData* nddata) {
   if (!nddata) return -1;
   free(nddata->factors);
   free(nddata->data);
+  free(nddata->slots);
+  free(nddata->nonzero_step);
   free(nddata);
   return 0;
 }
@@ -91,6 +123,47 @@ int ndlqr_GetNdFactor(NdData* nddata, int index, int level, NdFactor** factor) {
     return -1;
   }
   int linear_index = index + (nddata->nsegments + 1) * level;
+  if (nddata->slots) {
+    linear_index = nddata->slots[linear_index];
+    if (linear_index < 0) {
+      fprintf(stderr, "Factor (%d,%d) is not stored.\n", index, level);
+      return -1;
+    }
+  }
   *factor = nddata->factors + linear_index;
   return 0;
 }
+
+int ndlqr_NewSparsityMap(NdData* nddata) {
+  if (!nddata) return -1;
+  int numblocks = 3 * (nddata->nsegments + 1) * nddata->depth;
+  int* nonzero_step = (int*)realloc(nddata->nonzero_step, numblocks * sizeof(int));
+  if (!nonzero_step) return -1;
+  for (int i = 0; i < numblocks; ++i) {
+    nonzero_step[i] = ndlqr_kNeverNonzero;
+  }
+  nddata->nonzero_step = nonzero_step;
+  return 0;
+}
+
+int ndlqr_FreeSparsityMap(NdData* nddata) {
+  if (!nddata) return -1;
+  free(nddata->nonzero_step);
+  nddata->nonzero_step = NULL;
+  return 0;
+}
+
+bool ndlqr_IsBlockNonzero(NdData* nddata, int index, int level, NdFactorBlock block,
+                          int step) {
+  if (!nddata->nonzero_step) return true;
+  int linear_index = index + (nddata->nsegments + 1) * level;
+  return nddata->nonzero_step[3 * linear_index + block] < step;
+}
+
+void ndlqr_SetBlockNonzero(NdData* nddata, int index, int level, NdFactorBlock block,
+                           int step) {
+  if (!nddata->nonzero_step) return;
+  int linear_index = index + (nddata->nsegments + 1) * level;
+  int* nonzero_step = nddata->nonzero_step + 3 * linear_index + block;
+  if (step < *nonzero_step) *nonzero_step = step;
+}
@@ -12,6 +12,10 @@
  */
 #pragma once
 
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "lqr_data.h"
 #include "matrix.h"
 
@@ -47,6 +51,32 @@ Matrix ndlqr_GetLambdaFactor(NdFactor* factor);
 Matrix ndlqr_GetStateFactor(NdFactor* factor);
 Matrix ndlqr_GetInputFactor(NdFactor* factor);
 
+/**
+ * @brief Known structure of a block of the KKT matrix
+ *
+ * Structured blocks are never written to the NdData storage. The kernels that use them
+ * apply the structure directly instead of multiplying or solving against them.
+ */
+typedef enum {
+  ndlqr_kDenseBlock = 0,          ///< General block, stored explicitly
+  ndlqr_kMinusIdentityBlock = 1,  ///< Negative identity matrix
+  ndlqr_kZeroBlock = 2,           ///< All zeros
+} NdBlockStructure;
+
+/**
+ * @brief Identifies one of the blocks of an NdFactor
+ */
+typedef enum {
+  ndlqr_kLambda = 0,  ///< NdFactor.lambda
+  ndlqr_kState = 1,   ///< NdFactor.state
+  ndlqr_kInput = 2,   ///< NdFactor.input
+} NdFactorBlock;
+
+/**
+ * @brief Step recorded in the sparsity map for blocks that are always zero
+ */
+static const int ndlqr_kNeverNonzero = INT_MAX;
+
 /**
  * @brief Core storage container for the rsLQR solver
  *
@@ -74,8 +104,20 @@ Matrix ndlqr_GetInputFactor(NdFactor* factor);
  * Future modifications could alternatively make the right-hand-side vector the last column
  * in the matrix data, as suggested in the original paper.
  *
+ * The blocks coupling each knot point to the dynamics of the previous one are described
+ * by NdData.coupling_state and NdData.coupling_input. For explicit dynamics these are
+ * \f$ -I \f$ and zero, and are never stored (see NdBlockStructure).
+ *
+ * The solver can also attach a block sparsity map (NdData.nonzero_step), recording the
+ * step of the solve at which each block of each factor is first written with nonzero
+ * data. Products with blocks that are still zero are skipped. See ndlqr_IsBlockNonzero().
+ *
+ * A compact NdData only allocates some of the factors, and maps each (index, level) pair
+ * to its factor through the NdData.slots table. See ndlqr_NewCompactNdData().
+ *
  * ## Methods
  * - ndlqr_NewNdData()
+ * - ndlqr_NewCompactNdData()
  * - ndlqr_FreeNdData()
  * - ndlqr_GetNdFactor()
  * - ndlqr_ResetNdFactor()
@@ -87,8 +129,13 @@ typedef struct {
   int nsegments;  ///< number of segments, or one less than the length of the horizon
   int depth;      ///< number of columns of factors to store
   int width;      ///< width of each factor. Will be `n` for matrix data and typically 1 for the right-hand-side vector.
+  int numfactors;     ///< number of factors allocated
   double* data;       ///< pointer to entire chunk of allocated memory
-  NdFactor* factors;  ///< (nsegments, depth) array of factors. Stored in column-order.
+  NdFactor* factors;  ///< array of allocated factors
+  int* slots;         ///< (nsegments+1, depth) array with the index into NdData.factors for each pair, or -1 if it isn't stored. Stored in column-order. NULL if every factor is stored, in which case NdData.factors is indexed the same way.
+  NdBlockStructure coupling_state;  ///< structure of the state block coupling each knot point to the previous one
+  NdBlockStructure coupling_input;  ///< structure of the input block coupling each knot point to the previous one
+  int* nonzero_step;  ///< (3, nsegments+1, depth) array with the step of the solve at which each block first becomes nonzero. NULL if every block is treated as nonzero.
   // clang-format on
 } NdData;
 
@@ -107,6 +154,38 @@ typedef struct {
  */
 NdData* ndlqr_NewNdData(int nstates, int ninputs, int nhorizon, int width);
 
+/**
+ * @brief Initialize an NdData structure that only stores some of its factors
+ *
+ * Only the factors marked in @p stored are allocated, packed together in the order of
+ * their linear index. ndlqr_GetNdFactor() fails for any other factor.
+ *
+ * @param nstates Number of variables in the state vector
+ * @param ninputs Number of control inputs
+ * @param nhorizon Length of the time horizon
+ * @param width Width of each factor (see ndlqr_NewNdData())
+ * @param stored (nhorizon, depth) column-order mask of the factors to allocate, where
+ *               `index + nhorizon * level` is the entry for a factor. NULL to store all of
+ *               them.
+ * @return The initialized NdData structure
+ */
+NdData* ndlqr_NewCompactNdData(int nstates, int ninputs, int nhorizon, int width,
+                               const bool* stored);
+
+/**
+ * @brief Offset of a factor into the block of memory of an NdData structure
+ *
+ * Factors are stored back to back, so the offset of `numfactors` is the total number of
+ * doubles in NdData.data.
+ *
+ * @param nstates Number of variables in the state vector
+ * @param ninputs Number of control inputs
+ * @param width Width of each factor (see ndlqr_NewNdData())
+ * @param index Index of the factor into NdData.factors
+ * @return Offset of the factor data, in doubles
+ */
+size_t ndlqr_GetNdDataOffset(int nstates, int ninputs, int width, int index);
+
 /**
  * @brief Frees the memory allocated in an NdData structure
  *
@@ -115,6 +194,53 @@ NdData* ndlqr_NewNdData(int nstates, int ninputs, int nhorizon, int width);
  */
 int ndlqr_FreeNdData(NdData* nddata);
 
+/**
+ * @brief Allocate the block sparsity map, marking every block as always zero
+ *
+ * Any existing map is replaced. The map is freed by ndlqr_FreeNdData().
+ *
+ * @param nddata Initialized NdData structure
+ * @return 0 if successful
+ */
+int ndlqr_NewSparsityMap(NdData* nddata);
+
+/**
+ * @brief Free the block sparsity map, so every block is treated as nonzero
+ *
+ * @param nddata Initialized NdData structure
+ * @return 0 if successful
+ */
+int ndlqr_FreeSparsityMap(NdData* nddata);
+
+/**
+ * @brief Check if a block could be nonzero when it is read at a given step of the solve
+ *
+ * @param nddata Initialized NdData structure
+ * @param index  Knot point index
+ * @param level  Level index
+ * @param block  Block of the factor
+ * @param step   Step of the solve at which the block is read
+ * @return true if the block was written with nonzero data before @p step, or if
+ *         @p nddata doesn't have a sparsity map.
+ */
+bool ndlqr_IsBlockNonzero(NdData* nddata, int index, int level, NdFactorBlock block,
+                          int step);
+
+/**
+ * @brief Record that a block becomes nonzero at a given step of the solve
+ *
+ * Has no effect if the block is already nonzero at an earlier step, or if @p nddata
+ * doesn't have a sparsity map.
+ *
+ * @param nddata Initialized NdData structure
+ * @param index  Knot point index
+ * @param level  Level index
+ * @param block  Block of the factor
+ * @param step   Step of the solve that writes nonzero data to the block
+ */
+void ndlqr_SetBlockNonzero(NdData* nddata, int index, int level, NdFactorBlock block,
+                           int step);
+
 /**
  * @brief Retrieve an individual NdFactor out of the NdData
  *
@@ -133,7 +259,8 @@ int ndlqr_FreeNdData(NdData* nddata);
  * @param index Time step of the factor to extract
  * @param level Level (or column in the NdData) of the desired factor
  * @param factor Storage location for the factor.
- * @return 0 if successful
+ * @return 0 if successful, or -1 if the indices are out of range or the factor isn't
+ *         stored
  */
 int ndlqr_GetNdFactor(NdData* nddata, int index, int level, NdFactor** factor);
 
@@ -5,6 +5,7 @@
 
 #include "linalg.h"
 #include "linalg_utils.h"
+#include "omp.h"
 #include "utils.h"
 
 int ndlqr_SolveLeaf(NdLqrSolver* solver, int index) {
@@ -12,19 +13,16 @@ int ndlqr_SolveLeaf(NdLqrSolver* solver, int index) {
   // int ninputs = solver->ninputs;
   int nhorizon = solver->nhorizon;
 
+  // Q and R are diagonal, so all of the solves below are row scalings
   NdFactor* C;
   NdFactor* F;
-  NdFactor* z;
   Matrix* Q;
-  Matrix* R;
-  CholeskyInfo* Qchol = NULL;
-  CholeskyInfo* Rchol = NULL;
+  Matrix* R = NULL;
 
   int k = index;
   if (index == 0) {
     ndlqr_GetNdFactor(solver->data, k, 0, &C);
     ndlqr_GetNdFactor(solver->fact, k, 0, &F);
-    ndlqr_GetNdFactor(solver->soln, k, 0, &z);
     Q = &solver->diagonals[2 * k];
     R = &solver->diagonals[2 * k + 1];
 
@@ -36,35 +34,11 @@ int ndlqr_SolveLeaf(NdLqrSolver* solver, int index) {
     MatrixScaleByConst(&F->lambda, -1.0);
     MatrixSetConst(&F->state, 0.0);
     MatrixCopy(&F->input, &C->input);
-    ndlqr_GetRFactorizon(solver->cholfacts, 0, &Rchol);
-    MatrixCholeskyFactorizeWithInfo(R, Rchol);
-    MatrixCholeskySolveWithInfo(R, &F->input, Rchol);  // Fu = R \ Cu
-    MatrixCholeskySolveWithInfo(R, &z->input, Rchol);  // zu = R \ zu
-
-    // Solve the block system of equations (overwriting the rhs vector):
-    // [   -I   ] [zy]   [zy]   [ -x0 ]    [ Qx0 + q ]   [-Q zy - zx ]
-    // [-I  Q   ] [zx] = [zx] = [ -q  ] => [ x0      ] = [-zy        ]
-    // [      R ] [zu]   [zu]   [ -r  ]    [-R \ r   ]   [ R \ zu    ]
-    Matrix zy_temp = {nstates, 1,
-                      C->lambda.data};  // grab an unused portion of the matrix data
-    MatrixCopy(&zy_temp, &z->lambda);
-    MatrixCopy(&z->lambda, &z->state);
-    MatrixMultiply(Q, &zy_temp, &z->lambda, 0, 0, -1.0,
-                   -1.0);  // zy = - Q * zy - zx
-
-    MatrixCopy(&z->state, &zy_temp);
-    MatrixScaleByConst(&z->state, -1.0);  // zx = -zy
-    ndlqr_GetQFactorizon(solver->cholfacts, 0, &Qchol);
-    MatrixCholeskyFactorizeWithInfo(Q, Qchol);
-
+    MatrixDiagonalSolve(R, &F->input);  // Fu = R \ Cu
   } else {
     int level = 0;
 
     Q = &solver->diagonals[2 * k];
-    ndlqr_GetQFactorizon(solver->cholfacts, k, &Qchol);
-    MatrixCholeskyFactorizeWithInfo(Q, Qchol);
-
-    ndlqr_GetNdFactor(solver->soln, k, 0, &z);
 
     // All the terms that don't apply at the last time step
     if (k < nhorizon - 1) {
@@ -73,22 +47,11 @@ int ndlqr_SolveLeaf(NdLqrSolver* solver, int index) {
       ndlqr_GetNdFactor(solver->fact, k, level, &F);
 
       R = &solver->diagonals[2 * k + 1];
-      ndlqr_GetRFactorizon(solver->cholfacts, k, &Rchol);
-      MatrixCholeskyFactorizeWithInfo(R, Rchol);
-
-      MatrixCholeskySolveWithInfo(R, &z->input,
-                                  Rchol);  // solve zu = R \ zu  (R \ -r)
       MatrixCopy(&F->state, &C->state);
-      MatrixCholeskySolveWithInfo(Q, &F->state,
-                                  Qchol);  // solve Fx = Q \ Cx  (Q \ A')
+      MatrixDiagonalSolve(Q, &F->state);  // solve Fx = Q \ Cx  (Q \ A')
       MatrixCopy(&F->input, &C->input);
-      MatrixCholeskySolveWithInfo(R, &F->input,
-                                  Rchol);  // solve Fu = Q \ Cu  (R \ B')
+      MatrixDiagonalSolve(R, &F->input);  // solve Fu = R \ Cu  (R \ B')
     }
-    // Only term at the last time step
-    MatrixCholeskySolveWithInfo(Q, &z->state,
-                                Qchol);  // solve zx = Q \ zx  (Q \ -q)
-
     // Solve for the terms from the dynamics of the previous time step
     // NOTE: This is -I on the state for explicit integration
     //       For implicit integrators we'd use the A2, B2 partials wrt the next
@@ -96,10 +59,47 @@ int ndlqr_SolveLeaf(NdLqrSolver* solver, int index) {
     int prev_level = ndlqr_GetIndexLevel(&solver->tree, k - 1);
     ndlqr_GetNdFactor(solver->data, k, prev_level, &C);
     ndlqr_GetNdFactor(solver->fact, k, prev_level, &F);
-    MatrixCopy(&F->state, &C->state);  // the -I matrix
-    MatrixCholeskySolveWithInfo(Q, &F->state,
-                                Qchol);  // solve Q \ -I from previous time step
-    MatrixSetConst(&F->input, 0.0);      // Initialize the B2 matrix to zeros
+    if (solver->data->coupling_state == ndlqr_kMinusIdentityBlock) {
+      MatrixSetConst(&F->state, 0.0);  // Q \ -I = -inv(Q)
+      for (int i = 0; i < nstates; ++i) {
+        MatrixSetElement(&F->state, i, i, -1.0 / Q->data[i]);
+      }
+    } else {
+      MatrixCopy(&F->state, &C->state);
+      MatrixDiagonalSolve(Q, &F->state);  // solve Q \ A2'
+    }
+    if (solver->data->coupling_input == ndlqr_kDenseBlock && k < nhorizon - 1) {
+      MatrixCopy(&F->input, &C->input);
+      MatrixDiagonalSolve(R, &F->input);  // solve R \ B2'
+    } else {
+      MatrixSetConst(&F->input, 0.0);  // Initialize the B2 matrix to zeros
+    }
+  }
+  return ndlqr_SolveLeafRightHandSide(solver, solver->soln, k);
+}
+
+int ndlqr_SolveLeafRightHandSide(NdLqrSolver* solver, NdData* soln, int index) {
+  int k = index;
+  NdFactor* z;
+  ndlqr_GetNdFactor(soln, k, 0, &z);
+  Matrix* Q = &solver->diagonals[2 * k];
+  Matrix* R = &solver->diagonals[2 * k + 1];
+  if (k < solver->nhorizon - 1) {
+    MatrixDiagonalSolve(R, &z->input);  // solve zu = R \ zu  (R \ -r)
+  }
+  if (k > 0) {
+    MatrixDiagonalSolve(Q, &z->state);  // solve zx = Q \ zx  (Q \ -q)
+    return 0;
+  }
+
+  // Solve the block system of equations (overwriting the rhs vector):
+  // [   -I   ] [zy]   [zy]   [ -x0 ]    [ Qx0 + q ]   [-Q zy - zx ]
+  // [-I  Q   ] [zx] = [zx] = [ -q  ] => [ x0      ] = [-zy        ]
+  // [      R ] [zu]   [zu]   [ -r  ]    [-R \ r   ]   [ R \ zu    ]
+  for (int i = 0; i < solver->nstates; ++i) {
+    double zy = z->lambda.data[i];
+    z->lambda.data[i] = -Q->data[i] * zy - z->state.data[i];
+    z->state.data[i] = -zy;
   }
   return 0;
 }
@@ -111,8 +111,15 @@ int ndlqr_SolveLeaves(NdLqrSolver* solver) {
   return 0;
 }
 
-int ndlqr_FactorInnerProduct(NdData* data, NdData* fact, int index, int data_level,
-                             int fact_level) {
+/*
+ * Terms C'F of the inner product for ndlqr_FactorInnerProduct(), skipping any structured
+ * coupling blocks in C2 and any factor blocks that are still zero. If C2x is -I and F2x
+ * is nonzero, -F2x also has to be added to S, and is returned in minus_F2x.
+ * Returns the number of terms.
+ */
+static int GetInnerProductTerms(NdData* data, NdData* fact, int index, int data_level,
+                                int fact_level, Matrix* C, Matrix* F, Matrix* S,
+                                Matrix** minus_F2x) {
   NdFactor* C1;
   NdFactor* F1;
   NdFactor* C2;
@@ -121,15 +128,52 @@ int ndlqr_FactorInnerProduct(NdData* data, NdData* fact, int index, int data_lev
   ndlqr_GetNdFactor(fact, index, fact_level, &F1);
   ndlqr_GetNdFactor(data, index + 1, data_level, &C2);
   ndlqr_GetNdFactor(fact, index + 1, fact_level, &F2);
-  Matrix S = ndlqr_GetLambdaFactor(F2);
-  MatrixMultiply(&C1->state, &F1->state, &S, true, false, 1.0,
-                 -1.0);  // S = C1x'F1x
-  MatrixMultiply(&C1->input, &F1->input, &S, true, false, 1.0,
-                 1.0);  // S = C1u'F1u + S
-  MatrixMultiply(&C2->state, &F2->state, &S, true, false, 1.0,
-                 1.0);  // S = C2x'F2x + S
-  MatrixMultiply(&C2->input, &F2->input, &S, true, false, 1.0,
-                 1.0);  // S = C2u'F2u + S
+  *S = ndlqr_GetLambdaFactor(F2);
+
+  int step = ndlqr_GetProductStep(data_level);
+  int num_terms = 0;
+  if (ndlqr_IsBlockNonzero(fact, index, fact_level, ndlqr_kState, step)) {
+    C[num_terms] = C1->state;
+    F[num_terms++] = F1->state;
+  }
+  if (ndlqr_IsBlockNonzero(fact, index, fact_level, ndlqr_kInput, step)) {
+    C[num_terms] = C1->input;
+    F[num_terms++] = F1->input;
+  }
+  bool F2x_nonzero = ndlqr_IsBlockNonzero(fact, index + 1, fact_level, ndlqr_kState, step);
+  bool F2u_nonzero = ndlqr_IsBlockNonzero(fact, index + 1, fact_level, ndlqr_kInput, step);
+  if (data->coupling_state == ndlqr_kDenseBlock && F2x_nonzero) {
+    C[num_terms] = C2->state;
+    F[num_terms++] = F2->state;
+  }
+  if (data->coupling_input == ndlqr_kDenseBlock && F2u_nonzero) {
+    C[num_terms] = C2->input;
+    F[num_terms++] = F2->input;
+  }
+  bool minus_identity = data->coupling_state == ndlqr_kMinusIdentityBlock && F2x_nonzero;
+  *minus_F2x = minus_identity ? &F2->state : NULL;  // C2x'F2x = -F2x
+  return num_terms;
+}
+
+int ndlqr_FactorInnerProduct(NdData* data, NdData* fact, int index, int data_level,
+                             int fact_level) {
+  // S = C1x'F1x + C1u'F1u + C2x'F2x + C2u'F2u - S, in a single fused kernel
+  Matrix C[4];
+  Matrix F[4];
+  Matrix S;
+  Matrix* minus_F2x;
+  int num_terms = GetInnerProductTerms(data, fact, index, data_level, fact_level, C, F, &S,
+                                       &minus_F2x);
+  if (fact_level == data_level && S.rows == S.cols) {
+    // The diagonal block of the Schur complement is symmetric, so only compute half of it.
+    // The right-hand side passed in during the solution phase is a vector.
+    MatrixSymmetricTransposeMultiplySum(C, F, num_terms, &S, 1.0, -1.0);
+  } else {
+    MatrixTransposeMultiplySum(C, F, num_terms, &S, 1.0, -1.0);
+  }
+  if (minus_F2x) {
+    MatrixAddition(minus_F2x, &S, -1.0);
+  }
   return 0;
 }
 
@@ -147,26 +191,73 @@ int ndlqr_SolveCholeskyFactor(NdData* fact, CholeskyInfo* cholinfo, int index, i
   ndlqr_GetNdFactor(fact, index + 1, upper_level, &G);
   Matrix f = G->lambda;
 
+  // Nothing to solve if the right-hand side is still zero
+  int step = ndlqr_GetShurStep(level);
+  if (!ndlqr_IsBlockNonzero(fact, index + 1, upper_level, ndlqr_kLambda, step)) return 0;
   MatrixCholeskySolveWithInfo(&Sbar, &f, cholinfo);
   return 0;
 }
 
-int ndlqr_UpdateShurFactor(NdData* fact, NdData* soln, int index, int i, int level,
-                           int upper_level, bool calc_lambda) {
-  if (!fact || !soln) return -1;
+int ndlqr_SolveInverseFactor(NdData* fact, Matrix* Sinv, Matrix* work, int index, int level,
+                             int upper_level) {
+  if (!fact || !Sinv || !work) return -1;
+  if (upper_level <= level) {
+    fprintf(stderr, "ERROR: `upper_level` must be greater than `level`.");
+  }
+  NdFactor* G;
+  ndlqr_GetNdFactor(fact, index + 1, upper_level, &G);
+  Matrix f = G->lambda;
+
+  // Nothing to solve if the right-hand side is still zero
+  int step = ndlqr_GetShurStep(level);
+  if (!ndlqr_IsBlockNonzero(fact, index + 1, upper_level, ndlqr_kLambda, step)) return 0;
+  return MatrixInverseSolve(Sinv, &f, work);
+}
 
+/*
+ * Blocks updated by ndlqr_UpdateShurFactor(), which computes g = g - F * f for each
+ * pair of blocks in Fblocks and gblocks. Returns the number of blocks, which is zero if
+ * the right-hand side f is still zero.
+ */
+static int GetShurUpdateBlocks(NdData* fact, NdData* soln, int index, int i, int level,
+                               int upper_level, bool calc_lambda, Matrix* Fblocks,
+                               Matrix* gblocks, Matrix* f) {
   NdFactor* f_factor;
   NdFactor* g;
   NdFactor* F;
   ndlqr_GetNdFactor(soln, index + 1, upper_level, &f_factor);
   ndlqr_GetNdFactor(soln, i, upper_level, &g);
   ndlqr_GetNdFactor(fact, i, level, &F);
-  Matrix* f = &f_factor->lambda;
-  if (calc_lambda) {
-    MatrixMultiply(&F->lambda, f, &g->lambda, 0, 0, -1.0, 1.0);
+  *f = f_factor->lambda;
+
+  // Skip lambda if not needed and any blocks of F that are zero
+  int step = ndlqr_GetShurStep(level);
+  if (!ndlqr_IsBlockNonzero(soln, index + 1, upper_level, ndlqr_kLambda, step)) return 0;
+  Matrix Fall[3] = {F->lambda, F->state, F->input};
+  Matrix gall[3] = {g->lambda, g->state, g->input};
+  int num_blocks = 0;
+  for (int b = calc_lambda ? ndlqr_kLambda : ndlqr_kState; b <= ndlqr_kInput; ++b) {
+    if (ndlqr_IsBlockNonzero(fact, i, level, b, step)) {
+      Fblocks[num_blocks] = Fall[b];
+      gblocks[num_blocks++] = gall[b];
+    }
+  }
+  return num_blocks;
+}
+
+int ndlqr_UpdateShurFactor(NdData* fact, NdData* soln, int index, int i, int level,
+                           int upper_level, bool calc_lambda) {
+  if (!fact || !soln) return -1;
+
+  // Update the [lambda; state; input] stack in a single call
+  Matrix Fblocks[3];
+  Matrix gblocks[3];
+  Matrix f;
+  int num_blocks = GetShurUpdateBlocks(fact, soln, index, i, level, upper_level,
+                                       calc_lambda, Fblocks, gblocks, &f);
+  if (num_blocks > 0) {
+    MatrixMultiplyStacked(Fblocks, &f, gblocks, num_blocks, -1.0, 1.0);
   }
-  MatrixMultiply(&F->state, f, &g->state, 0, 0, -1.0, 1.0);
-  MatrixMultiply(&F->input, f, &g->input, 0, 0, -1.0, 1.0);
   return 0;
 }
 
@@ -190,3 +281,399 @@ int ndlqr_ComputeShurCompliment(NdLqrSolver* solver, int index, int level,
   }
   return 0;
 }
+
+/*
+ * Intra-block parallel phases
+ *
+ * Every thread of the team works on each block, so these are called by all the threads
+ * instead of being given a range of work items.
+ */
+// Columns of an (n,ncols) block handled by the calling thread of the team
+static UnitRange GetThreadColumns(int ncols) {
+  int num_threads = omp_get_num_threads();
+  int threadid = omp_get_thread_num();
+  int cols_per_thread = ncols / num_threads;
+  UnitRange cols = {cols_per_thread * threadid, cols_per_thread * (threadid + 1)};
+  if (threadid == num_threads - 1) cols.stop = ncols;
+  return cols;
+}
+
+bool ndlqr_UseIntraBlockParallelism(NdLqrSolver* solver, int level) {
+  int numleaves = PowerOfTwo(solver->depth - level - 1);
+  return solver->intra_block_min_size > 0 &&
+         solver->nstates >= solver->intra_block_min_size &&
+         numleaves < solver->num_threads;
+}
+
+int ndlqr_ParallelBlockCholesky(NdLqrSolver* solver, int level) {
+  if (!solver) return -1;
+  int numleaves = PowerOfTwo(solver->depth - level - 1);
+  int out = 0;
+  for (int leaf = 0; leaf < numleaves; ++leaf) {
+    int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
+    NdFactor* F;
+    ndlqr_GetNdFactor(solver->fact, index + 1, level, &F);
+    Matrix Sbar = F->lambda;
+    CholeskyInfo* cholinfo;
+    ndlqr_GetSFactorization(solver->cholfacts, leaf, level, &cholinfo);
+    if (MatrixCholeskyFactorizeParallel(&Sbar, cholinfo) != 0) {
+      out = -1;
+      continue;
+    }
+
+    // Cache the explicit inverse, if requested, by solving against a slice of the
+    // columns of the identity on each thread
+    Matrix* Sinv;
+    if (ndlqr_GetSInverse(solver->cholfacts, leaf, level, &Sinv) == 0) {
+      UnitRange cols = GetThreadColumns(Sinv->cols);
+      Matrix X = {Sinv->rows, cols.stop - cols.start, Sinv->data + cols.start * Sinv->rows};
+      MatrixSetConst(&X, 0.0);
+      for (int j = cols.start; j < cols.stop; ++j) {
+        MatrixSetElement(Sinv, j, j, 1.0);
+      }
+      if (X.cols > 0) MatrixCholeskySolveWithInfo(&Sbar, &X, cholinfo);
+    }
+  }
+  return out;
+}
+
+int ndlqr_ParallelBlockCholeskySolves(NdLqrSolver* solver, int level) {
+  if (!solver) return -1;
+  int depth = solver->depth;
+  int numleaves = PowerOfTwo(depth - level - 1);
+  int step = ndlqr_GetShurStep(level);
+  UnitRange cols = GetThreadColumns(solver->nstates);
+  if (cols.stop == cols.start) return 0;
+  for (int leaf = 0; leaf < numleaves; ++leaf) {
+    int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
+    NdFactor* F;
+    ndlqr_GetNdFactor(solver->fact, index + 1, level, &F);
+    Matrix Sbar = F->lambda;
+    Matrix* Sinv;
+    Matrix* work;
+    ndlqr_GetSInverse(solver->cholfacts, leaf, level, &Sinv);
+    ndlqr_GetInverseWorkspace(solver->cholfacts, omp_get_thread_num(), &work);
+    CholeskyInfo* cholinfo;
+    ndlqr_GetSFactorization(solver->cholfacts, leaf, level, &cholinfo);
+    for (int upper_level = level + 1; upper_level < depth; ++upper_level) {
+      bool nonzero =
+          ndlqr_IsBlockNonzero(solver->fact, index + 1, upper_level, ndlqr_kLambda, step);
+      if (!nonzero) continue;
+      NdFactor* G;
+      ndlqr_GetNdFactor(solver->fact, index + 1, upper_level, &G);
+      Matrix f = G->lambda;
+      Matrix fcols = {f.rows, cols.stop - cols.start, f.data + cols.start * f.rows};
+      if (Sinv && work) {
+        MatrixInverseSolve(Sinv, &fcols, work);
+      } else {
+        MatrixCholeskySolveWithInfo(&Sbar, &fcols, cholinfo);
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Batched phases
+ *
+ * The work items of each phase are collected in chunks of kNdLqrBatchSize, and the
+ * block operations of each chunk are passed to the linear algebra library in a single
+ * batched call.
+ */
+#define kNdLqrBatchSize 64
+
+// A chunk of independent products C = alpha * op(A) * B + beta * C
+typedef struct {
+  Matrix A[kNdLqrBatchSize];
+  Matrix B[kNdLqrBatchSize];
+  Matrix C[kNdLqrBatchSize];
+  int count;
+} NdProductBatch;
+
+static void AddToBatch(NdProductBatch* batch, Matrix* A, Matrix* B, Matrix* C) {
+  batch->A[batch->count] = *A;
+  batch->B[batch->count] = *B;
+  batch->C[batch->count] = *C;
+  ++batch->count;
+}
+
+static void FlushBatch(NdProductBatch* batch, bool tA, double alpha, double beta) {
+  MatrixMultiplyBatched(batch->A, batch->B, batch->C, batch->count, tA, false, alpha,
+                        beta);
+  batch->count = 0;
+}
+
+/*
+ * During the factorization, a phase has a work item for every leaf (or knot point) and
+ * every upper level starting at first_upper_level. During the solution pass, there is
+ * one item per leaf (or knot point), for level 0 of the solution vector.
+ */
+static void GetBatchWorkItem(NdLqrSolver* solver, bool factorization, int first_upper_level,
+                             int item, int* i, int* upper_level) {
+  if (factorization) {
+    int num_levels = solver->depth - first_upper_level;
+    *i = item / num_levels;
+    *upper_level = first_upper_level + (item % num_levels);
+  } else {
+    *i = item;
+    *upper_level = 0;
+  }
+}
+
+int ndlqr_BatchedInnerProducts(NdLqrSolver* solver, NdData* soln, int level,
+                               UnitRange work) {
+  if (!solver || !soln) return -1;
+  bool factorization = soln == solver->fact;
+
+  // Term t of every product in the chunk is computed by batch t, so that no two products
+  // in a batch update the same output
+  NdProductBatch terms[4];
+  Matrix negate[kNdLqrBatchSize];
+  Matrix minus_F2x[kNdLqrBatchSize];
+  Matrix minus_F2x_out[kNdLqrBatchSize];
+  int num_items = 0;
+  int num_negate = 0;
+  int num_minus_F2x = 0;
+  for (int t = 0; t < 4; ++t) terms[t].count = 0;
+  for (int item = work.start; item < work.stop; ++item) {
+    int leaf;
+    int fact_level;
+    GetBatchWorkItem(solver, factorization, level, item, &leaf, &fact_level);
+    int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
+    Matrix C[4];
+    Matrix F[4];
+    Matrix S;
+    Matrix* F2x;
+    int num_terms =
+        GetInnerProductTerms(solver->data, soln, index, level, fact_level, C, F, &S, &F2x);
+    for (int t = 0; t < num_terms; ++t) {
+      AddToBatch(&terms[t], C + t, F + t, &S);
+    }
+    if (num_terms == 0) negate[num_negate++] = S;
+    if (F2x) {
+      minus_F2x[num_minus_F2x] = *F2x;
+      minus_F2x_out[num_minus_F2x++] = S;
+    }
+
+    // S = C1x'F1x + C1u'F1u + C2x'F2x + C2u'F2u - S
+    if (++num_items == kNdLqrBatchSize || item == work.stop - 1) {
+      for (int t = 0; t < 4; ++t) {
+        FlushBatch(&terms[t], true, 1.0, t == 0 ? -1.0 : 1.0);
+      }
+      for (int i = 0; i < num_negate; ++i) {
+        MatrixScaleByConst(negate + i, -1.0);
+      }
+      for (int i = 0; i < num_minus_F2x; ++i) {
+        MatrixAddition(minus_F2x + i, minus_F2x_out + i, -1.0);
+      }
+      num_items = 0;
+      num_negate = 0;
+      num_minus_F2x = 0;
+    }
+  }
+  return 0;
+}
+
+int ndlqr_BatchedCholesky(NdLqrSolver* solver, int level, UnitRange leaves) {
+  if (!solver) return -1;
+  Matrix Sbar[kNdLqrBatchSize];
+  CholeskyInfo* cholinfo[kNdLqrBatchSize];
+  int count = 0;
+  int out = 0;
+  for (int leaf = leaves.start; leaf < leaves.stop; ++leaf) {
+    int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
+    NdFactor* F;
+    ndlqr_GetNdFactor(solver->fact, index + 1, level, &F);
+    Sbar[count] = F->lambda;
+    ndlqr_GetSFactorization(solver->cholfacts, leaf, level, cholinfo + count);
+    ++count;
+    if (count == kNdLqrBatchSize || leaf == leaves.stop - 1) {
+      if (MatrixCholeskyFactorizeBatched(Sbar, count, cholinfo) != 0) out = -1;
+      count = 0;
+    }
+  }
+
+  // Cache the explicit inverses, if requested
+  for (int leaf = leaves.start; leaf < leaves.stop; ++leaf) {
+    Matrix* Sinv;
+    if (ndlqr_GetSInverse(solver->cholfacts, leaf, level, &Sinv) != 0) break;
+    int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
+    NdFactor* F;
+    CholeskyInfo* info;
+    ndlqr_GetNdFactor(solver->fact, index + 1, level, &F);
+    ndlqr_GetSFactorization(solver->cholfacts, leaf, level, &info);
+    MatrixCholeskyInverseWithInfo(&F->lambda, Sinv, 1.0, info);
+  }
+  return out;
+}
+
+int ndlqr_BatchedCholeskySolves(NdLqrSolver* solver, NdData* soln, int level,
+                                UnitRange work) {
+  if (!solver || !soln) return -1;
+  bool factorization = soln == solver->fact;
+  int step = ndlqr_GetShurStep(level);
+  Matrix Sbar[kNdLqrBatchSize];
+  Matrix rhs[kNdLqrBatchSize];
+  int count = 0;
+  int out = 0;
+  for (int item = work.start; item < work.stop; ++item) {
+    int leaf;
+    int upper_level;
+    GetBatchWorkItem(solver, factorization, level + 1, item, &leaf, &upper_level);
+    int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
+    NdFactor* F;
+    NdFactor* G;
+    ndlqr_GetNdFactor(solver->fact, index + 1, level, &F);
+    ndlqr_GetNdFactor(soln, index + 1, upper_level, &G);
+
+    // Nothing to solve if the right-hand side is still zero
+    bool nonzero =
+        !factorization ||
+        ndlqr_IsBlockNonzero(soln, index + 1, upper_level, ndlqr_kLambda, step);
+    Matrix* Sinv;
+    Matrix* work_inv;
+    ndlqr_GetSInverse(solver->cholfacts, leaf, level, &Sinv);
+    ndlqr_GetInverseWorkspace(solver->cholfacts, omp_get_thread_num(), &work_inv);
+    if (nonzero && Sinv && work_inv) {
+      MatrixInverseSolve(Sinv, &G->lambda, work_inv);
+    } else if (nonzero) {
+      Sbar[count] = F->lambda;
+      rhs[count++] = G->lambda;
+    }
+    if (count == kNdLqrBatchSize || (count > 0 && item == work.stop - 1)) {
+      if (MatrixCholeskySolveBatched(Sbar, rhs, count) != 0) out = -1;
+      count = 0;
+    }
+  }
+  return out;
+}
+
+int ndlqr_BatchedShurUpdates(NdLqrSolver* solver, NdData* soln, int level,
+                             UnitRange work) {
+  if (!solver || !soln) return -1;
+  bool factorization = soln == solver->fact;
+  NdProductBatch batch;
+  batch.count = 0;
+  for (int item = work.start; item < work.stop; ++item) {
+    int k;
+    int upper_level;
+    GetBatchWorkItem(solver, factorization, level + 1, item, &k, &upper_level);
+    int index = ndlqr_GetIndexAtLevel(&solver->tree, k, level);
+    bool calc_lambda = ndlqr_ShouldCalcLambda(&solver->tree, index, k);
+    Matrix Fblocks[3];
+    Matrix gblocks[3];
+    Matrix f;
+    int num_blocks = GetShurUpdateBlocks(solver->fact, soln, index, k, level, upper_level,
+                                         calc_lambda, Fblocks, gblocks, &f);
+    if (batch.count + num_blocks > kNdLqrBatchSize) {
+      FlushBatch(&batch, false, -1.0, 1.0);
+    }
+    for (int b = 0; b < num_blocks; ++b) {
+      AddToBatch(&batch, Fblocks + b, &f, gblocks + b);
+    }
+  }
+  FlushBatch(&batch, false, -1.0, 1.0);
+  return 0;
+}
+
+int ndlqr_GetProductStep(int level) { return 2 * level + 1; }
+
+int ndlqr_GetShurStep(int level) { return 2 * level + 2; }
+
+int ndlqr_BuildSparsityMap(NdLqrSolver* solver) {
+  if (!solver) return -1;
+  NdData* data = solver->data;
+  NdData* fact = solver->fact;
+  OrderedBinaryTree* tree = &solver->tree;
+  if (ndlqr_NewSparsityMap(fact) != 0) return -1;
+
+  long n = solver->nstates;
+  long m = solver->ninputs;
+  int nhorizon = solver->nhorizon;
+  int depth = solver->depth;
+  long rows[3] = {n, n, m};
+  long skipped_flops = 0;
+
+  // Leaves. Mirrors ndlqr_SolveLeaf().
+  int step = 0;
+  ndlqr_SetBlockNonzero(fact, 0, 0, ndlqr_kLambda, step);
+  ndlqr_SetBlockNonzero(fact, 0, 0, ndlqr_kInput, step);
+  for (int k = 1; k < nhorizon; ++k) {
+    if (k < nhorizon - 1) {
+      int level = ndlqr_GetIndexLevel(tree, k);
+      ndlqr_SetBlockNonzero(fact, k, level, ndlqr_kState, step);
+      ndlqr_SetBlockNonzero(fact, k, level, ndlqr_kInput, step);
+    }
+    int prev_level = ndlqr_GetIndexLevel(tree, k - 1);
+    ndlqr_SetBlockNonzero(fact, k, prev_level, ndlqr_kState, step);
+    if (data->coupling_input == ndlqr_kDenseBlock && k < nhorizon - 1) {
+      ndlqr_SetBlockNonzero(fact, k, prev_level, ndlqr_kInput, step);
+    }
+  }
+
+  for (int level = 0; level < depth; ++level) {
+    int numleaves = PowerOfTwo(depth - level - 1);
+
+    // Inner products. Mirrors ndlqr_FactorInnerProduct().
+    step = ndlqr_GetProductStep(level);
+    for (int leaf = 0; leaf < numleaves; ++leaf) {
+      int index = ndlqr_GetIndexFromLeaf(tree, leaf, level);
+      for (int upper_level = level; upper_level < depth; ++upper_level) {
+        bool nonzero =
+            ndlqr_IsBlockNonzero(fact, index + 1, upper_level, ndlqr_kLambda, step);
+        for (int b = ndlqr_kState; b <= ndlqr_kInput; ++b) {
+          long term_flops = 2 * rows[b] * n * n;
+          if (ndlqr_IsBlockNonzero(fact, index, upper_level, b, step)) {
+            nonzero = true;
+          } else {
+            skipped_flops += term_flops;
+          }
+          NdBlockStructure coupling =
+              b == ndlqr_kState ? data->coupling_state : data->coupling_input;
+          if (coupling == ndlqr_kZeroBlock) continue;
+          if (coupling == ndlqr_kMinusIdentityBlock) term_flops = n * n;
+          if (ndlqr_IsBlockNonzero(fact, index + 1, upper_level, b, step)) {
+            nonzero = true;
+          } else {
+            skipped_flops += term_flops;
+          }
+        }
+        if (nonzero) {
+          ndlqr_SetBlockNonzero(fact, index + 1, upper_level, ndlqr_kLambda, step);
+        }
+      }
+    }
+
+    // Cholesky solves. Mirrors ndlqr_SolveCholeskyFactor().
+    step = ndlqr_GetShurStep(level);
+    for (int leaf = 0; leaf < numleaves; ++leaf) {
+      int index = ndlqr_GetIndexFromLeaf(tree, leaf, level);
+      for (int upper_level = level + 1; upper_level < depth; ++upper_level) {
+        if (!ndlqr_IsBlockNonzero(fact, index + 1, upper_level, ndlqr_kLambda, step)) {
+          skipped_flops += 2 * n * n * n;
+        }
+      }
+    }
+
+    // Schur complements, for both the factorization and the solution vector.
+    // Mirrors ndlqr_UpdateShurFactor().
+    for (int k = 0; k < nhorizon; ++k) {
+      int index = ndlqr_GetIndexAtLevel(tree, k, level);
+      bool calc_lambda = ndlqr_ShouldCalcLambda(tree, index, k);
+      for (int b = calc_lambda ? ndlqr_kLambda : ndlqr_kState; b <= ndlqr_kInput; ++b) {
+        bool F_nonzero = ndlqr_IsBlockNonzero(fact, k, level, b, step);
+        if (!F_nonzero) skipped_flops += 2 * rows[b] * n;
+        for (int upper_level = level + 1; upper_level < depth; ++upper_level) {
+          if (F_nonzero &&
+              ndlqr_IsBlockNonzero(fact, index + 1, upper_level, ndlqr_kLambda, step)) {
+            ndlqr_SetBlockNonzero(fact, k, upper_level, b, step);
+          } else {
+            skipped_flops += 2 * rows[b] * n * n;
+          }
+        }
+      }
+    }
+  }
+  solver->skipped_flops = skipped_flops;
+  return 0;
+}
@@ -38,6 +38,18 @@
  */
 int ndlqr_SolveLeaf(NdLqrSolver* solver, int index);
 
+/**
+ * @brief Apply the leaf solve of a knot point to a right-hand side
+ *
+ * The part of ndlqr_SolveLeaf() that updates the right-hand side, applied to @p soln.
+ *
+ * @param solver rsLQR solver, with the cost diagonals of the problem
+ * @param soln   Right-hand side, with the same layout as NdLqrSolver.soln
+ * @param index  Knot point index
+ * @return 0 if successful
+ */
+int ndlqr_SolveLeafRightHandSide(NdLqrSolver* solver, NdData* soln, int index);
+
 int ndlqr_SolveLeaves(NdLqrSolver* solver);
 
 /**
@@ -56,6 +68,10 @@ int ndlqr_SolveLeaves(NdLqrSolver* solver);
  * where \f$ j \f$ is @p data_level, \f$ p \f$ is @p fact_level, and \f$ k \f$ is
  * @p index.
  *
+ * When @p fact_level equals @p data_level during the factorization, the result is the
+ * symmetric block that gets Cholesky-factored in the solve, so only its lower triangle
+ * is computed.
+ *
  * @param data       The data for the original KKT matrix
  * @param fact       The current data for the factorization
  * @param index      Knot point index
@@ -99,6 +115,24 @@ int ndlqr_FactorInnerProduct(NdData* data, NdData* fact, int index, int data_lev
 int ndlqr_SolveCholeskyFactor(NdData* fact, CholeskyInfo* cholinfo, int index, int level,
                               int upper_level);
 
+/**
+ * @brief Same as ndlqr_SolveCholeskyFactor(), but using a cached explicit inverse
+ *
+ * Computes the solution as a matrix multiplication with the inverse of
+ * \f$ \bar{\Lambda}_{k+1}^{(j)} \f$. See ndlqr_EnableInverseCaching().
+ *
+ * @param fact        Data for the factorization
+ * @param Sinv        Cached inverse of \f$ \bar{\Lambda}_{k+1}^{(j)} \f$.
+ * @param work        Scratch matrix of size (n,n) not being used by any other thread.
+ * @param index       Knot point index. Should be calculated using ndlqr_GetIndexFromLeaf().
+ * @param level       Level index for the level currently being processed by the
+ *                    upper-level solve.
+ * @param upper_level Level index for the right-hand-side. @p upper_level > @p level.
+ * @return 0 if successful
+ */
+int ndlqr_SolveInverseFactor(NdData* fact, Matrix* Sinv, Matrix* work, int index, int level,
+                             int upper_level);
+
 /**
  * @brief Determines if the \f$ \Lambda \f$ should be updated during
  *        ndlqr_UpdateSchurFactor()
@@ -146,4 +180,144 @@ int ndlqr_UpdateShurFactor(NdData* fact, NdData* soln, int index, int i, int lev
 
 int ndlqr_ComputeShurCompliment(NdLqrSolver* solver, int index, int level, int upper_level);
 
+/**
+ * @brief Batched version of the inner products computed at level @p level
+ *
+ * Computes the same products as ndlqr_FactorInnerProduct() for the work items in
+ * @p work, but passes them to the linear algebra library in batches (see
+ * MatrixMultiplyBatched()). The symmetric blocks are computed in full.
+ *
+ * During the factorization (@p soln is `solver->fact`), work item `i` is the product for
+ * leaf `i / (depth - level)` and upper level `level + i % (depth - level)`. During the
+ * solution pass (@p soln is `solver->soln`), work item `i` is the product for leaf `i`.
+ *
+ * @param solver An initialized rsLQR solver
+ * @param soln   Factorization data or solution vector
+ * @param level  Level currently being processed
+ * @param work   Range of work items to process
+ * @return 0 if successful
+ */
+int ndlqr_BatchedInnerProducts(NdLqrSolver* solver, NdData* soln, int level,
+                               UnitRange work);
+
+/**
+ * @brief Batched Cholesky factorization of the blocks for the leaves at @p level
+ *
+ * Also caches the explicit inverses of the factors, if enabled.
+ *
+ * @param solver An initialized rsLQR solver
+ * @param level  Level currently being processed
+ * @param leaves Range of leaves to process
+ * @return 0 if every factorization was successful
+ */
+int ndlqr_BatchedCholesky(NdLqrSolver* solver, int level, UnitRange leaves);
+
+/**
+ * @brief Batched version of ndlqr_SolveCholeskyFactor()
+ *
+ * Work items are numbered like ndlqr_BatchedInnerProducts(), starting at the level above
+ * @p level during the factorization. Blocks with a cached inverse are solved one at a
+ * time with ndlqr_SolveInverseFactor().
+ *
+ * @param solver An initialized rsLQR solver
+ * @param soln   Factorization data or solution vector
+ * @param level  Level currently being processed
+ * @param work   Range of work items to process
+ * @return 0 if successful
+ */
+int ndlqr_BatchedCholeskySolves(NdLqrSolver* solver, NdData* soln, int level,
+                                UnitRange work);
+
+/**
+ * @brief Batched version of ndlqr_UpdateShurFactor()
+ *
+ * Work items are numbered like ndlqr_BatchedCholeskySolves(), except by knot point
+ * instead of by leaf.
+ *
+ * @param solver An initialized rsLQR solver
+ * @param soln   Factorization data or solution vector
+ * @param level  Level currently being processed
+ * @param work   Range of work items to process
+ * @return 0 if successful
+ */
+int ndlqr_BatchedShurUpdates(NdLqrSolver* solver, NdData* soln, int level,
+                             UnitRange work);
+
+/**
+ * @brief Check if the blocks at @p level should be split across threads
+ *
+ * True if intra-block parallelism is enabled for the problem size (see
+ * ndlqr_SetIntraBlockParallelism()) and @p level has fewer leaves than threads.
+ *
+ * @param solver An initialized rsLQR solver
+ * @param level  Level currently being processed
+ */
+bool ndlqr_UseIntraBlockParallelism(NdLqrSolver* solver, int level);
+
+/**
+ * @brief Cholesky factorization of the blocks at @p level, using all threads for each
+ *
+ * Factors the blocks of each leaf one after the other with
+ * MatrixCholeskyFactorizeParallel(), and computes the cached inverses, if enabled, by
+ * splitting the columns of the identity between the threads. Must be called by every
+ * thread of the team.
+ *
+ * @param solver An initialized rsLQR solver
+ * @param level  Level currently being processed
+ * @return 0 if every factorization was successful
+ */
+int ndlqr_ParallelBlockCholesky(NdLqrSolver* solver, int level);
+
+/**
+ * @brief Cholesky solves of the factorization at @p level, using all threads for each
+ *
+ * Same as calling ndlqr_SolveCholeskyFactor() (or ndlqr_SolveInverseFactor()) for every
+ * leaf and upper level, but each thread solves for its own slice of the columns of each
+ * right-hand side, so no synchronization is needed. Must be called by every thread of
+ * the team.
+ *
+ * @param solver An initialized rsLQR solver
+ * @param level  Level currently being processed
+ * @return 0 if successful
+ */
+int ndlqr_ParallelBlockCholeskySolves(NdLqrSolver* solver, int level);
+
+/**
+ * @brief Step of the solve for the inner products at level @p level
+ *
+ * The steps of the solve are used to index the block sparsity map. The leaves are step 0,
+ * and each level of the factorization takes two steps: one for the inner products and
+ * one for the Cholesky solves and Schur complements.
+ *
+ * @param level Level index
+ * @return The step index
+ */
+int ndlqr_GetProductStep(int level);
+
+/**
+ * @brief Step of the solve for the Cholesky solves and Schur complements at @p level
+ *
+ * See ndlqr_GetProductStep().
+ *
+ * @param level Level index
+ * @return The step index
+ */
+int ndlqr_GetShurStep(int level);
+
+/**
+ * @brief Build the block sparsity map for the factorization
+ *
+ * Steps through the solve symbolically, recording when each block of the factorization
+ * data first becomes nonzero. During the solve, products with blocks that are still zero
+ * are skipped. Also counts the number of flops skipped in each solve, stored in
+ * NdLqrSolver.skipped_flops.
+ *
+ * Depends on the structure of the coupling blocks, so it should be rebuilt whenever
+ * NdData.coupling_state or NdData.coupling_input of the problem data change.
+ *
+ * @param solver An initialized rsLQR solver
+ * @return 0 if successful
+ */
+int ndlqr_BuildSparsityMap(NdLqrSolver* solver);
+
 /**@} */
@@ -71,11 +71,11 @@ int ndlqr_BackwardPass(RiccatiSolver* solver) {
     MatrixCopyDiagonal(Qxx, &Qd);
     MatrixCopyDiagonal(Quu, &Rd);
 
-    MatrixMultiply(&A, Pn, Qxx_tmp, 1, 0, 1.0, 0.0);   // Qxx = A'P
-    MatrixMultiply(&B, Pn, Qux_tmp, 1, 0, 1.0, 0.0);   // Qux = B'P
-    MatrixMultiply(Qxx_tmp, &A, Qxx, 0, 0, 1.0, 1.0);  // Qxx = Q + A'P*A
-    MatrixMultiply(Qux_tmp, &B, Quu, 0, 0, 1.0, 1.0);  // Quu = R + B'P*B
-    MatrixMultiply(Qux_tmp, &A, Qux, 0, 0, 1.0, 0.0);  // Qux = B'P*A
+    MatrixMultiply(&A, Pn, Qxx_tmp, 1, 0, 1.0, 0.0);                  // Qxx = A'P
+    MatrixMultiply(&B, Pn, Qux_tmp, 1, 0, 1.0, 0.0);                  // Qux = B'P
+    MatrixMultiplySymmetricResult(Qxx_tmp, &A, Qxx, 0, 0, 1.0, 1.0);  // Qxx = Q + A'P*A
+    MatrixMultiplySymmetricResult(Qux_tmp, &B, Quu, 0, 0, 1.0, 1.0);  // Quu = R + B'P*B
+    MatrixMultiply(Qux_tmp, &A, Qux, 0, 0, 1.0, 0.0);                 // Qux = B'P*A
 
     // Calculate Gains
     Matrix* K = solver->K + k;
@@ -84,7 +84,7 @@ int ndlqr_BackwardPass(RiccatiSolver* solver) {
     MatrixCopy(K, Qux);
     MatrixCopy(d, Qu);
 
-    CholeskyInfo cholinfo = {'L', 0, 'E', NULL, 0};
+    CholeskyInfo cholinfo = {'L', 0, 'E', NULL};
     MatrixCholeskyFactorizeWithInfo(Quu_tmp, &cholinfo);
     MatrixCholeskySolveWithInfo(Quu_tmp, K, &cholinfo);
     MatrixCholeskySolveWithInfo(Quu_tmp, d, &cholinfo);
@@ -97,10 +97,9 @@ int ndlqr_BackwardPass(RiccatiSolver* solver) {
     Matrix* p = solver->p + k;
 
     MatrixCopy(P, Qxx);
-    MatrixMultiply(Quu, K, Qux_tmp, 0, 0, 1.0, 0.0);  // Qux_tmp = Quu * K
-    MatrixMultiply(K, Qux_tmp, P, 1, 0, 1.0, 1.0);    // P = Qxx + K'Quu*K
-    MatrixMultiply(K, Qux, P, 1, 0, 1.0, 1.0);        // P = Quu + K'Quu*K + K'Qux
-    MatrixMultiply(Qux, K, P, 1, 0, 1.0, 1.0);        // P = Quu + K'Quu*K + K'Qux + Qux'K
+    MatrixMultiply(Quu, K, Qux_tmp, 0, 0, 1.0, 0.0);               // Qux_tmp = Quu * K
+    MatrixMultiplySymmetricResult(K, Qux_tmp, P, 1, 0, 1.0, 1.0);  // P = Qxx + K'Quu*K
+    MatrixSymmetricRank2kUpdate(K, Qux, P, 1.0, 1.0);              // P += K'Qux + Qux'K
 
     MatrixCopy(p, Qx);
     MatrixMultiply(Quu, d, Qu_tmp, 0, 0, 1.0, 0.0);  // Qu_tmp = Quu * d
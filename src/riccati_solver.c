@@ -4,31 +4,35 @@
 #include <stdlib.h>
 #include <string.h>
 
+size_t ndlqr_GetRiccatiDataSize(int nstates, int ninputs, int nhorizon) {
+  // Computed in size_t, since it can exceed the range of an int for long horizons
+  size_t n = nstates;
+  size_t m = ninputs;
+  size_t num_K = m * n * (nhorizon - 1);
+  size_t num_d = m * (nhorizon - 1);
+  size_t num_P = n * n * nhorizon;
+  size_t num_p = n * nhorizon;
+  size_t num_X = n * nhorizon;
+  size_t num_U = m * (nhorizon - 1);
+  size_t num_Y = n * nhorizon;
+  size_t num_Q = 2 * (n * n + m * m + m * n + n + m);
+  return num_K + num_d + num_P + num_p + num_X + num_U + num_Y + num_Q;
+}
+
 RiccatiSolver* ndlqr_NewRiccatiSolver(LQRProblem* lqrprob) {
   int nhorizon = lqrprob->nhorizon;
   int nstates = lqrprob->lqrdata[0]->nstates;
   int ninputs = lqrprob->lqrdata[0]->ninputs;
-  int nvars = (2 * nstates + ninputs) * nhorizon - ninputs;
-
-  int dim_K = ninputs * nstates;
-  int dim_d = ninputs;
-  int dim_P = nstates * nstates;
-  int dim_p = nstates;
-  int dim_X = nstates;
-  int dim_U = ninputs;
-  int dim_Y = nstates;
-  int dim_Q = nstates * nstates + ninputs * ninputs + ninputs * nstates + nstates + ninputs;
+  int nvars = ndlqr_GetNumVariables(nstates, ninputs, nhorizon);
+  if (nvars < 0) {
+    fprintf(stderr, "ERROR: Too many variables for the solver.\n");
+    return NULL;
+  }
+  size_t dim_Q = (size_t)nstates * nstates + ninputs * ninputs + ninputs * nstates +
+                 nstates + ninputs;
   int len_Q = 2;
 
-  int num_K = dim_K * (nhorizon - 1);
-  int num_d = dim_d * (nhorizon - 1);
-  int num_P = dim_P * nhorizon;
-  int num_p = dim_p * nhorizon;
-  int num_X = dim_X * nhorizon;
-  int num_U = dim_U * (nhorizon - 1);
-  int num_Y = dim_Y * nhorizon;
-  int num_Q = dim_Q * len_Q;
-  int total_size = num_K + num_d + num_P + num_p + num_X + num_U + num_Y + num_Q;
+  size_t total_size = ndlqr_GetRiccatiDataSize(nstates, ninputs, nhorizon);
   double* data = (double*)malloc(total_size * sizeof(double));
   if (!data) return NULL;
   memset(data, 0, total_size * sizeof(double));
@@ -47,7 +51,7 @@ RiccatiSolver* ndlqr_NewRiccatiSolver(LQRProblem* lqrprob) {
   Matrix* Y = (Matrix*)malloc(nhorizon * sizeof(Matrix));
 
   // clang-format off
-  int offset = 0;
+  size_t offset = 0;
   for (int k = 0; k < nhorizon; ++k) {
     P[k].rows = nstates;
     P[k].cols = nstates;
@@ -85,7 +89,7 @@ RiccatiSolver* ndlqr_NewRiccatiSolver(LQRProblem* lqrprob) {
   // clang-format off
 
   // Initialize the temporary Q matrices
-  offset = total_size - num_Q;
+  offset = total_size - dim_Q * len_Q;
   Matrix* Q = (Matrix*)malloc(5 * len_Q * sizeof(Matrix));
   Matrix* Qx = Q + 0 * len_Q;
   Matrix* Qu = Q + 1 * len_Q;
@@ -12,6 +12,8 @@
  */
 #pragma once
 
+#include <stddef.h>
+
 #include "lqr_problem.h"
 #include "matrix.h"
 
@@ -91,10 +93,21 @@ typedef struct {
  * Create a new Riccati solver, provided the problem data given by lqrprob.
  *
  * @param lqrprob Contains all the data to describe the LQR problem to be solved.
- * @return An initialized Riccati solver.
+ * @return An initialized Riccati solver, or NULL if the problem has more variables than
+ *         fit in an int (see ndlqr_GetNumVariables()).
  */
 RiccatiSolver* ndlqr_NewRiccatiSolver(LQRProblem* lqrprob);
 
+/**
+ * @brief Number of doubles in the block of memory allocated by the Riccati solver
+ *
+ * @param nstates Length of the state vector
+ * @param ninputs Number of control inputs
+ * @param nhorizon Length of the horizon
+ * @return Size of RiccatiSolver.data
+ */
+size_t ndlqr_GetRiccatiDataSize(int nstates, int ninputs, int nhorizon);
+
 /**
  * @brief Free the memory for a Riccati solver
  *
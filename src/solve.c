@@ -2,6 +2,7 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -14,17 +15,35 @@
 
 #define ENABLE_PROFILER
 #ifdef ENABLE_PROFILER
+// Timed on the master thread only, so the timers don't add any synchronization
 #define OMP_TICK \
-  _Pragma("omp single") { t_start = omp_get_wtime(); }
+  _Pragma("omp master") { t_start = omp_get_wtime(); }
 
 #define OMP_TOC(t_elapsed) \
-  _Pragma("omp single nowait") { t_elapsed += (omp_get_wtime() - t_start) * 1000.0; }
+  _Pragma("omp master") { t_elapsed += (omp_get_wtime() - t_start) * 1000.0; }
 #else
 #define OMP_TICK
 #define OMP_TOC(t_elapsed)
 #endif
 
+// Wait for the whole team to finish a phase, counting the barrier in the profile
+#define OMP_PHASE_BARRIER                                      \
+  _Pragma("omp master") { ++solver->profile.num_barriers; } \
+  _Pragma("omp barrier")
+
+/*
+ * Smallest amount of work, in flops, worth handing to another thread when the thread
+ * counts are picked automatically. Below this, the extra synchronization costs more than
+ * the work saved.
+ */
+#define kNdLqrMinFlopsPerThread 20000
+
+// Threads in [num_threads, team size) get an empty range and skip the phase.
 UnitRange get_work(int total_work, int num_threads, int threadid) {
+  if (threadid >= num_threads) {
+    UnitRange empty = {0, 0};
+    return empty;
+  }
   int tasks_per_thread = total_work / num_threads;
   int start = tasks_per_thread * threadid;
   int stop = tasks_per_thread * (threadid + 1);
@@ -35,157 +54,594 @@ UnitRange get_work(int total_work, int num_threads, int threadid) {
   return rng;
 }
 
+// Number of threads to use for a phase with the given number of work items, each taking
+// about item_flops flops.
+static int GetEffectiveThreads(NdLqrSolver* solver, long num_items, long item_flops) {
+  long num_threads = solver->num_threads;
+  if (num_items < 1) num_items = 1;
+  if (num_items < num_threads) num_threads = num_items;
+  if (solver->auto_threads) {
+    long max_threads = num_items * item_flops / kNdLqrMinFlopsPerThread;
+    if (max_threads < 1) max_threads = 1;
+    if (max_threads < num_threads) num_threads = max_threads;
+  }
+  return (int)num_threads;
+}
+
+int ndlqr_GetLeafThreads(NdLqrSolver* solver) {
+  // Each leaf divides its (n,n) state and (m,n) input blocks by the diagonals of Q and R
+  long n = solver->nstates;
+  long m = solver->ninputs;
+  return GetEffectiveThreads(solver, solver->nhorizon, (2 * n + m) * n);
+}
+
+// Number of independent work items in a phase, and the flops in each of them
+static void GetPhaseWork(NdLqrSolver* solver, NdLqrPhase phase, int level, long* num_items,
+                         long* item_flops) {
+  long n = solver->nstates;
+  long m = solver->ninputs;
+  long numleaves = PowerOfTwo(solver->depth - level - 1);
+  long upper_levels = solver->depth - level - 1;
+  switch (phase) {
+    case ndlqr_kProductsPhase:
+      *num_items = numleaves * (upper_levels + 1);
+      *item_flops = 2 * (2 * n + m) * n * n;
+      break;
+    case ndlqr_kCholeskyPhase:
+      *num_items = numleaves;
+      *item_flops = n * n * n / 3;
+      break;
+    case ndlqr_kCholSolvePhase:
+      *num_items = numleaves * upper_levels;
+      *item_flops = 2 * n * n * n;
+      break;
+    case ndlqr_kShurPhase:
+      *num_items = solver->nhorizon * upper_levels;
+      *item_flops = 2 * (2 * n + m) * n * n;
+      break;
+    case ndlqr_kSolveProductsPhase:
+      *num_items = numleaves;
+      *item_flops = 2 * (2 * n + m) * n;
+      break;
+    case ndlqr_kSolveCholSolvePhase:
+      *num_items = numleaves;
+      *item_flops = 2 * n * n;
+      break;
+    default:  // ndlqr_kSolveShurPhase
+      *num_items = solver->nhorizon;
+      *item_flops = 2 * (2 * n + m) * n;
+      break;
+  }
+}
+
+bool ndlqr_UseFusedPhases(NdLqrSolver* solver, int level) {
+  int numleaves = PowerOfTwo(solver->depth - level - 1);
+  return solver->fused_phases && numleaves >= solver->num_threads;
+}
+
+int ndlqr_GetPhaseThreads(NdLqrSolver* solver, NdLqrPhase phase, int level) {
+  if (level < 0 || level >= solver->depth) return -1;
+  if ((int)phase < 0 || phase >= ndlqr_kNumPhases) return -1;
+  bool block_phase = phase == ndlqr_kCholeskyPhase || phase == ndlqr_kCholSolvePhase;
+  if (block_phase && ndlqr_UseIntraBlockParallelism(solver, level)) {
+    return solver->num_threads;
+  }
+  long num_items;
+  long item_flops;
+  if (ndlqr_UseFusedPhases(solver, level)) {
+    // Every phase of the pass is split by leaf. The single-pass solve runs both passes
+    // together.
+    bool factorization = phase < ndlqr_kSolveProductsPhase;
+    NdLqrPhase first = factorization ? ndlqr_kProductsPhase : ndlqr_kSolveProductsPhase;
+    NdLqrPhase last = factorization ? ndlqr_kShurPhase : ndlqr_kSolveShurPhase;
+    if (solver->single_pass) {
+      first = ndlqr_kProductsPhase;
+      last = ndlqr_kSolveShurPhase;
+    }
+    long pass_flops = 0;
+    for (NdLqrPhase p = first; p <= last; ++p) {
+      GetPhaseWork(solver, p, level, &num_items, &item_flops);
+      pass_flops += num_items * item_flops;
+    }
+    num_items = PowerOfTwo(solver->depth - level - 1);
+    return GetEffectiveThreads(solver, num_items, pass_flops / num_items);
+  }
+  GetPhaseWork(solver, phase, level, &num_items, &item_flops);
+  return GetEffectiveThreads(solver, num_items, item_flops);
+}
+
+// Record the number of threads used by each phase in the profile
+static void RecordPhaseThreads(NdLqrSolver* solver) {
+  NdLqrProfile* profile = &solver->profile;
+  profile->leaf_threads = ndlqr_GetLeafThreads(solver);
+  profile->num_levels = solver->depth < kNdLqrMaxLevels ? solver->depth : kNdLqrMaxLevels;
+  for (int level = 0; level < profile->num_levels; ++level) {
+    for (int phase = 0; phase < ndlqr_kNumPhases; ++phase) {
+      profile->phase_threads[level][phase] = ndlqr_GetPhaseThreads(solver, phase, level);
+    }
+  }
+}
+
+// Libraries of the solver's tuning, or the ones the calling thread already uses
+static const enum MatrixLinearAlgebraLibrary* GetSolverLibraries(
+    const NdLqrSolver* solver) {
+  if (solver->tuning.valid) return solver->tuning.libraries;
+  return MatrixGetThreadOperationLibraries();
+}
+
+// Work items [start * scale, stop * scale), e.g. all the items of a range of leaves
+static UnitRange ScaleRange(UnitRange rng, int scale) {
+  UnitRange scaled = {rng.start * scale, rng.stop * scale};
+  return scaled;
+}
+
+/*
+ * Phases of each level of the factorization. Each one processes the work items in rng,
+ * and the phases of the same leaf have to run in this order.
+ */
+
+// Inner products with the factors of the upper levels. Item i is leaf i / (depth - level).
+static void FactorInnerProducts(NdLqrSolver* solver, int level, UnitRange rng) {
+  if (solver->batched) {
+    ndlqr_BatchedInnerProducts(solver, solver->fact, level, rng);
+    return;
+  }
+  int cur_depth = solver->depth - level;
+  for (int i = rng.start; i < rng.stop; ++i) {
+    int leaf = i / cur_depth;
+    int upper_level = level + (i % cur_depth);
+    int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
+    ndlqr_FactorInnerProduct(solver->data, solver->fact, index, level, upper_level);
+  }
+}
+
+// Cholesky factorization of each leaf in rng
+static void FactorCholesky(NdLqrSolver* solver, int level, UnitRange rng) {
+  if (solver->batched) {
+    ndlqr_BatchedCholesky(solver, level, rng);
+    return;
+  }
+  for (int leaf = rng.start; leaf < rng.stop; ++leaf) {
+    int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
+    // Get the Sbar Matrix calculated above
+    NdFactor* F;
+    ndlqr_GetNdFactor(solver->fact, index + 1, level, &F);
+    Matrix Sbar = F->lambda;
+    CholeskyInfo* cholinfo;
+    ndlqr_GetSFactorization(solver->cholfacts, leaf, level, &cholinfo);
+    MatrixCholeskyFactorizeWithInfo(&Sbar, cholinfo);
+
+    // Cache the explicit inverse, if requested
+    Matrix* Sinv;
+    if (ndlqr_GetSInverse(solver->cholfacts, leaf, level, &Sinv) == 0) {
+      MatrixCholeskyInverseWithInfo(&Sbar, Sinv, 1.0, cholinfo);
+    }
+  }
+}
+
+// Solve with the Cholesky factor for f. Item i is leaf i / (depth - level - 1).
+static void FactorCholeskySolves(NdLqrSolver* solver, int level, UnitRange rng,
+                                 int threadid) {
+  if (solver->batched) {
+    ndlqr_BatchedCholeskySolves(solver, solver->fact, level, rng);
+    return;
+  }
+  int upper_levels = solver->depth - level - 1;
+  for (int i = rng.start; i < rng.stop; ++i) {
+    int leaf = i / upper_levels;
+    int upper_level = level + 1 + (i % upper_levels);
+    int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
+
+    Matrix* Sinv;
+    Matrix* work;
+    ndlqr_GetSInverse(solver->cholfacts, leaf, level, &Sinv);
+    ndlqr_GetInverseWorkspace(solver->cholfacts, threadid, &work);
+    if (Sinv && work) {
+      ndlqr_SolveInverseFactor(solver->fact, Sinv, work, index, level, upper_level);
+    } else {
+      CholeskyInfo* cholinfo;
+      ndlqr_GetSFactorization(solver->cholfacts, leaf, level, &cholinfo);
+      ndlqr_SolveCholeskyFactor(solver->fact, cholinfo, index, level, upper_level);
+    }
+  }
+}
+
+// Shur compliments. Item i is knot point i / (depth - level - 1).
+static void FactorShurUpdates(NdLqrSolver* solver, int level, UnitRange rng) {
+  if (solver->batched) {
+    ndlqr_BatchedShurUpdates(solver, solver->fact, level, rng);
+    return;
+  }
+  int upper_levels = solver->depth - level - 1;
+  for (int i = rng.start; i < rng.stop; ++i) {
+    int k = i / upper_levels;
+    int upper_level = level + 1 + (i % upper_levels);
+
+    int index = ndlqr_GetIndexAtLevel(&solver->tree, k, level);
+    bool calc_lambda = ndlqr_ShouldCalcLambda(&solver->tree, index, k);
+    ndlqr_UpdateShurFactor(solver->fact, solver->fact, index, k, level, upper_level,
+                           calc_lambda);
+  }
+}
+
+/*
+ * Phases of each level of the solution pass
+ *
+ * The pass solves for the right-hand side in soln, and can skip some of the leaves and
+ * knot points of each level, e.g. the ones that don't lead to the requested knot points
+ * (see ndlqr_SetPartialSolution()). The masks are (nhorizon, depth) arrays, with each
+ * level stored contiguously, or NULL to process all of them.
+ */
+typedef struct {
+  NdData* soln;
+  const bool* leaves;
+  const bool* knots;
+} SolutionPass;
+
+static bool IsLeafRequested(const SolutionPass* pass, int nhorizon, int level, int leaf) {
+  return !pass->leaves || pass->leaves[level * nhorizon + leaf];
+}
+
+static bool IsKnotRequested(const SolutionPass* pass, int nhorizon, int level, int k) {
+  return !pass->knots || pass->knots[level * nhorizon + k];
+}
+
+// Calculate inner products with right-hand-side, with the factors computed above
+static void SolveInnerProducts(NdLqrSolver* solver, const SolutionPass* pass, int level,
+                               UnitRange leaves) {
+  if (solver->batched && !pass->leaves) {
+    ndlqr_BatchedInnerProducts(solver, pass->soln, level, leaves);
+    return;
+  }
+  for (int leaf = leaves.start; leaf < leaves.stop; ++leaf) {
+    if (!IsLeafRequested(pass, solver->nhorizon, level, leaf)) continue;
+    int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
+
+    // Calculate z = d - F'b1 - F2'b2
+    ndlqr_FactorInnerProduct(solver->data, pass->soln, index, level, 0);
+  }
+}
+
+// Solve for separator variables with cached Cholesky decomposition
+static void SolveSeparators(NdLqrSolver* solver, const SolutionPass* pass, int level,
+                            UnitRange leaves, int threadid) {
+  if (solver->batched && !pass->leaves) {
+    ndlqr_BatchedCholeskySolves(solver, pass->soln, level, leaves);
+    return;
+  }
+  for (int leaf = leaves.start; leaf < leaves.stop; ++leaf) {
+    if (!IsLeafRequested(pass, solver->nhorizon, level, leaf)) continue;
+    int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
+
+    // Get the Sbar Matrix calculated above
+    NdFactor* F;
+    NdFactor* z;
+    ndlqr_GetNdFactor(solver->fact, index + 1, level, &F);
+    ndlqr_GetNdFactor(pass->soln, index + 1, 0, &z);
+    Matrix Sbar = F->lambda;
+    Matrix zy = z->lambda;
+
+    // Solve (S - C1'F1 - C2'F2)^{-1} (d - F1'b1 - F2'b2) -> Sbar \ z = zbar
+    //                 |                       |
+    //    reuse Cholesky factorization   Inner product calculated above
+    Matrix* Sinv;
+    Matrix* work;
+    ndlqr_GetSInverse(solver->cholfacts, leaf, level, &Sinv);
+    ndlqr_GetInverseWorkspace(solver->cholfacts, threadid, &work);
+    if (Sinv && work) {
+      MatrixInverseSolve(Sinv, &zy, work);
+    } else {
+      CholeskyInfo* cholinfo;
+      ndlqr_GetSFactorization(solver->cholfacts, leaf, level, &cholinfo);
+      MatrixCholeskySolveWithInfo(&Sbar, &zy, cholinfo);
+    }
+  }
+}
+
+// Propagate information to solution vector
+//    y = y - F zbar
+static void SolvePropagate(NdLqrSolver* solver, const SolutionPass* pass, int level,
+                           UnitRange knots) {
+  if (solver->batched && !pass->knots) {
+    ndlqr_BatchedShurUpdates(solver, pass->soln, level, knots);
+    return;
+  }
+  for (int k = knots.start; k < knots.stop; ++k) {
+    if (!IsKnotRequested(pass, solver->nhorizon, level, k)) continue;
+    int index = ndlqr_GetIndexAtLevel(&solver->tree, k, level);
+    bool calc_lambda = ndlqr_ShouldCalcLambda(&solver->tree, index, k);
+    ndlqr_UpdateShurFactor(solver->fact, pass->soln, index, k, level, 0, calc_lambda);
+  }
+}
+
+// Solve for the right-hand side using the cached factorization. Called by every thread
+// of the team.
+static void RunSolutionPass(NdLqrSolver* solver, const SolutionPass* pass, int threadid) {
+  int depth = solver->depth;
+  int nhorizon = solver->nhorizon;
+  for (int level = 0; level < depth; ++level) {
+    int numleaves = PowerOfTwo(depth - level - 1);
+
+    if (ndlqr_UseFusedPhases(solver, level)) {
+      int phase_threads = ndlqr_GetPhaseThreads(solver, ndlqr_kSolveProductsPhase, level);
+      UnitRange leaves = get_work(numleaves, phase_threads, threadid);
+      SolveInnerProducts(solver, pass, level, leaves);
+      SolveSeparators(solver, pass, level, leaves, threadid);
+      SolvePropagate(solver, pass, level, ScaleRange(leaves, nhorizon / numleaves));
+      OMP_PHASE_BARRIER;
+      continue;
+    }
+
+    int phase_threads = ndlqr_GetPhaseThreads(solver, ndlqr_kSolveProductsPhase, level);
+    UnitRange rng = get_work(numleaves, phase_threads, threadid);
+    SolveInnerProducts(solver, pass, level, rng);
+    OMP_PHASE_BARRIER;
+
+    phase_threads = ndlqr_GetPhaseThreads(solver, ndlqr_kSolveCholSolvePhase, level);
+    rng = get_work(numleaves, phase_threads, threadid);
+    SolveSeparators(solver, pass, level, rng, threadid);
+    OMP_PHASE_BARRIER;
+
+    phase_threads = ndlqr_GetPhaseThreads(solver, ndlqr_kSolveShurPhase, level);
+    rng = get_work(nhorizon, phase_threads, threadid);
+    SolvePropagate(solver, pass, level, rng);
+    OMP_PHASE_BARRIER;
+  }
+}
+
 int ndlqr_Solve(NdLqrSolver* solver) {
   // clock_t t_start_total = clock();
   double t_start_total = omp_get_wtime();
   double t_start = 0;
   (void)t_start;
   MatrixLinAlgTimeReset();
+  const enum MatrixLinearAlgebraLibrary* libs = GetSolverLibraries(solver);
+  const enum MatrixLinearAlgebraLibrary* prev_libs =
+      MatrixSetThreadOperationLibraries(libs);
 
   int depth = solver->depth;
   int nhorizon = solver->nhorizon;
+  bool single_pass = solver->single_pass;
+  SolutionPass pass = {solver->soln, solver->partial_leaves, solver->partial_knots};
+  solver->profile.num_barriers = 0;
 
   omp_set_num_threads(solver->num_threads);
 
 #pragma omp parallel
   {
-#pragma omp single
+    const enum MatrixLinearAlgebraLibrary* team_libs =
+        MatrixSetThreadOperationLibraries(libs);
+#pragma omp master
     { solver->num_threads = omp_get_num_threads(); }
-    // implicit barrier
+    OMP_PHASE_BARRIER;
 
     // Solve for independent diagonal blocks
-    int num_threads = solver->num_threads;
+    // Each phase uses as many of the threads as its work justifies, and the rest skip it
     int threadid = omp_get_thread_num();
-    UnitRange rng = get_work(solver->nhorizon, num_threads, threadid);
+    UnitRange rng = get_work(solver->nhorizon, ndlqr_GetLeafThreads(solver), threadid);
     OMP_TICK;
     for (int k = rng.start; k < rng.stop; ++k) {
       ndlqr_SolveLeaf(solver, k);
     }
     OMP_TOC(solver->profile.t_leaves_ms);
-#pragma omp barrier
+    OMP_PHASE_BARRIER;
 
     // Solve factorization
+    // In a single-pass solve, the right-hand side is treated as one more column of the
+    // factorization and is carried through the phases of every level along with it.
     for (int level = 0; level < depth; ++level) {
       int numleaves = PowerOfTwo(depth - level - 1);
+      int cur_depth = depth - level;
+      int upper_levels = cur_depth - 1;
+
+      if (ndlqr_UseFusedPhases(solver, level)) {
+        // Every phase of a leaf only touches the blocks of that leaf, so each thread runs
+        // all of them for its own leaves and the team only synchronizes once per level
+        int phase_threads = ndlqr_GetPhaseThreads(solver, ndlqr_kProductsPhase, level);
+        UnitRange leaves = get_work(numleaves, phase_threads, threadid);
+        int knots_per_leaf = nhorizon / numleaves;
+        OMP_TICK;
+        FactorInnerProducts(solver, level, ScaleRange(leaves, cur_depth));
+        if (single_pass) SolveInnerProducts(solver, &pass, level, leaves);
+        FactorCholesky(solver, level, leaves);
+        FactorCholeskySolves(solver, level, ScaleRange(leaves, upper_levels), threadid);
+        if (single_pass) SolveSeparators(solver, &pass, level, leaves, threadid);
+        FactorShurUpdates(solver, level,
+                          ScaleRange(leaves, knots_per_leaf * upper_levels));
+        if (single_pass) {
+          SolvePropagate(solver, &pass, level, ScaleRange(leaves, knots_per_leaf));
+        }
+        OMP_TOC(solver->profile.t_fused_ms);
+        OMP_PHASE_BARRIER;
+        continue;
+      }
 
       // Calc Inner Products
-      int cur_depth = depth - level;
       int num_products = numleaves * cur_depth;
-
-      rng = get_work(num_products, num_threads, threadid);
+      int phase_threads = ndlqr_GetPhaseThreads(solver, ndlqr_kProductsPhase, level);
+      rng = get_work(num_products, phase_threads, threadid);
       OMP_TICK;
-      for (int i = rng.start; i < rng.stop; ++i) {
-        int leaf = i / cur_depth;
-        int upper_level = level + (i % cur_depth);
-        int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
-        ndlqr_FactorInnerProduct(solver->data, solver->fact, index, level, upper_level);
+      FactorInnerProducts(solver, level, rng);
+      if (single_pass) {
+        phase_threads = ndlqr_GetPhaseThreads(solver, ndlqr_kSolveProductsPhase, level);
+        rng = get_work(numleaves, phase_threads, threadid);
+        SolveInnerProducts(solver, &pass, level, rng);
       }
       OMP_TOC(solver->profile.t_products_ms);
-#pragma omp barrier
+      OMP_PHASE_BARRIER;
 
       // Cholesky factorization
-      rng = get_work(numleaves, num_threads, threadid);
+      bool split_blocks = ndlqr_UseIntraBlockParallelism(solver, level);
+      phase_threads = ndlqr_GetPhaseThreads(solver, ndlqr_kCholeskyPhase, level);
+      rng = get_work(numleaves, phase_threads, threadid);
       OMP_TICK;
-      for (int leaf = rng.start; leaf < rng.stop; ++leaf) {
-        int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
-        // Get the Sbar Matrix calculated above
-        NdFactor* F;
-        ndlqr_GetNdFactor(solver->fact, index + 1, level, &F);
-        Matrix Sbar = F->lambda;
-        CholeskyInfo* cholinfo;
-        ndlqr_GetSFactorization(solver->cholfacts, leaf, level, &cholinfo);
-        MatrixCholeskyFactorizeWithInfo(&Sbar, cholinfo);
+      if (split_blocks) {
+        ndlqr_ParallelBlockCholesky(solver, level);
+      } else {
+        FactorCholesky(solver, level, rng);
       }
       OMP_TOC(solver->profile.t_cholesky_ms);
-#pragma omp barrier
+      OMP_PHASE_BARRIER;
 
       // Solve with Cholesky factor for f
-      int upper_levels = cur_depth - 1;
       int num_solves = numleaves * upper_levels;
-      rng = get_work(num_solves, num_threads, threadid);
+      phase_threads = ndlqr_GetPhaseThreads(solver, ndlqr_kCholSolvePhase, level);
+      rng = get_work(num_solves, phase_threads, threadid);
       OMP_TICK;
-      for (int i = rng.start; i < rng.stop; ++i) {
-        int leaf = i / upper_levels;
-        int upper_level = level + 1 + (i % upper_levels);
-        int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
-
-        CholeskyInfo* cholinfo;
-        ndlqr_GetSFactorization(solver->cholfacts, leaf, level, &cholinfo);
-        ndlqr_SolveCholeskyFactor(solver->fact, cholinfo, index, level, upper_level);
+      if (split_blocks) {
+        ndlqr_ParallelBlockCholeskySolves(solver, level);
+      } else {
+        FactorCholeskySolves(solver, level, rng, threadid);
+      }
+      if (single_pass) {
+        phase_threads = ndlqr_GetPhaseThreads(solver, ndlqr_kSolveCholSolvePhase, level);
+        rng = get_work(numleaves, phase_threads, threadid);
+        SolveSeparators(solver, &pass, level, rng, threadid);
       }
       OMP_TOC(solver->profile.t_cholsolve_ms);
-#pragma omp barrier
+      OMP_PHASE_BARRIER;
 
       // Shur compliments
       int num_factors = nhorizon * upper_levels;
-      rng = get_work(num_factors, num_threads, threadid);
+      phase_threads = ndlqr_GetPhaseThreads(solver, ndlqr_kShurPhase, level);
+      rng = get_work(num_factors, phase_threads, threadid);
       OMP_TICK;
-      for (int i = rng.start; i < rng.stop; ++i) {
-        int k = i / upper_levels;
-        int upper_level = level + 1 + (i % upper_levels);
-
-        int index = ndlqr_GetIndexAtLevel(&solver->tree, k, level);
-        bool calc_lambda = ndlqr_ShouldCalcLambda(&solver->tree, index, k);
-        ndlqr_UpdateShurFactor(solver->fact, solver->fact, index, k, level, upper_level,
-                               calc_lambda);
+      FactorShurUpdates(solver, level, rng);
+      if (single_pass) {
+        phase_threads = ndlqr_GetPhaseThreads(solver, ndlqr_kSolveShurPhase, level);
+        rng = get_work(nhorizon, phase_threads, threadid);
+        SolvePropagate(solver, &pass, level, rng);
       }
       OMP_TOC(solver->profile.t_shur_ms);
-#pragma omp barrier
+      OMP_PHASE_BARRIER;
     }
 
     // Solve for solution vector using the cached factorization
-    for (int level = 0; level < depth; ++level) {
-      int numleaves = PowerOfTwo(depth - level - 1);
-
-      // Calculate inner products with right-hand-side, with the factors
-      // computed above
-      rng = get_work(numleaves, num_threads, threadid);
-      for (int leaf = rng.start; leaf < rng.stop; ++leaf) {
-        int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
-
-        // Calculate z = d - F'b1 - F2'b2
-        ndlqr_FactorInnerProduct(solver->data, solver->soln, index, level, 0);
-      }
-#pragma omp barrier
-
-      // Solve for separator variables with cached Cholesky decomposition
-      rng = get_work(numleaves, num_threads, threadid);
-      for (int leaf = rng.start; leaf < rng.stop; ++leaf) {
-        int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
-
-        // Get the Sbar Matrix calculated above
-        NdFactor* F;
-        NdFactor* z;
-        ndlqr_GetNdFactor(solver->fact, index + 1, level, &F);
-        ndlqr_GetNdFactor(solver->soln, index + 1, 0, &z);
-        Matrix Sbar = F->lambda;
-        Matrix zy = z->lambda;
-
-        // Solve (S - C1'F1 - C2'F2)^{-1} (d - F1'b1 - F2'b2) -> Sbar \ z = zbar
-        //                 |                       |
-        //    reuse Cholesky factorization   Inner product calculated above
-        CholeskyInfo* cholinfo;
-        ndlqr_GetSFactorization(solver->cholfacts, leaf, level, &cholinfo);
-        MatrixCholeskySolveWithInfo(&Sbar, &zy, cholinfo);
-      }
-#pragma omp barrier
-
-      // Propagate information to solution vector
-      //    y = y - F zbar
-      rng = get_work(nhorizon, num_threads, threadid);
-      for (int k = rng.start; k < rng.stop; ++k) {
-        int index = ndlqr_GetIndexAtLevel(&solver->tree, k, level);
-        bool calc_lambda = ndlqr_ShouldCalcLambda(&solver->tree, index, k);
-        ndlqr_UpdateShurFactor(solver->fact, solver->soln, index, k, level, 0, calc_lambda);
-      }
-#pragma omp barrier
-    }
+    if (!single_pass) RunSolutionPass(solver, &pass, threadid);
+    MatrixSetThreadOperationLibraries(team_libs);
   }
+  MatrixSetThreadOperationLibraries(prev_libs);
   double diff = omp_get_wtime() - t_start_total;
   solver->solve_time_ms = diff * 1000.0;
   solver->linalg_time_ms = MatrixGetLinAlgTimeMilliseconds();
   solver->profile.t_total_ms = solver->solve_time_ms;
   solver->profile.num_threads = solver->num_threads;
+  solver->profile.skipped_flops = solver->skipped_flops;
+  RecordPhaseThreads(solver);
+  return 0;
+}
+
+// Copies the right-hand side of knot point k into z, as in ndlqr_InitializeWithLQRProblem()
+static void GetKnotRightHandSide(const LQRProblem* lqrprob, int k, NdFactor* z) {
+  int nhorizon = lqrprob->nhorizon;
+  const double* lambda = k == 0 ? lqrprob->x0 : lqrprob->lqrdata[k - 1]->d;
+  for (int i = 0; i < z->lambda.rows; ++i) z->lambda.data[i] = -lambda[i];
+  for (int i = 0; i < z->state.rows; ++i) z->state.data[i] = -lqrprob->lqrdata[k]->q[i];
+  for (int i = 0; i < z->input.rows; ++i) {
+    z->input.data[i] = k < nhorizon - 1 ? -lqrprob->lqrdata[k]->r[i] : 0.0;
+  }
+}
+
+// Sets rhs to the new values in delta, and delta to the change from the old values
+static void SwapRightHandSide(Matrix* rhs, Matrix* delta) {
+  for (int i = 0; i < MatrixNumElements(rhs); ++i) {
+    double value = delta->data[i];
+    delta->data[i] = value - rhs->data[i];
+    rhs->data[i] = value;
+  }
+}
+
+int ndlqr_UpdateRightHandSide(NdLqrSolver* solver, const LQRProblem* lqrprob,
+                              const int* knots, int num_knots) {
+  if (!solver || !lqrprob || num_knots < 0 || (num_knots > 0 && !knots)) return -1;
+  int nhorizon = solver->nhorizon;
+  int depth = solver->depth;
+  if (lqrprob->nhorizon != nhorizon) return -1;
+  for (int i = 0; i < num_knots; ++i) {
+    if (knots[i] < 0 || knots[i] >= nhorizon) return -1;
+  }
+
+  // Clear the change from the last update, which is only nonzero at the knot points it
+  // touched
+  NdData* delta = solver->delta;
+  bool* nonzero = solver->delta_knots;
+  for (int k = 0; k < nhorizon; ++k) {
+    if (!nonzero[k]) continue;
+    NdFactor* dz;
+    ndlqr_GetNdFactor(delta, k, 0, &dz);
+    MatrixSetConst(&dz->lambda, 0.0);
+    MatrixSetConst(&dz->state, 0.0);
+    MatrixSetConst(&dz->input, 0.0);
+    nonzero[k] = false;
+  }
+  bool* leaves = solver->update_leaves;
+  bool* knots_mask = solver->update_knots;
+  memset(leaves, 0, nhorizon * depth * sizeof(bool));
+  memset(knots_mask, 0, nhorizon * depth * sizeof(bool));
+
+  // Change in the right-hand side
+  for (int i = 0; i < num_knots; ++i) {
+    int k = knots[i];
+    NdFactor* z;
+    NdFactor* rhs;
+    ndlqr_GetNdFactor(delta, k, 0, &z);
+    ndlqr_GetNdFactor(solver->rhs, k, 0, &rhs);
+    GetKnotRightHandSide(lqrprob, k, z);
+    SwapRightHandSide(&rhs->lambda, &z->lambda);
+    SwapRightHandSide(&rhs->state, &z->state);
+    SwapRightHandSide(&rhs->input, &z->input);
+    nonzero[k] = true;
+  }
+  for (int k = 0; k < nhorizon; ++k) {
+    if (nonzero[k]) ndlqr_SolveLeafRightHandSide(solver, delta, k);
+  }
+
+  // A leaf is only solved if the change has reached either side of its separator, after
+  // which it spreads to every knot point of the leaf
+  SolutionPass request = {solver->soln, solver->partial_leaves, solver->partial_knots};
+  for (int level = 0; level < depth; ++level) {
+    int span = PowerOfTwo(level + 1);
+    for (int leaf = 0; leaf < nhorizon / span; ++leaf) {
+      int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
+      if (!nonzero[index] && !nonzero[index + 1]) continue;
+      if (!IsLeafRequested(&request, nhorizon, level, leaf)) continue;
+      leaves[level * nhorizon + leaf] = true;
+      for (int k = leaf * span; k < (leaf + 1) * span; ++k) {
+        knots_mask[level * nhorizon + k] = IsKnotRequested(&request, nhorizon, level, k);
+        nonzero[k] = true;
+      }
+    }
+  }
+
+  // Solve for the change in the solution
+  SolutionPass pass = {delta, leaves, knots_mask};
+  const enum MatrixLinearAlgebraLibrary* libs = GetSolverLibraries(solver);
+  const enum MatrixLinearAlgebraLibrary* prev_libs =
+      MatrixSetThreadOperationLibraries(libs);
+  solver->profile.num_barriers = 0;
+  omp_set_num_threads(solver->num_threads);
+#pragma omp parallel
+  {
+    const enum MatrixLinearAlgebraLibrary* team_libs =
+        MatrixSetThreadOperationLibraries(libs);
+#pragma omp master
+    { solver->num_threads = omp_get_num_threads(); }
+    OMP_PHASE_BARRIER;
+    RunSolutionPass(solver, &pass, omp_get_thread_num());
+    MatrixSetThreadOperationLibraries(team_libs);
+  }
+
+  for (int k = 0; k < nhorizon; ++k) {
+    if (!nonzero[k]) continue;
+    NdFactor* z;
+    NdFactor* dz;
+    ndlqr_GetNdFactor(solver->soln, k, 0, &z);
+    ndlqr_GetNdFactor(delta, k, 0, &dz);
+    MatrixAddition(&dz->lambda, &z->lambda, 1.0);
+    MatrixAddition(&dz->state, &z->state, 1.0);
+    MatrixAddition(&dz->input, &z->input, 1.0);
+  }
+  MatrixSetThreadOperationLibraries(prev_libs);
   return 0;
 }
 
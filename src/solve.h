@@ -36,6 +36,71 @@
  */
 int ndlqr_Solve(NdLqrSolver* solver);
 
+/**
+ * @brief Update the solution after the right-hand side changes at a few knot points
+ *
+ * Re-reads the right-hand side at the given knot points from @p lqrprob, i.e. the
+ * initial state or the affine dynamics term \f$ d_{k-1} \f$, and the linear costs
+ * \f$ q_k, r_k \f$, and updates the solution using the factorization cached by the
+ * last call to ndlqr_Solve(). Since the solution is linear in the right-hand side,
+ * only the change has to be solved for, and the change at a knot point only reaches the
+ * leaves whose separators it touches at each level. The solution pass skips every other
+ * leaf and knot point, so changing only `x0` updates about `2 * nhorizon` knot points
+ * instead of `nhorizon * depth`. The rest of the problem data must not have changed.
+ *
+ * If a partial solution is requested (see ndlqr_SetPartialSolution()), only the
+ * requested knot points are updated.
+ *
+ * @pre ndlqr_Solve() has already been called
+ * @param solver    rsLQR solver
+ * @param lqrprob   Problem data with the new right-hand side
+ * @param knots     Indices of the knot points whose right-hand side changed
+ * @param num_knots Number of knot points
+ * @return 0 if successful, or -1 if any of the indices are out of range
+ */
+int ndlqr_UpdateRightHandSide(NdLqrSolver* solver, const LQRProblem* lqrprob,
+                              const int* knots, int num_knots);
+
+/**
+ * @brief Number of threads that work on a phase of the solve
+ *
+ * Never more than the team size or the number of independent work items in the phase,
+ * which is small at the upper levels of the tree. If the solver was set to
+ * ndlqr_kAutoThreads, it is also limited by the estimated number of flops in the
+ * phase, so that each thread gets enough work to pay for its synchronization. The
+ * remaining threads of the team skip the phase. Phases that split their blocks across
+ * threads (see ndlqr_SetIntraBlockParallelism()) use the whole team. On levels that fuse
+ * their phases (see ndlqr_UseFusedPhases()), every phase of the same pass is split by
+ * leaf and uses the same number of threads.
+ *
+ * @param solver rsLQR solver
+ * @param phase  Phase of the solve
+ * @param level  Level of the binary tree
+ * @return Number of threads, or -1 if the phase or level are invalid.
+ */
+int ndlqr_GetPhaseThreads(NdLqrSolver* solver, NdLqrPhase phase, int level);
+
+/**
+ * @brief Whether a level runs all of its phases for each leaf without barriers in between
+ *
+ * True if fused phases are enabled (see ndlqr_SetFusedPhases()) and the level has at
+ * least as many leaves as there are threads.
+ *
+ * @param solver rsLQR solver
+ * @param level  Level of the binary tree
+ */
+bool ndlqr_UseFusedPhases(NdLqrSolver* solver, int level);
+
+/**
+ * @brief Number of threads that solve the leaves
+ *
+ * See ndlqr_GetPhaseThreads().
+ *
+ * @param solver rsLQR solver
+ * @return Number of threads
+ */
+int ndlqr_GetLeafThreads(NdLqrSolver* solver);
+
 /**
  * @brief Return the solution vector
  *
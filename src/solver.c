@@ -4,12 +4,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "linalg_custom.h"
 #include "linalg_utils.h"
+#include "nested_dissection.h"
 #include "omp.h"
 #include "utils.h"
 
 NdLqrProfile ndlqr_NewNdLqrProfile() {
-  NdLqrProfile prof = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, -1};
+  NdLqrProfile prof = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, -1, 0, 0, 0, {{0}}, 0.0, 0};
   return prof;
 }
 
@@ -20,16 +22,23 @@ void ndlqr_ResetProfile(NdLqrProfile* prof) {
   prof->t_cholesky_ms = 0.0;
   prof->t_cholsolve_ms = 0.0;
   prof->t_shur_ms = 0.0;
+  prof->t_fused_ms = 0.0;
 }
 
 void ndlqr_CopyProfile(NdLqrProfile* dest, NdLqrProfile* src) {
   dest->num_threads = src->num_threads;
+  dest->leaf_threads = src->leaf_threads;
+  dest->num_levels = src->num_levels;
+  memcpy(dest->phase_threads, src->phase_threads, sizeof(src->phase_threads));
   dest->t_total_ms = src->t_total_ms;
   dest->t_leaves_ms = src->t_leaves_ms;
   dest->t_products_ms = src->t_products_ms;
   dest->t_cholesky_ms = src->t_cholesky_ms;
   dest->t_cholsolve_ms = src->t_cholsolve_ms;
   dest->t_shur_ms = src->t_shur_ms;
+  dest->t_fused_ms = src->t_fused_ms;
+  dest->num_barriers = src->num_barriers;
+  dest->skipped_flops = src->skipped_flops;
 }
 
 void ndlqr_PrintProfile(NdLqrProfile* profile) {
@@ -40,6 +49,18 @@ void ndlqr_PrintProfile(NdLqrProfile* profile) {
   printf("Solve Cholesky: %.3f ms\n", profile->t_cholesky_ms);
   printf("Solve Solve:    %.3f ms\n", profile->t_cholsolve_ms);
   printf("Solve Shur:     %.3f ms\n", profile->t_shur_ms);
+  printf("Solve Fused:    %.3f ms\n", profile->t_fused_ms);
+  printf("Barriers:       %d\n", profile->num_barriers);
+  printf("Skipped flops:  %ld\n", profile->skipped_flops);
+  if (profile->num_levels > 0) {
+    printf("Threads by level (products, cholesky, cholsolve, shur | solve pass):\n");
+    printf("  leaves: %d\n", profile->leaf_threads);
+  }
+  for (int level = 0; level < profile->num_levels; ++level) {
+    const int* threads = profile->phase_threads[level];
+    printf("  level %2d: %d %d %d %d | %d %d %d\n", level, threads[0], threads[1],
+           threads[2], threads[3], threads[4], threads[5], threads[6]);
+  }
 }
 
 void PrintComp(double base, double new) {
@@ -55,25 +76,51 @@ void ndlqr_CompareProfile(NdLqrProfile* base, NdLqrProfile* prof) {
   printf("Solve Cholesky:  "); PrintComp(base->t_cholesky_ms, prof->t_cholesky_ms);
   printf("Solve CholSolve: "); PrintComp(base->t_cholsolve_ms, prof->t_cholsolve_ms);
   printf("Solve Shur Comp: "); PrintComp(base->t_shur_ms, prof->t_shur_ms);
+  printf("Solve Fused:     "); PrintComp(base->t_fused_ms, prof->t_fused_ms);
+  printf("Barriers:        %d / %d\n", base->num_barriers, prof->num_barriers);
+  printf("Skipped flops:   %ld / %ld\n", base->skipped_flops, prof->skipped_flops);
   // clang-format on
 }
 
+/*
+ * The KKT matrix data for knot point k is only read at the level of k and at the level of
+ * k-1, for the dynamics at k and at the previous time step. The other factors are never
+ * allocated.
+ */
+static NdData* NewMatrixData(OrderedBinaryTree* tree, int nstates, int ninputs,
+                             int nhorizon) {
+  bool* stored = (bool*)calloc(nhorizon * tree->depth, sizeof(bool));
+  if (!stored) return NULL;
+  for (int k = 0; k < nhorizon; ++k) {
+    if (k < nhorizon - 1) stored[k + nhorizon * ndlqr_GetIndexLevel(tree, k)] = true;
+    if (k > 0) stored[k + nhorizon * ndlqr_GetIndexLevel(tree, k - 1)] = true;
+  }
+  NdData* data = ndlqr_NewCompactNdData(nstates, ninputs, nhorizon, nstates, stored);
+  free(stored);
+  return data;
+}
+
 NdLqrSolver* ndlqr_NewNdLqrSolver(int nstates, int ninputs, int nhorizon) {
+  int nvars = ndlqr_GetNumVariables(nstates, ninputs, nhorizon);
+  if (nvars < 0) {
+    fprintf(stderr, "ERROR: Too many variables for the solver.\n");
+    return NULL;
+  }
   OrderedBinaryTree tree = ndlqr_BuildTree(nhorizon);
   NdLqrSolver* solver = (NdLqrSolver*)malloc(sizeof(NdLqrSolver));
-  int nvars = (2 * nstates + ninputs) * nhorizon - ninputs;
 
-  int diag_size = (nstates * nstates + ninputs * ninputs) * nhorizon;
+  // The costs are diagonal, so only the diagonals of Q and R are stored
+  size_t blocksize = nstates + ninputs;
+  size_t diag_size = blocksize * nhorizon;
   double* diag_data = (double*)malloc(diag_size * sizeof(double));
   Matrix* diagonals = (Matrix*)malloc(2 * nhorizon * sizeof(Matrix));
   for (int k = 0; k < nhorizon; ++k) {
-    int blocksize = nstates * nstates + ninputs * ninputs;
     diagonals[2 * k].rows = nstates;
-    diagonals[2 * k].cols = nstates;
+    diagonals[2 * k].cols = 1;
     diagonals[2 * k].data = diag_data + k * blocksize;
     diagonals[2 * k + 1].rows = ninputs;
-    diagonals[2 * k + 1].cols = ninputs;
-    diagonals[2 * k + 1].data = diag_data + k * blocksize + nstates * nstates;
+    diagonals[2 * k + 1].cols = 1;
+    diagonals[2 * k + 1].data = diag_data + k * blocksize + nstates;
   }
   NdLqrCholeskyFactors* cholfacts = ndlqr_NewCholeskyFactors(tree.depth, nhorizon);
 
@@ -84,14 +131,35 @@ NdLqrSolver* ndlqr_NewNdLqrSolver(int nstates, int ninputs, int nhorizon) {
   solver->nvars = nvars;
   solver->tree = tree;
   solver->diagonals = diagonals;
-  solver->data = ndlqr_NewNdData(nstates, ninputs, nhorizon, nstates);
+  solver->data = NewMatrixData(&tree, nstates, ninputs, nhorizon);
   solver->fact = ndlqr_NewNdData(nstates, ninputs, nhorizon, nstates);
   solver->soln = ndlqr_NewNdData(nstates, ninputs, nhorizon, 1);
+  solver->rhs = ndlqr_NewNdData(nstates, ninputs, nhorizon, 1);
+  solver->delta = ndlqr_NewNdData(nstates, ninputs, nhorizon, 1);
+  solver->delta_knots = (bool*)calloc(nhorizon, sizeof(bool));
+  solver->update_knots = (bool*)calloc(nhorizon * tree.depth, sizeof(bool));
+  solver->update_leaves = (bool*)calloc(nhorizon * tree.depth, sizeof(bool));
+  solver->data->coupling_state = ndlqr_kMinusIdentityBlock;
+  solver->data->coupling_input = ndlqr_kZeroBlock;
   solver->cholfacts = cholfacts;
   solver->solve_time_ms = 0.0;
   solver->linalg_time_ms = 0.0;
   solver->profile = ndlqr_NewNdLqrProfile();
   solver->num_threads = omp_get_num_procs() / 2;
+  solver->auto_threads = false;
+  solver->skipped_flops = 0;
+  solver->tuning = ndlqr_DefaultKernelTuning();
+  solver->batched = false;
+  solver->intra_block_min_size = 0;
+  solver->fused_phases = true;
+  solver->single_pass = false;
+  solver->partial_knots = NULL;
+  solver->partial_leaves = NULL;
+  const char* cachefile = getenv("RSLQR_TUNING_CACHE");
+  if (cachefile) {
+    ndlqr_LoadKernelTuning(cachefile, nstates, ninputs, &solver->tuning);
+  }
+  ndlqr_BuildSparsityMap(solver);
   return solver;
 }
 
@@ -111,7 +179,14 @@ int ndlqr_FreeNdLqrSolver(NdLqrSolver* solver) {
   ndlqr_FreeNdData(solver->data);
   ndlqr_FreeNdData(solver->fact);
   ndlqr_FreeNdData(solver->soln);
+  ndlqr_FreeNdData(solver->rhs);
+  ndlqr_FreeNdData(solver->delta);
+  free(solver->delta_knots);
+  free(solver->update_knots);
+  free(solver->update_leaves);
   ndlqr_FreeCholeskyFactors(solver->cholfacts);
+  free(solver->partial_knots);
+  free(solver->partial_leaves);
   free(solver->diagonals[0].data);
   free(solver->diagonals);
   free(solver);
@@ -124,12 +199,10 @@ int ndlqr_InitializeWithLQRProblem(const LQRProblem* lqrprob, NdLqrSolver* solve
   int ninputs = solver->ninputs;
   if (lqrprob->nhorizon != solver->nhorizon) return -1;
 
-  // Create a minux identity matrix for copying into the original matrix
-  Matrix minus_identity = NewMatrix(nstates, nstates);
-  MatrixSetConst(&minus_identity, 0);
-  for (int i = 0; i < nstates; ++i) {
-    MatrixSetElement(&minus_identity, i, i, -1);
-  }
+  // The coupling to the next time step is only stored if it doesn't have a known structure
+  bool store_state_coupling = solver->data->coupling_state == ndlqr_kDenseBlock;
+  bool store_input_coupling = solver->data->coupling_input == ndlqr_kDenseBlock;
+  ndlqr_BuildSparsityMap(solver);
 
   // Loop over the knot points, copying the LQR data into the matrix data
   // and populating the right-hand-side vector
@@ -157,39 +230,37 @@ int ndlqr_InitializeWithLQRProblem(const LQRProblem* lqrprob, NdLqrSolver* solve
     memcpy(zfactor->input.data, lqrprob->lqrdata[k]->r, ninputs * sizeof(double));
 
     // Copy Q and R into diagonals
-    Matrix Q = solver->diagonals[2 * k];
-    Matrix R = solver->diagonals[2 * k + 1];
-    MatrixSetConst(&Q, 0);
-    MatrixSetConst(&R, 0);
-    for (int i = 0; i < nstates; ++i) {
-      MatrixSetElement(&Q, i, i, lqrprob->lqrdata[k]->Q[i]);
-    }
-    for (int i = 0; i < ninputs; ++i) {
-      MatrixSetElement(&R, i, i, lqrprob->lqrdata[k]->R[i]);
-    }
+    memcpy(solver->diagonals[2 * k].data, lqrprob->lqrdata[k]->Q, nstates * sizeof(double));
+    memcpy(solver->diagonals[2 * k + 1].data, lqrprob->lqrdata[k]->R,
+           ninputs * sizeof(double));
 
     // Next time step
     ndlqr_GetNdFactor(solver->data, k + 1, level, &Cfactor);
     ndlqr_GetNdFactor(solver->soln, k + 1, 0, &zfactor);
-    memcpy(Cfactor->state.data, minus_identity.data, nstates * nstates * sizeof(double));
-    MatrixSetConst(&Cfactor->input, 0.0);
+    if (store_state_coupling) {
+      MatrixSetConst(&Cfactor->state, 0.0);
+      for (int i = 0; i < nstates; ++i) {
+        MatrixSetElement(&Cfactor->state, i, i, -1);
+      }
+    }
+    if (store_input_coupling) {
+      MatrixSetConst(&Cfactor->input, 0.0);
+    }
     memcpy(zfactor->lambda.data, lqrprob->lqrdata[k]->d, nstates * sizeof(double));
   }
 
   // Terminal step
   memcpy(zfactor->state.data, lqrprob->lqrdata[k]->q, nstates * sizeof(double));
-  Matrix Q = solver->diagonals[2 * k];
-  MatrixSetConst(&Q, 0);
-  for (int i = 0; i < nstates; ++i) {
-    MatrixSetElement(&Q, i, i, lqrprob->lqrdata[k]->Q[i]);
-  }
+  memcpy(solver->diagonals[2 * k].data, lqrprob->lqrdata[k]->Q, nstates * sizeof(double));
 
   // Negate the entire rhs vector
   for (int i = 0; i < solver->nvars; ++i) {
     solver->soln->data[i] *= -1;
   }
 
-  FreeMatrix(&minus_identity);
+  // Keep the right-hand side for ndlqr_UpdateRightHandSide()
+  memcpy(solver->rhs->data, solver->soln->data, solver->nvars * sizeof(double));
+
   return 0;
 }
 
@@ -205,17 +276,125 @@ void ndlqr_PrintSolveSummary(NdLqrSolver* solver) {
   }
   printf("  Solved with %d threads.\n", solver->num_threads);
   printf("  ");
+  const enum MatrixLinearAlgebraLibrary* prev = MatrixGetThreadOperationLibraries();
+  if (solver->tuning.valid) MatrixSetThreadOperationLibraries(solver->tuning.libraries);
   MatrixPrintLinearAlgebraLibrary();
+  MatrixSetThreadOperationLibraries(prev);
+  printf("  Internal kernels: %s\n", clap_GetKernelISAName(clap_GetKernelISA()));
 }
 
 int ndlqr_GetNumVars(NdLqrSolver* solver) { return solver->nvars; }
 
 int ndlqr_SetNumThreads(NdLqrSolver* solver, int num_threads) {
-  if (!solver) return -1;
+  if (!solver || num_threads < 0) return -1;
+  solver->auto_threads = num_threads == ndlqr_kAutoThreads;
+  if (solver->auto_threads) num_threads = omp_get_num_procs();
   solver->num_threads = num_threads;
+
+  // Make sure every thread has a workspace for applying the cached inverses
+  NdLqrCholeskyFactors* cholfacts = solver->cholfacts;
+  if (cholfacts->inverses && num_threads > cholfacts->num_workspaces) {
+    return ndlqr_EnableInverseCaching(cholfacts, solver->nstates, num_threads);
+  }
+  return 0;
+}
+
+int ndlqr_SetInverseFactorCaching(NdLqrSolver* solver, bool enable) {
+  if (!solver) return -1;
+  if (!enable) return ndlqr_DisableInverseCaching(solver->cholfacts);
+  int num_threads = omp_get_num_procs();
+  if (solver->num_threads > num_threads) num_threads = solver->num_threads;
+  return ndlqr_EnableInverseCaching(solver->cholfacts, solver->nstates, num_threads);
+}
+
+int ndlqr_SetBatchedExecution(NdLqrSolver* solver, bool enable) {
+  if (!solver) return -1;
+  solver->batched = enable;
+  return 0;
+}
+
+int ndlqr_SetFusedPhases(NdLqrSolver* solver, bool enable) {
+  if (!solver) return -1;
+  solver->fused_phases = enable;
   return 0;
 }
 
+int ndlqr_SetSinglePassSolve(NdLqrSolver* solver, bool enable) {
+  if (!solver) return -1;
+  solver->single_pass = enable;
+  return 0;
+}
+
+int ndlqr_SetPartialSolution(NdLqrSolver* solver, const int* knots, int num_knots) {
+  if (!solver || num_knots < 0 || (num_knots > 0 && !knots)) return -1;
+  int nhorizon = solver->nhorizon;
+  int depth = solver->depth;
+  for (int i = 0; i < num_knots; ++i) {
+    if (knots[i] < 0 || knots[i] >= nhorizon) return -1;
+  }
+  free(solver->partial_knots);
+  free(solver->partial_leaves);
+  solver->partial_knots = NULL;
+  solver->partial_leaves = NULL;
+  if (num_knots == 0) return 0;
+
+  bool* partial_knots = (bool*)calloc(nhorizon * depth, sizeof(bool));
+  bool* partial_leaves = (bool*)calloc(nhorizon * depth, sizeof(bool));
+  if (!partial_knots || !partial_leaves) {
+    free(partial_knots);
+    free(partial_leaves);
+    return -1;
+  }
+
+  // Walk down the tree from the top level. Each leaf containing a knot point that's needed
+  // at its level must be solved, which needs the solution at the knot points on either
+  // side of its separator from all of the levels below.
+  bool* level_knots = partial_knots + (depth - 1) * nhorizon;
+  for (int i = 0; i < num_knots; ++i) {
+    level_knots[knots[i]] = true;
+  }
+  for (int level = depth - 1; level >= 0; --level) {
+    level_knots = partial_knots + level * nhorizon;
+    bool* level_leaves = partial_leaves + level * nhorizon;
+    int span = PowerOfTwo(level + 1);
+    for (int k = 0; k < nhorizon; ++k) {
+      if (level_knots[k]) level_leaves[k / span] = true;
+    }
+    if (level == 0) break;
+    bool* lower_knots = level_knots - nhorizon;
+    memcpy(lower_knots, level_knots, nhorizon * sizeof(bool));
+    for (int leaf = 0; leaf < nhorizon / span; ++leaf) {
+      if (!level_leaves[leaf]) continue;
+      int index = ndlqr_GetIndexFromLeaf(&solver->tree, leaf, level);
+      lower_knots[index] = true;
+      lower_knots[index + 1] = true;
+    }
+  }
+  solver->partial_knots = partial_knots;
+  solver->partial_leaves = partial_leaves;
+  return 0;
+}
+
+int ndlqr_SetIntraBlockParallelism(NdLqrSolver* solver, int min_size) {
+  if (!solver || min_size < 0) return -1;
+  solver->intra_block_min_size = min_size;
+  return 0;
+}
+
+int ndlqr_AutotuneSolver(NdLqrSolver* solver, const char* cachefile) {
+  if (!solver) return -1;
+  int nstates = solver->nstates;
+  int ninputs = solver->ninputs;
+  if (ndlqr_LoadKernelTuning(cachefile, nstates, ninputs, &solver->tuning) == 0) {
+    return 0;
+  }
+  int out = ndlqr_BenchmarkKernels(nstates, ninputs, &solver->tuning);
+  if (out == 0 && cachefile) {
+    out = ndlqr_SaveKernelTuning(cachefile, nstates, ninputs, &solver->tuning);
+  }
+  return out;
+}
+
 int ndlqr_GetNumThreads(NdLqrSolver* solver) {
   if (!solver) return -1;
   return solver->num_threads;
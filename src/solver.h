@@ -12,12 +12,34 @@
  */
 #pragma once
 
+#include "autotune.h"
 #include "binary_tree.h"
 #include "cholesky_factors.h"
 #include "linalg.h"
 #include "lqr_problem.h"
 #include "nddata.h"
 
+/**
+ * @brief Phases of each level of the solve, in the order they are run
+ *
+ * See ndlqr_GetPhaseThreads().
+ */
+typedef enum {
+  ndlqr_kProductsPhase = 0,        ///< Inner products of the factorization
+  ndlqr_kCholeskyPhase = 1,        ///< Cholesky factorizations
+  ndlqr_kCholSolvePhase = 2,       ///< Cholesky solves of the factorization
+  ndlqr_kShurPhase = 3,            ///< Schur complements of the factorization
+  ndlqr_kSolveProductsPhase = 4,   ///< Inner products with the right-hand side
+  ndlqr_kSolveCholSolvePhase = 5,  ///< Cholesky solves for the separator variables
+  ndlqr_kSolveShurPhase = 6,       ///< Propagation of the separator variables
+  ndlqr_kNumPhases = 7,
+} NdLqrPhase;
+
+/**
+ * @brief Largest number of levels recorded in NdLqrProfile
+ */
+#define kNdLqrMaxLevels 32
+
 /**
  * @brief A struct describing how long each part of the solve took, in milliseconds.
  *
@@ -36,6 +58,13 @@ typedef struct {
   double t_cholsolve_ms;
   double t_shur_ms;
   int num_threads;
+  long skipped_flops;  ///< flops skipped using the block sparsity map
+  int leaf_threads;    ///< threads that solved the leaves
+  int num_levels;      ///< levels recorded in phase_threads
+  int phase_threads[kNdLqrMaxLevels][ndlqr_kNumPhases];  ///< threads that worked on each
+                                                         ///< phase of each level
+  double t_fused_ms;   ///< factorization levels that ran their phases fused per leaf
+  int num_barriers;    ///< team barriers of the last solve
 } NdLqrProfile;
 
 /**
@@ -108,6 +137,13 @@ void ndlqr_CompareProfile(NdLqrProfile* base, NdLqrProfile* prof);
  * - ndlqr_ResetSolver()
  * - ndlqr_GetNumVars()
  * - ndlqr_SetNumThreads()
+ * - ndlqr_SetInverseFactorCaching()
+ * - ndlqr_SetBatchedExecution()
+ * - ndlqr_SetFusedPhases()
+ * - ndlqr_SetSinglePassSolve()
+ * - ndlqr_SetPartialSolution()
+ * - ndlqr_SetIntraBlockParallelism()
+ * - ndlqr_AutotuneSolver()
  * - ndlqr_PrintSolveProfile()
  * - ndlqr_GetProfile()
  */
@@ -118,26 +154,48 @@ typedef struct {
   int depth;     ///< depth of the binary tree
   int nvars;     ///< number of decision variables (size of the linear system)
   OrderedBinaryTree tree;
-  Matrix* diagonals;  ///< (nhorizon,2) array of diagonal blocks (Q,R)
-  NdData* data;       ///< original matrix data
+  Matrix* diagonals;  ///< (nhorizon,2) array of the (Q,R) diagonals, stored as vectors
+  NdData* data;       ///< original matrix data. Only the factors that are read are stored
   NdData* fact;       ///< factorization
   NdData* soln;       ///< solution vector (also the initial RHS)
+  NdData* rhs;        ///< right-hand side of the last solve
+  NdData* delta;      ///< change in the solution. See ndlqr_UpdateRightHandSide()
+  bool* delta_knots;  ///< (nhorizon,) knot points where delta is nonzero
   NdLqrCholeskyFactors* cholfacts;
   double solve_time_ms;  ///< total solve time in milliseconds.
   double linalg_time_ms;
   NdLqrProfile profile;
   int num_threads;  ///< Number of threads used by the solver.
+  bool auto_threads;  ///< Size the threads of each phase by its work.
+  long skipped_flops;  ///< Flops skipped in each solve. See ndlqr_BuildSparsityMap().
+  NdLqrKernelTuning tuning;  ///< Libraries used by the solve. See ndlqr_AutotuneSolver()
+  bool batched;  ///< Use batched linear algebra. See ndlqr_SetBatchedExecution()
+  int intra_block_min_size;  ///< See ndlqr_SetIntraBlockParallelism()
+  bool fused_phases;  ///< Run the phases of each leaf without barriers between them.
+  bool single_pass;   ///< Solve for the right-hand side during the factorization.
+  bool* partial_knots;   ///< (nhorizon, depth) knot points updated at each level of the
+                         ///< solution pass, or NULL for all of them.
+                         ///< See ndlqr_SetPartialSolution()
+  bool* partial_leaves;  ///< (nhorizon, depth) leaves solved at each level of the
+                         ///< solution pass, or NULL for all of them
+  bool* update_knots;    ///< (nhorizon, depth) knot points updated at each level by
+                         ///< ndlqr_UpdateRightHandSide()
+  bool* update_leaves;   ///< (nhorizon, depth) leaves solved at each level by
+                         ///< ndlqr_UpdateRightHandSide()
 } NdLqrSolver;
 
 /**
  * @brief Create a new solver, allocating all the required memory.
  *
- * Must be followed by a later call to ndlqr_FreeNdLqrSolver().
+ * Must be followed by a later call to ndlqr_FreeNdLqrSolver(). If the
+ * `RSLQR_TUNING_CACHE` environment variable is set, the libraries tuned for this
+ * problem size are loaded from that cache (see ndlqr_AutotuneSolver()).
  *
  * @param nstates Number of elements in the state vector
  * @param ninputs Number of control inputs
  * @param nhorizon Length of the time horizon. Must be a power of 2.
- * @return A pointer to the new solver
+ * @return A pointer to the new solver, or NULL if the problem has more variables than fit
+ *         in an int (see ndlqr_GetNumVariables()).
  */
 NdLqrSolver* ndlqr_NewNdLqrSolver(int nstates, int ninputs, int nhorizon);
 
@@ -172,7 +230,8 @@ void ndlqr_ResetSolver(NdLqrSolver* solver);
 /**
  * @brief Prints a summary of the solve
  *
- * Prints solve time, the residual norm, and the number of theads.
+ * Prints solve time, the residual norm, the number of threads, the linear algebra
+ * library, and the instruction set used by the internal kernels.
  *
  * @pre ndlqr_Solve() has already been called
  * @param solver
@@ -186,6 +245,13 @@ void ndlqr_PrintSolveSummary(NdLqrSolver* solver);
  */
 int ndlqr_GetNumVars(NdLqrSolver* solver);
 
+/**
+ * @brief Pick the number of threads for each phase of the solve from its work size
+ *
+ * Pass to ndlqr_SetNumThreads().
+ */
+static const int ndlqr_kAutoThreads = 0;
+
 /**
  * @brief Set the number of threads to be used during the solve
  *
@@ -193,12 +259,140 @@ int ndlqr_GetNumVars(NdLqrSolver* solver);
  * To query the actual number of threads used during the solve, use the
  * ndlqr_GetNumThreads() function after the solve.
  *
+ * Phases with fewer work items than threads only use as many threads as there are
+ * items, and the other threads skip the phase. If @p num_threads is ndlqr_kAutoThreads,
+ * the solve starts a thread for every processor, and each phase only uses as many of
+ * them as its amount of work justifies, so small problems and the upper levels of the
+ * tree run on fewer threads (see ndlqr_GetPhaseThreads()). The number of threads used
+ * by each phase is recorded in the profile.
+ *
  * @param solver rsLQR solver
- * @param num_threads requested number of threads
+ * @param num_threads requested number of threads, or ndlqr_kAutoThreads
  * @return 0 if successful
  */
 int ndlqr_SetNumThreads(NdLqrSolver* solver, int num_threads);
 
+/**
+ * @brief Cache the explicit inverses of the Cholesky factors during the solve
+ *
+ * When enabled, the inverse of each factored block is computed right after its
+ * factorization, and every later solve with that block is done with a matrix
+ * multiplication instead of forward and backward substitution. This uses an extra
+ * (n,n) matrix per block, plus one per thread. Disabled by default.
+ *
+ * @param solver rsLQR solver
+ * @param enable Whether the inverses should be cached
+ * @return 0 if successful
+ */
+int ndlqr_SetInverseFactorCaching(NdLqrSolver* solver, bool enable);
+
+/**
+ * @brief Pass the block operations of each phase to the library in batches
+ *
+ * When enabled, each phase of the factorization and solution passes collects the block
+ * operations of a thread's work items and issues them as batched products, Cholesky
+ * factorizations, and solves (see MatrixMultiplyBatched()). This amortizes the per-call
+ * overhead of external libraries like BLAS and MKL over many small blocks, and is
+ * usually only worth it with those libraries. The leaves only scale rows by the diagonal
+ * cost matrices, so they aren't batched. Disabled by default.
+ *
+ * @param solver rsLQR solver
+ * @param enable Whether to use the batched operations
+ * @return 0 if successful
+ */
+int ndlqr_SetBatchedExecution(NdLqrSolver* solver, bool enable);
+
+/**
+ * @brief Run all the phases of each leaf in one task
+ *
+ * Every phase of a level only touches the blocks of its own leaf, so a thread can compute
+ * the inner products, the Cholesky factorization, the Cholesky solves and the Schur
+ * complements of its leaves back to back, and the team only needs to synchronize once per
+ * level instead of after every phase. The same holds for the three phases of each level of
+ * the solution pass. Levels with fewer leaves than threads keep the separate phases, which
+ * split their finer-grained work across more threads. The phases of fused levels are
+ * timed together in NdLqrProfile::t_fused_ms. Enabled by default.
+ *
+ * @param solver rsLQR solver
+ * @param enable Whether to fuse the phases of each leaf
+ * @return 0 if successful
+ */
+int ndlqr_SetFusedPhases(NdLqrSolver* solver, bool enable);
+
+/**
+ * @brief Solve for the right-hand side in the same traversal as the factorization
+ *
+ * The solution pass repeats the inner products, Cholesky solves and Schur complements of
+ * the factorization with the right-hand side in place of the factors of the upper levels,
+ * using the blocks of the factorization at the same level. Since those blocks are final
+ * once their level has been factored, the right-hand side can instead be carried along
+ * as one more column of the factorization, as suggested in the original paper. The
+ * solve then only traverses the tree once, needs half as many barriers, and reuses each
+ * block of the factorization while it's still in cache. The right-hand side is still
+ * stored separately in NdLqrSolver.soln, since it is narrower than the factors.
+ *
+ * @param solver rsLQR solver
+ * @param enable Whether to solve for the right-hand side during the factorization
+ * @return 0 if successful
+ */
+int ndlqr_SetSinglePassSolve(NdLqrSolver* solver, bool enable);
+
+/**
+ * @brief Only solve for the variables at some of the knot points
+ *
+ * Model-predictive control typically only applies the first control, and possibly uses
+ * the next state to warm start the next solve. The solution at knot point `k` only
+ * depends on the separators of the leaves containing `k` at each level, and the solution
+ * pass for each of those separators only depends on the solution at the knot points on
+ * either side of it at the lower levels. The solution pass then skips the inner products,
+ * Cholesky solves and Schur complements that don't lead to one of the requested knot
+ * points. The factorization is still computed in full.
+ *
+ * After the solve, only the blocks of the solution at the requested knot points (i.e.
+ * \f$ \lambda_k, x_k, u_k \f$) are valid. The solution pass doesn't use batched linear
+ * algebra while a partial solution is requested.
+ *
+ * @param solver    rsLQR solver
+ * @param knots     Indices of the knot points to solve for, between 0 and `nhorizon - 1`
+ * @param num_knots Number of knot points, or 0 to solve for every knot point
+ * @return 0 if successful, or -1 if any of the indices are out of range
+ */
+int ndlqr_SetPartialSolution(NdLqrSolver* solver, const int* knots, int num_knots);
+
+/**
+ * @brief Split the large blocks at the top of the tree across threads
+ *
+ * Level `l` of the factorization only has `2^(depth - l - 1)` leaves, so near the top of
+ * the tree most threads are idle during the Cholesky factorizations and solves. When
+ * enabled, levels with fewer leaves than threads instead use every thread for each
+ * block: the factorizations are split with a parallel blocked Cholesky (see
+ * MatrixCholeskyFactorizeParallel()), and the Cholesky solves by the columns of their
+ * right-hand sides. This only pays off when the blocks are large, e.g. 100 states or
+ * more. Disabled by default.
+ *
+ * @param solver   rsLQR solver
+ * @param min_size Smallest number of states for which the blocks are split, or 0 to
+ *                 disable
+ * @return 0 if successful
+ */
+int ndlqr_SetIntraBlockParallelism(NdLqrSolver* solver, int min_size);
+
+/**
+ * @brief Pick the fastest linear algebra library for each operation in the solve
+ *
+ * Loads the libraries for this CPU and problem size from @p cachefile if they've been
+ * tuned before. Otherwise each available library is benchmarked with
+ * ndlqr_BenchmarkKernels() and the winners are added to the cache. The libraries are
+ * only used during this solver's solves, and the previous libraries are restored
+ * afterwards.
+ *
+ * @param solver    rsLQR solver
+ * @param cachefile Path to the JSON tuning cache. Can be NULL to always benchmark
+ *                  without caching the results.
+ * @return 0 if successful
+ */
+int ndlqr_AutotuneSolver(NdLqrSolver* solver, const char* cachefile);
+
 /**
  * @brief Get the number of threads used during the rsLQR solve
  *
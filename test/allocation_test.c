@@ -0,0 +1,145 @@
+#include <stdlib.h>
+
+#include "riccati_solve.h"
+#include "riccati_solver.h"
+#include "solve.h"
+#include "solver.h"
+#include "test/minunit.h"
+#include "test/test_problem.h"
+
+// Count heap allocations by wrapping the glibc allocator. This catches C++ allocations
+// too, since operator new calls malloc.
+#ifdef __GLIBC__
+#define kCanCountAllocations 1
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t num, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static int count_allocations = 0;
+static long num_allocations = 0;
+
+static void RecordAllocation() {
+  if (__atomic_load_n(&count_allocations, __ATOMIC_RELAXED)) {
+    __atomic_fetch_add(&num_allocations, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void* malloc(size_t size) {
+  RecordAllocation();
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t num, size_t size) {
+  RecordAllocation();
+  return __libc_calloc(num, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  RecordAllocation();
+  return __libc_realloc(ptr, size);
+}
+
+static void StartCountingAllocations() {
+  num_allocations = 0;
+  __atomic_store_n(&count_allocations, 1, __ATOMIC_SEQ_CST);
+}
+
+static long StopCountingAllocations() {
+  __atomic_store_n(&count_allocations, 0, __ATOMIC_SEQ_CST);
+  return num_allocations;
+}
+#else
+#define kCanCountAllocations 0
+static void StartCountingAllocations() {}
+static long StopCountingAllocations() { return 0; }
+#endif
+
+int SolveWithoutAllocating() {
+  LQRProblem* lqrprob = ndlqr_ReadTestLQRProblem();
+  int nstates = lqrprob->lqrdata[0]->nstates;
+  int ninputs = lqrprob->lqrdata[0]->ninputs;
+  int nhorizon = lqrprob->nhorizon;
+  NdLqrSolver* solver = ndlqr_NewNdLqrSolver(nstates, ninputs, nhorizon);
+  ndlqr_SetNumThreads(solver, 1);
+
+  // The first solve starts the OpenMP thread pool, which allocates
+  for (int cache = 0; cache < 2; ++cache) {
+    ndlqr_SetInverseFactorCaching(solver, cache);
+    ndlqr_ResetNdData(solver->fact);
+    ndlqr_InitializeWithLQRProblem(lqrprob, solver);
+    ndlqr_Solve(solver);
+
+    ndlqr_ResetNdData(solver->fact);
+    ndlqr_InitializeWithLQRProblem(lqrprob, solver);
+    StartCountingAllocations();
+    ndlqr_Solve(solver);
+    long count = StopCountingAllocations();
+    mu_assert(count == 0);
+  }
+
+  RiccatiSolver* riccati = ndlqr_NewRiccatiSolver(lqrprob);
+  ndlqr_SolveRiccati(riccati);
+  StartCountingAllocations();
+  ndlqr_SolveRiccati(riccati);
+  long count = StopCountingAllocations();
+  mu_assert(count == 0);
+
+  Matrix x = ndlqr_GetSolution(solver);
+  Matrix xriccati = ndlqr_GetRiccatiSolution(riccati);
+  mu_assert(MatrixNormedDifference(&x, &xriccati) < 1e-10);
+
+  ndlqr_FreeRiccatiSolver(riccati);
+  ndlqr_FreeNdLqrSolver(solver);
+  ndlqr_FreeLQRProblem(lqrprob);
+  return 1;
+}
+
+int UpdateWithoutAllocating() {
+  LQRProblem* lqrprob = ndlqr_ReadTestLQRProblem();
+  int nstates = lqrprob->lqrdata[0]->nstates;
+  int ninputs = lqrprob->lqrdata[0]->ninputs;
+  int nhorizon = lqrprob->nhorizon;
+  NdLqrSolver* solver = ndlqr_NewNdLqrSolver(nstates, ninputs, nhorizon);
+  ndlqr_SetNumThreads(solver, 1);
+  ndlqr_InitializeWithLQRProblem(lqrprob, solver);
+  ndlqr_Solve(solver);
+
+  // Change the initial state, then the costs at a few knot points
+  int first[1] = {0};
+  int waypoints[3] = {2, 3, nhorizon - 1};
+  lqrprob->x0[0] += 1.0;
+  StartCountingAllocations();
+  int out = ndlqr_UpdateRightHandSide(solver, lqrprob, first, 1);
+  long count = StopCountingAllocations();
+  mu_assert(out == 0);
+  mu_assert(count == 0);
+
+  for (int i = 0; i < 3; ++i) lqrprob->lqrdata[waypoints[i]]->q[0] -= 0.5;
+  StartCountingAllocations();
+  out = ndlqr_UpdateRightHandSide(solver, lqrprob, waypoints, 3);
+  count = StopCountingAllocations();
+  mu_assert(out == 0);
+  mu_assert(count == 0);
+
+  ndlqr_FreeNdLqrSolver(solver);
+  ndlqr_FreeLQRProblem(lqrprob);
+  return 1;
+}
+
+int CountAllocations() {
+  if (!kCanCountAllocations) return 1;
+  StartCountingAllocations();
+  void* volatile ptr = malloc(8);  // volatile, so the allocation isn't optimized out
+  long count = StopCountingAllocations();
+  free(ptr);
+  mu_assert(count == 1);
+  return 1;
+}
+
+void AllTests() {
+  mu_run_test(CountAllocations);
+  mu_run_test(SolveWithoutAllocating);
+  mu_run_test(UpdateWithoutAllocating);
+}
+
+mu_test_main
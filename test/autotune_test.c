@@ -0,0 +1,128 @@
+#include "autotune.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riccati_solve.h"
+#include "riccati_solver.h"
+#include "solve.h"
+#include "solver.h"
+#include "test/minunit.h"
+#include "test/test_problem.h"
+
+static const char* kCacheFile = "autotune_test_cache.json";
+
+int CPUModel() {
+  char cpu[256];
+  ndlqr_GetCPUModel(cpu, sizeof(cpu));
+  mu_assert(strlen(cpu) > 0);
+
+  // Truncated to fit in the buffer
+  char small[4];
+  ndlqr_GetCPUModel(small, sizeof(small));
+  mu_assert(strlen(small) == 3);
+  return 1;
+}
+
+int TuningCache() {
+  remove(kCacheFile);
+  NdLqrKernelTuning tuning = ndlqr_DefaultKernelTuning();
+  mu_assert(!tuning.valid);
+  mu_assert(ndlqr_LoadKernelTuning(kCacheFile, 6, 3, &tuning) == -1);
+  mu_assert(ndlqr_SaveKernelTuning(kCacheFile, 6, 3, &tuning) == -1);  // not valid
+  tuning.valid = true;
+  tuning.libraries[laCholesky] = kNumLinearAlgebraLibraries;
+  mu_assert(ndlqr_SaveKernelTuning(kCacheFile, 6, 3, &tuning) == -1);  // not a library
+
+  // Save entries for two problem sizes
+  for (int op = 0; op < kNumLinearAlgebraOperations; ++op) {
+    tuning.libraries[op] = libInternal;
+  }
+  tuning.valid = true;
+  mu_assert(ndlqr_SaveKernelTuning(kCacheFile, 6, 3, &tuning) == 0);
+  if (MatrixHasLinearAlgebraLibrary(libEigen)) {
+    tuning.libraries[laMultiply] = libEigen;
+  }
+  mu_assert(ndlqr_SaveKernelTuning(kCacheFile, 12, 4, &tuning) == 0);
+
+  NdLqrKernelTuning loaded = ndlqr_DefaultKernelTuning();
+  mu_assert(ndlqr_LoadKernelTuning(kCacheFile, 12, 4, &loaded) == 0);
+  mu_assert(loaded.valid);
+  for (int op = 0; op < kNumLinearAlgebraOperations; ++op) {
+    mu_assert(loaded.libraries[op] == tuning.libraries[op]);
+  }
+  mu_assert(ndlqr_LoadKernelTuning(kCacheFile, 6, 3, &loaded) == 0);
+  mu_assert(loaded.libraries[laMultiply] == libInternal);
+  mu_assert(ndlqr_LoadKernelTuning(kCacheFile, 6, 4, &loaded) == -1);
+
+  // Replace an existing entry
+  tuning.libraries[laMultiply] = libInternal;
+  mu_assert(ndlqr_SaveKernelTuning(kCacheFile, 12, 4, &tuning) == 0);
+  mu_assert(ndlqr_LoadKernelTuning(kCacheFile, 12, 4, &loaded) == 0);
+  mu_assert(loaded.libraries[laMultiply] == libInternal);
+
+  // Invalid files are overwritten
+  FILE* fp = fopen(kCacheFile, "w");
+  fputs("not json", fp);
+  fclose(fp);
+  mu_assert(ndlqr_LoadKernelTuning(kCacheFile, 6, 3, &loaded) == -1);
+  mu_assert(ndlqr_SaveKernelTuning(kCacheFile, 6, 3, &tuning) == 0);
+  mu_assert(ndlqr_LoadKernelTuning(kCacheFile, 6, 3, &loaded) == 0);
+  remove(kCacheFile);
+  return 1;
+}
+
+int AutotuneSolver() {
+  remove(kCacheFile);
+  LQRProblem* lqrprob = ndlqr_ReadTestLQRProblem();
+  int nstates = lqrprob->lqrdata[0]->nstates;
+  int ninputs = lqrprob->lqrdata[0]->ninputs;
+  int nhorizon = lqrprob->nhorizon;
+  NdLqrKernelTuning before = ndlqr_DefaultKernelTuning();
+
+  // Benchmark and store the result in the cache
+  NdLqrSolver* solver = ndlqr_NewNdLqrSolver(nstates, ninputs, nhorizon);
+  mu_assert(!solver->tuning.valid);
+  mu_assert(ndlqr_AutotuneSolver(solver, kCacheFile) == 0);
+  mu_assert(solver->tuning.valid);
+  for (int op = 0; op < kNumLinearAlgebraOperations; ++op) {
+    mu_assert(MatrixHasLinearAlgebraLibrary(solver->tuning.libraries[op]));
+  }
+
+  // New solvers load the tuning from the cache
+  setenv("RSLQR_TUNING_CACHE", kCacheFile, 1);
+  NdLqrSolver* cached = ndlqr_NewNdLqrSolver(nstates, ninputs, nhorizon);
+  unsetenv("RSLQR_TUNING_CACHE");
+  mu_assert(cached->tuning.valid);
+  for (int op = 0; op < kNumLinearAlgebraOperations; ++op) {
+    mu_assert(cached->tuning.libraries[op] == solver->tuning.libraries[op]);
+  }
+
+  // Solve with the tuned libraries, which are only used during the solve
+  ndlqr_InitializeWithLQRProblem(lqrprob, cached);
+  ndlqr_Solve(cached);
+  for (int op = 0; op < kNumLinearAlgebraOperations; ++op) {
+    mu_assert(MatrixGetOperationLibrary(op) == before.libraries[op]);
+  }
+  RiccatiSolver* riccati = ndlqr_NewRiccatiSolver(lqrprob);
+  ndlqr_SolveRiccati(riccati);
+  Matrix x = ndlqr_GetSolution(cached);
+  Matrix xriccati = ndlqr_GetRiccatiSolution(riccati);
+  mu_assert(MatrixNormedDifference(&x, &xriccati) < 1e-10);
+
+  ndlqr_FreeRiccatiSolver(riccati);
+  ndlqr_FreeNdLqrSolver(solver);
+  ndlqr_FreeNdLqrSolver(cached);
+  ndlqr_FreeLQRProblem(lqrprob);
+  remove(kCacheFile);
+  return 1;
+}
+
+void AllTests() {
+  mu_run_test(CPUModel);
+  mu_run_test(TuningCache);
+  mu_run_test(AutotuneSolver);
+}
+
+mu_test_main
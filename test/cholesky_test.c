@@ -77,36 +77,136 @@ int CholeskyFactors() {
   MakePSD(N);
   bool usingeigen = MatrixGetLinearAlgebraLibrary() == libEigen;
 
+  // One factorization for each S block, ordered by level
   NdLqrCholeskyFactors* cholfacts = ndlqr_NewCholeskyFactors(3, 8);
+  mu_assert(cholfacts->numfacts == 7);
   CholeskyInfo* cholinfo = NULL;
-  ndlqr_GetQFactorizon(cholfacts, 0, &cholinfo);
+  ndlqr_GetSFactorization(cholfacts, 0, 1, &cholinfo);
+  mu_assert(cholinfo == cholfacts->cholinfo + 4);
+  mu_assert(ndlqr_GetSFactorization(cholfacts, 2, 1, &cholinfo) == -1);
+  mu_assert(ndlqr_GetSFactorization(cholfacts, 0, 3, &cholinfo) == -1);
+  ndlqr_GetSFactorization(cholfacts, 0, 0, &cholinfo);
   mu_assert(cholinfo == cholfacts->cholinfo);
   MatrixCholeskyFactorizeWithInfo(A, cholinfo);
   MatrixCholeskySolveWithInfo(A, B, cholinfo);
   if (usingeigen) {
-    mu_assert(cholinfo->is_freed == false);
     mu_assert(cholinfo->lib == 'E');
   }
 
-  ndlqr_GetRFactorizon(cholfacts, 0, &cholinfo);
-  if (usingeigen) {
-    mu_assert(cholinfo->is_freed == true);
-  }
+  // The factorizations are done in place, without allocating any extra storage
+  mu_assert(cholinfo->fact == NULL);
+  ndlqr_GetSFactorization(cholfacts, 1, 0, &cholinfo);
   MatrixCholeskyFactorizeWithInfo(A + 1, cholinfo);
-  if (usingeigen) {
-    mu_assert(cholinfo->is_freed == false);
-  }
+  mu_assert(cholinfo->fact == NULL);
 
   int res = ndlqr_FreeCholeskyFactors(cholfacts);
-  mu_assert(cholinfo->is_freed == true);
   FreeMatrices(N);
   mu_assert(res == 0);
   return 1;
 }
 
+static double MaxDifference(int len, const double* a, const double* b) {
+  double diff = 0.0;
+  for (int i = 0; i < len; ++i) {
+    diff = fmax(diff, fabs(a[i] - b[i]));
+  }
+  return diff;
+}
+
+// The fixed-size Eigen kernels should match the dynamic-size ones
+int FixedSizeKernels() {
+  int nstates[8];
+  int ninputs[8];
+  int num_sizes = eigen_GetFixedSizes(nstates, ninputs, 8);
+  if (num_sizes > 8) num_sizes = 8;
+  for (int i = 0; i < num_sizes; ++i) {
+    int dims[3] = {nstates[i], ninputs[i], 1};
+    int nmax = nstates[i] > ninputs[i] ? nstates[i] : ninputs[i];
+    int size = nmax * nmax;
+    double* a = (double*)malloc(size * sizeof(double));
+    double* b = (double*)malloc(size * sizeof(double));
+    double* c = (double*)malloc(size * sizeof(double));
+    double* cans = (double*)malloc(size * sizeof(double));
+    for (int j = 0; j < size; ++j) {
+      a[j] = sin(0.3 * j);
+      b[j] = cos(0.7 * j);
+    }
+
+    // Products of every pair of blocks and block-vector products
+    for (int im = 0; im < 2; ++im) {
+      for (int in = 0; in < 2; ++in) {
+        for (int ik = 0; ik < 3; ++ik) {
+          int m = dims[im];
+          int n = dims[in];
+          int k = dims[ik];
+          for (int t = 0; t < 4; ++t) {
+            bool tA = t & 1;
+            bool tB = t & 2;
+            for (int j = 0; j < m * k; ++j) c[j] = cans[j] = 0.1 * j;
+            mu_assert(eigen_MatrixMultiplyFixed(m, n, k, a, b, c, tA, tB, 1.3, 0.7));
+            eigen_MatrixMultiply(m, n, k, a, b, cans, tA, tB, 1.3, 0.7);
+            mu_assert(MaxDifference(m * k, c, cans) < 1e-12);
+          }
+        }
+      }
+    }
+
+    // Factorizations and solves of the square blocks
+    for (int in = 0; in < 2; ++in) {
+      int n = dims[in];
+      Matrix L = NewMatrix(n, n);
+      Matrix Lans = NewMatrix(n, n);
+      for (int j = 0; j < n * n; ++j) a[j] = sin(0.3 * j);
+      eigen_MatrixMultiply(n, n, n, a, a, L.data, true, false, 1.0, 0.0);
+      for (int j = 0; j < n; ++j) *MatrixGetElement(&L, j, j) += n;
+      MatrixCopy(&Lans, &L);
+      int info = -1;
+      mu_assert(eigen_CholeskyFactorizeFixed(n, L.data, &info));
+      mu_assert(info == 0);
+      mu_assert(eigen_CholeskyFactorize(n, Lans.data) == 0);
+      mu_assert(MaxDifference(n * n, L.data, Lans.data) < 1e-12);
+      for (int j = 0; j < n; ++j) {
+        for (int k = j + 1; k < n; ++k) MatrixSetElement(&L, j, k, 0.0);
+      }
+
+      for (int ik = 0; ik < 3; ++ik) {
+        int k = dims[ik];
+        for (int j = 0; j < n * k; ++j) c[j] = cans[j] = b[j];
+        mu_assert(eigen_CholeskySolveFixed(n, k, L.data, c));
+        eigen_CholeskySolve(n, k, L.data, cans);
+        mu_assert(MaxDifference(n * k, c, cans) < 1e-12);
+
+        // L x = b and L' x = b
+        for (int t = 0; t < 2; ++t) {
+          for (int j = 0; j < n * k; ++j) c[j] = b[j];
+          mu_assert(eigen_TriangularSolveFixed(n, k, L.data, c, t));
+          eigen_MatrixMultiply(n, n, k, L.data, c, cans, t, false, 1.0, 0.0);
+          mu_assert(MaxDifference(n * k, b, cans) < 1e-10);
+        }
+      }
+      FreeMatrix(&L);
+      FreeMatrix(&Lans);
+    }
+    free(a);
+    free(b);
+    free(c);
+    free(cans);
+  }
+
+  // Other sizes fall back to the dynamic-size kernels
+  double x[4] = {1, 2, 3, 4};
+  int info;
+  mu_assert(!eigen_MatrixMultiplyFixed(1000, 1000, 1000, x, x, x, false, false, 1, 0));
+  mu_assert(!eigen_CholeskyFactorizeFixed(1000, x, &info));
+  mu_assert(!eigen_CholeskySolveFixed(1000, 1, x, x));
+  mu_assert(x[0] == 1 && x[3] == 4);
+  return 1;
+}
+
 void AllTests() {
   mu_run_test(CholeskyFree);
   mu_run_test(CholeskyFactors);
+  mu_run_test(FixedSizeKernels);
 }
 
 mu_test_main
@@ -1,5 +1,8 @@
 #include "linalg.h"
 
+#include <omp.h>
+
+#include "linalg_custom.h"
 #include "matrix.h"
 #include "test/minunit.h"
 
@@ -121,12 +124,410 @@ int CholeskySolve3x3() {
   return 1;
 }
 
+// Fill A with a well-conditioned symmetric positive-definite matrix
+void RandomSPDMatrix(Matrix* A) {
+  int n = A->rows;
+  Matrix G = NewMatrix(n, n);
+  for (int i = 0; i < n * n; ++i) G.data[i] = sin(1.3 * i + 0.2);
+  MatrixMultiply(&G, &G, A, 1, 0, 1.0, 0.0);
+  for (int i = 0; i < n; ++i) *MatrixGetElement(A, i, i) += n;
+  FreeMatrix(&G);
+}
+
+int BlockedCholesky() {
+  // Compare the internal blocked kernels against the library being used (i.e. LAPACK
+  // for the BLAS and MKL builds), for sizes smaller than, equal to, and larger than the
+  // block size, with one and multiple right-hand sides
+  int sizes[4] = {5, 32, 45, 70};
+  for (int s = 0; s < 4; ++s) {
+    int n = sizes[s];
+    for (int nrhs = 1; nrhs <= 7; nrhs += 6) {
+      Matrix A = NewMatrix(n, n);
+      Matrix Alib = NewMatrix(n, n);
+      Matrix Aclap = NewMatrix(n, n);
+      Matrix b = NewMatrix(n, nrhs);
+      Matrix xlib = NewMatrix(n, nrhs);
+      Matrix xclap = NewMatrix(n, nrhs);
+      Matrix r = NewMatrix(n, nrhs);
+      RandomSPDMatrix(&A);
+      for (int i = 0; i < n * nrhs; ++i) b.data[i] = cos(0.4 * i) - 0.5;
+      MatrixCopy(&Alib, &A);
+      MatrixCopy(&Aclap, &A);
+      MatrixCopy(&xlib, &b);
+      MatrixCopy(&xclap, &b);
+
+      CholeskyInfo cholinfo = DefaultCholeskyInfo();
+      MatrixCholeskyFactorizeWithInfo(&Alib, &cholinfo);
+      MatrixCholeskySolveWithInfo(&Alib, &xlib, &cholinfo);
+      FreeFactorization(&cholinfo);
+      mu_assert(clap_CholeskyFactorize(&Aclap) == clap_kCholeskySuccess);
+      clap_CholeskySolve(&Aclap, &xclap);
+
+      // Lower triangle should match, and the upper triangle should be untouched
+      double err = 0.0;
+      for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < n; ++i) {
+          Matrix* Aref = i >= j ? &Alib : &A;
+          double ref = *MatrixGetElement(Aref, i, j);
+          err = fmax(err, fabs(*MatrixGetElement(&Aclap, i, j) - ref));
+        }
+      }
+      mu_assert(err < 1e-10);
+      mu_assert(MatrixNormedDifference(&xlib, &xclap) < 1e-10);
+
+      // Check the residual of the solution
+      MatrixCopy(&r, &b);
+      MatrixMultiply(&A, &xclap, &r, 0, 0, 1.0, -1.0);
+      double res = 0.0;
+      for (int i = 0; i < n * nrhs; ++i) res = fmax(res, fabs(r.data[i]));
+      mu_assert(res < 1e-10);
+
+      FreeMatrix(&A);
+      FreeMatrix(&Alib);
+      FreeMatrix(&Aclap);
+      FreeMatrix(&b);
+      FreeMatrix(&xlib);
+      FreeMatrix(&xclap);
+      FreeMatrix(&r);
+    }
+  }
+
+  // Indefinite matrices should still be detected
+  int n = 40;
+  Matrix A = NewMatrix(n, n);
+  RandomSPDMatrix(&A);
+  *MatrixGetElement(&A, n - 1, n - 1) = -1.0;
+  mu_assert(clap_CholeskyFactorize(&A) == clap_kCholeskyFail);
+  FreeMatrix(&A);
+  return 1;
+}
+
+int CholeskyInverse() {
+  int sizes[3] = {1, 6, 45};
+  for (int s = 0; s < 3; ++s) {
+    int n = sizes[s];
+    Matrix A = NewMatrix(n, n);
+    Matrix Achol = NewMatrix(n, n);
+    Matrix Ainv = NewMatrix(n, n);
+    Matrix Aans = NewMatrix(n, n);
+    RandomSPDMatrix(&A);
+    MatrixCopy(&Achol, &A);
+
+    // Compare against a Cholesky solve with -I
+    CholeskyInfo cholinfo = DefaultCholeskyInfo();
+    MatrixCholeskyFactorizeWithInfo(&Achol, &cholinfo);
+    MatrixSetConst(&Aans, 0.0);
+    for (int i = 0; i < n; ++i) MatrixSetElement(&Aans, i, i, -1.0);
+    MatrixCholeskySolveWithInfo(&Achol, &Aans, &cholinfo);
+    MatrixSetConst(&Ainv, NAN);
+    mu_assert(MatrixCholeskyInverseWithInfo(&Achol, &Ainv, -1.0, &cholinfo) == 0);
+    mu_assert(MatrixNormedDifference(&Ainv, &Aans) < 1e-10);
+
+    // There is no inverse of a failed factorization
+    cholinfo.success = -1;
+    mu_assert(MatrixCholeskyInverseWithInfo(&Achol, &Ainv, -1.0, &cholinfo) == -1);
+    mu_assert(MatrixNormedDifference(&Ainv, &Aans) < 1e-10);
+    FreeFactorization(&cholinfo);
+
+    FreeMatrix(&A);
+    FreeMatrix(&Achol);
+    FreeMatrix(&Ainv);
+    FreeMatrix(&Aans);
+  }
+  return 1;
+}
+
+int SymmetricProducts() {
+  // Sizes smaller and larger than the kernel tiles, with an odd inner dimension
+  int sizes[4] = {1, 6, 13, 40};
+  for (int s = 0; s < 4; ++s) {
+    int n = sizes[s];
+    int k = n + 3;
+    Matrix G = NewMatrix(k, n);
+    Matrix P = NewMatrix(k, k);
+    Matrix X = NewMatrix(n, k);
+    Matrix Xt = NewMatrix(k, n);
+    Matrix Gt = NewMatrix(n, k);
+    Matrix C = NewMatrix(n, n);
+    Matrix Cans = NewMatrix(n, n);
+    for (int i = 0; i < k * n; ++i) G.data[i] = sin(0.3 * i + s);
+    RandomSPDMatrix(&P);
+    MatrixMultiply(&G, &P, &X, 1, 0, 1.0, 0.0);  // X = G'P
+    MatrixCopyTranspose(&Xt, &X);
+    MatrixCopyTranspose(&Gt, &G);
+
+    // C = G'P*G - C, for all combinations of transposes
+    for (int t = 0; t < 4; ++t) {
+      bool tA = t & 1;
+      bool tB = t & 2;
+      RandomSPDMatrix(&C);
+      MatrixCopy(&Cans, &C);
+      MatrixMultiplySymmetricResult(tA ? &Xt : &X, tB ? &Gt : &G, &C, tA, tB, 1.5, -1.0);
+      MatrixMultiply(&X, &G, &Cans, 0, 0, 1.5, -1.0);
+      mu_assert(MatrixNormedDifference(&C, &Cans) < 1e-10);
+    }
+
+    // C = G'X' + X G - C, as a sum of products and a rank-2k update
+    Matrix A[2] = {G, Xt};
+    Matrix B[2] = {Xt, G};
+    RandomSPDMatrix(&C);
+    MatrixCopy(&Cans, &C);
+    MatrixSymmetricTransposeMultiplySum(A, B, 2, &C, 0.5, -1.0);
+    MatrixMultiply(&G, &Xt, &Cans, 1, 0, 0.5, -1.0);
+    MatrixMultiply(&Xt, &G, &Cans, 1, 0, 0.5, 1.0);
+    mu_assert(MatrixNormedDifference(&C, &Cans) < 1e-10);
+    MatrixSymmetricRank2kUpdate(&G, &Xt, &C, 2.0, 1.0);
+    MatrixMultiply(&G, &Xt, &Cans, 1, 0, 2.0, 1.0);
+    MatrixMultiply(&Xt, &G, &Cans, 1, 0, 2.0, 1.0);
+    mu_assert(MatrixNormedDifference(&C, &Cans) < 1e-10);
+
+    FreeMatrix(&G);
+    FreeMatrix(&P);
+    FreeMatrix(&X);
+    FreeMatrix(&Xt);
+    FreeMatrix(&Gt);
+    FreeMatrix(&C);
+    FreeMatrix(&Cans);
+  }
+  return 1;
+}
+
+int SelectLibrary() {
+  // Every available library should give the same answer as the internal routines
+  enum MatrixLinearAlgebraLibrary default_lib = MatrixGetLinearAlgebraLibrary();
+  int n = 13;
+  Matrix G = NewMatrix(n, n + 2);
+  Matrix A = NewMatrix(n, n);
+  Matrix L = NewMatrix(n, n);
+  Matrix b = NewMatrix(n, 2);
+  Matrix C = NewMatrix(n, n);
+  Matrix Cans = NewMatrix(n, n);
+  Matrix x = NewMatrix(n, 2);
+  Matrix xans = NewMatrix(n, 2);
+  for (int i = 0; i < n * (n + 2); ++i) G.data[i] = cos(0.7 * i);
+  for (int i = 0; i < 2 * n; ++i) b.data[i] = sin(0.4 * i);
+  RandomSPDMatrix(&A);
+
+  mu_assert(MatrixSetLinearAlgebraLibrary(libInternal) == 0);
+  MatrixMultiply(&G, &G, &Cans, 0, 1, 1.0, 0.0);
+  MatrixCopy(&L, &A);
+  MatrixCopy(&xans, &b);
+  MatrixCholeskyFactorize(&L);
+  MatrixCholeskySolve(&L, &xans);
+
+  for (enum MatrixLinearAlgebraLibrary lib = libBLAS; lib <= libInternal; ++lib) {
+    if (!MatrixHasLinearAlgebraLibrary(lib)) {
+      mu_assert(MatrixSetLinearAlgebraLibrary(lib) == -1);
+      continue;
+    }
+    mu_assert(MatrixSetLinearAlgebraLibrary(lib) == 0);
+    mu_assert(MatrixGetLinearAlgebraLibrary() == lib);
+    mu_assert(MatrixGetOperationLibrary(laCholesky) == lib);
+    MatrixMultiplySymmetricResult(&G, &G, &C, 0, 1, 1.0, 0.0);
+    mu_assert(MatrixNormedDifference(&C, &Cans) < 1e-10);
+    MatrixCopy(&L, &A);
+    MatrixCopy(&x, &b);
+    CholeskyInfo cholinfo = DefaultCholeskyInfo();
+    MatrixCholeskyFactorizeWithInfo(&L, &cholinfo);
+    MatrixCholeskySolveWithInfo(&L, &x, &cholinfo);
+    mu_assert(MatrixNormedDifference(&x, &xans) < 1e-10);
+    mu_assert(cholinfo.lib == (lib == libEigen ? 'E' : lib == libInternal ? 'I' : 'B'));
+  }
+
+  // Override the library for a single operation
+  MatrixSetLinearAlgebraLibrary(libInternal);
+  if (MatrixHasLinearAlgebraLibrary(libEigen)) {
+    mu_assert(MatrixSetOperationLibrary(laMultiply, libEigen) == 0);
+    mu_assert(MatrixGetOperationLibrary(laMultiply) == libEigen);
+    mu_assert(MatrixGetOperationLibrary(laCholesky) == libInternal);
+    MatrixMultiply(&G, &G, &C, 0, 1, 1.0, 0.0);
+    mu_assert(MatrixNormedDifference(&C, &Cans) < 1e-10);
+    MatrixCopy(&L, &A);
+    MatrixCopy(&x, &b);
+    CholeskyInfo cholinfo = DefaultCholeskyInfo();
+    MatrixCholeskyFactorizeWithInfo(&L, &cholinfo);
+    MatrixCholeskySolveWithInfo(&L, &x, &cholinfo);
+    mu_assert(MatrixNormedDifference(&x, &xans) < 1e-10);
+    mu_assert(cholinfo.lib == 'I');
+  }
+  mu_assert(MatrixSetOperationLibrary(kNumLinearAlgebraOperations, libInternal) == -1);
+
+  // Select the libraries for this thread only
+  MatrixSetLinearAlgebraLibrary(libInternal);
+  enum MatrixLinearAlgebraLibrary libs[kNumLinearAlgebraOperations];
+  for (int op = 0; op < kNumLinearAlgebraOperations; ++op) libs[op] = libInternal;
+  libs[laMultiply] = default_lib;
+  mu_assert(MatrixSetThreadOperationLibraries(libs) == NULL);
+  mu_assert(MatrixGetThreadOperationLibraries() == libs);
+  mu_assert(MatrixGetOperationLibrary(laMultiply) == default_lib);
+  enum MatrixLinearAlgebraLibrary other_lib = libInternal;
+#pragma omp parallel num_threads(2)
+  {
+    if (omp_get_thread_num() == 1) other_lib = MatrixGetOperationLibrary(laMultiply);
+  }
+  mu_assert(other_lib == libInternal);
+  mu_assert(MatrixSetThreadOperationLibraries(NULL) == libs);
+  mu_assert(MatrixGetThreadOperationLibraries() == NULL);
+  libs[laCholesky] = kNumLinearAlgebraLibraries;
+  mu_assert(MatrixSetThreadOperationLibraries(libs) == NULL);  // not available
+  mu_assert(MatrixGetOperationLibrary(laCholesky) == libInternal);
+  mu_assert(MatrixSetLinearAlgebraLibrary(kNumLinearAlgebraLibraries) == -1);
+
+  MatrixSetLinearAlgebraLibrary(default_lib);
+  FreeMatrix(&G);
+  FreeMatrix(&A);
+  FreeMatrix(&L);
+  FreeMatrix(&b);
+  FreeMatrix(&C);
+  FreeMatrix(&Cans);
+  FreeMatrix(&x);
+  FreeMatrix(&xans);
+  return 1;
+}
+
+int BatchedOperations() {
+  // Blocks of different sizes, as in the solver
+  enum MatrixLinearAlgebraLibrary default_lib = MatrixGetLinearAlgebraLibrary();
+  const int count = 70;  // more than one chunk
+  Matrix A[70];
+  Matrix B[70];
+  Matrix C[70];
+  Matrix Cans[70];
+  Matrix L[70];
+  Matrix x[70];
+  Matrix xans[70];
+  for (int i = 0; i < count; ++i) {
+    int n = i % 3 == 0 ? 6 : 3;
+    int m = i % 2 == 0 ? 1 : 6;
+    A[i] = NewMatrix(n, n);
+    B[i] = NewMatrix(n, m);
+    C[i] = NewMatrix(n, m);
+    Cans[i] = NewMatrix(n, m);
+    L[i] = NewMatrix(n, n);
+    x[i] = NewMatrix(n, m);
+    xans[i] = NewMatrix(n, m);
+    for (int j = 0; j < n * n; ++j) A[i].data[j] = cos(0.3 * (i + j));
+    for (int j = 0; j < n * m; ++j) B[i].data[j] = sin(0.7 * (i + j));
+    RandomSPDMatrix(L + i);
+  }
+
+  for (enum MatrixLinearAlgebraLibrary lib = libBLAS; lib <= libInternal; ++lib) {
+    if (MatrixSetLinearAlgebraLibrary(lib) != 0) continue;
+    for (int i = 0; i < count; ++i) {
+      MatrixSetConst(C + i, 1.0);
+      MatrixSetConst(Cans + i, 1.0);
+      MatrixMultiply(A + i, B + i, Cans + i, true, false, -1.0, 0.5);
+    }
+    MatrixMultiplyBatched(A, B, C, count, true, false, -1.0, 0.5);
+    for (int i = 0; i < count; ++i) {
+      mu_assert(MatrixNormedDifference(C + i, Cans + i) < 1e-10);
+    }
+
+    Matrix S[70];
+    CholeskyInfo info[70];
+    CholeskyInfo* pinfo[70];
+    for (int i = 0; i < count; ++i) {
+      S[i] = NewMatrix(L[i].rows, L[i].cols);
+      MatrixCopy(S + i, L + i);
+      MatrixCopy(x + i, B + i);
+      MatrixCopy(xans + i, B + i);
+      info[i] = DefaultCholeskyInfo();
+      pinfo[i] = i % 2 == 0 ? info + i : NULL;
+    }
+    mu_assert(MatrixCholeskyFactorizeBatched(S, count, pinfo) == 0);
+    mu_assert(MatrixCholeskySolveBatched(S, x, count) == 0);
+    for (int i = 0; i < count; ++i) {
+      MatrixCholeskySolve(S + i, xans + i);
+      mu_assert(MatrixNormedDifference(x + i, xans + i) < 1e-10);
+      if (i % 2 == 0) {
+        mu_assert(info[i].success == 0);
+        mu_assert(info[i].uplo == 'L');
+      }
+      FreeMatrix(S + i);
+    }
+  }
+
+  // Empty batches are fine
+  MatrixMultiplyBatched(A, B, C, 0, false, false, 1.0, 0.0);
+  mu_assert(MatrixCholeskyFactorizeBatched(L, 0, NULL) == 0);
+  mu_assert(MatrixCholeskySolveBatched(NULL, NULL, 0) == -1);
+
+  MatrixSetLinearAlgebraLibrary(default_lib);
+  for (int i = 0; i < count; ++i) {
+    FreeMatrix(A + i);
+    FreeMatrix(B + i);
+    FreeMatrix(C + i);
+    FreeMatrix(Cans + i);
+    FreeMatrix(L + i);
+    FreeMatrix(x + i);
+    FreeMatrix(xans + i);
+  }
+  return 1;
+}
+
+int ParallelCholesky() {
+  // Sizes with one block, and with partial blocks in both the panel and trailing tiles
+  int sizes[3] = {40, 64, 150};
+  for (int s = 0; s < 3; ++s) {
+    int n = sizes[s];
+    Matrix A = NewMatrix(n, n);
+    Matrix Aref = NewMatrix(n, n);
+    RandomSPDMatrix(&A);
+    MatrixCopy(&Aref, &A);
+    mu_assert(clap_CholeskyFactorize(&Aref) == clap_kCholeskySuccess);
+    for (int num_threads = 1; num_threads <= 3; num_threads += 2) {
+      Matrix Apar = NewMatrix(n, n);
+      MatrixCopy(&Apar, &A);
+      CholeskyInfo cholinfo = DefaultCholeskyInfo();
+      int out[3] = {-1, -1, -1};
+#pragma omp parallel num_threads(num_threads)
+      { out[omp_get_thread_num()] = MatrixCholeskyFactorizeParallel(&Apar, &cholinfo); }
+      for (int i = 0; i < num_threads; ++i) mu_assert(out[i] == 0);
+      mu_assert(cholinfo.success == 0);
+      mu_assert(cholinfo.uplo == 'L');
+
+      // Lower triangle should match, and the upper triangle should be untouched
+      double err = 0.0;
+      for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < n; ++i) {
+          double ref = *MatrixGetElement(i >= j ? &Aref : &A, i, j);
+          err = fmax(err, fabs(*MatrixGetElement(&Apar, i, j) - ref));
+        }
+      }
+      mu_assert(err < 1e-10);
+      FreeMatrix(&Apar);
+    }
+    FreeMatrix(&A);
+    FreeMatrix(&Aref);
+  }
+
+  // Every thread sees the failure
+  int n = 150;
+  Matrix A = NewMatrix(n, n);
+  RandomSPDMatrix(&A);
+  *MatrixGetElement(&A, n - 1, n - 1) = -1.0;
+  CholeskyInfo cholinfo = DefaultCholeskyInfo();
+  int out[2] = {0, 0};
+#pragma omp parallel num_threads(2)
+  { out[omp_get_thread_num()] = MatrixCholeskyFactorizeParallel(&A, &cholinfo); }
+  mu_assert(out[0] != 0 && out[1] != 0);
+  mu_assert(cholinfo.success != 0);
+  FreeMatrix(&A);
+  return 1;
+}
+
 void AllTests() {
   mu_run_test(DiagonalCholesky);
   mu_run_test(DiagonalCholeskySolve);
   mu_run_test(CholeskySolve3x3);
+  mu_run_test(BlockedCholesky);
+  mu_run_test(CholeskyInverse);
   mu_run_test(MatMul);
   mu_run_test(SymMatMul);
+  mu_run_test(SymmetricProducts);
+  mu_run_test(SelectLibrary);
+  mu_run_test(BatchedOperations);
+  mu_run_test(ParallelCholesky);
   MatrixPrintLinearAlgebraLibrary();
 }
 
@@ -107,6 +107,16 @@ int NewLQRProblem() {
   return 1;
 }
 
+int NumVariables() {
+  mu_assert(ndlqr_GetNumVariables(6, 3, 8) == 15 * 8 - 3);
+
+  // Sizes just below and above the range of an int
+  mu_assert(ndlqr_GetNumVariables(100, 50, 8589934) == 2147483450);
+  mu_assert(ndlqr_GetNumVariables(100, 50, 8589935) == -1);
+  mu_assert(ndlqr_GetNumVariables(100, 50, 1 << 24) == -1);
+  return 1;
+}
+
 int InitializeLQRProblem() {
   int nhorizon = 8;
   int nstates = 6;
@@ -194,6 +204,7 @@ int ReadLongProb() {
 
 void AllTests() {
   mu_run_test(NewLQRProblem);
+  mu_run_test(NumVariables);
   mu_run_test(ReadLQRDataFileTest);
   mu_run_test(ReadTestDataFile);
   mu_run_test(ReadProblemFile);
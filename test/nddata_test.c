@@ -125,10 +125,71 @@ int SetSolutionFactors() {
   return 1;
 }
 
+int CompactNdData() {
+  int nstates = 6;
+  int ninputs = 3;
+  int nhorizon = 8;
+  int factorsize = (2 * nstates + ninputs) * nstates;
+  bool stored[24] = {false};
+  stored[1] = true;                 // (1,0)
+  stored[2 + nhorizon * 2] = true;  // (2,2)
+  stored[7 + nhorizon * 1] = true;  // (7,1)
+  NdData* nddata = ndlqr_NewCompactNdData(nstates, ninputs, nhorizon, nstates, stored);
+  mu_assert(nddata->depth == 3);
+  mu_assert(nddata->numfactors == 3);
+
+  // Stored factors are packed in order of their linear index
+  NdFactor* factor;
+  mu_assert(ndlqr_GetNdFactor(nddata, 1, 0, &factor) == 0);
+  mu_assert(factor->lambda.data == nddata->data);
+  mu_assert(ndlqr_GetNdFactor(nddata, 7, 1, &factor) == 0);
+  mu_assert(factor->lambda.data == nddata->data + factorsize);
+  mu_assert(ndlqr_GetNdFactor(nddata, 2, 2, &factor) == 0);
+  mu_assert(factor->lambda.data == nddata->data + 2 * factorsize);
+  mu_assert(factor->input.rows == ninputs);
+
+  // Factors that aren't stored can't be retrieved
+  NdFactor* missing = NULL;
+  mu_assert(ndlqr_GetNdFactor(nddata, 0, 0, &missing) == -1);
+  mu_assert(ndlqr_GetNdFactor(nddata, 2, 1, &missing) == -1);
+  mu_assert(missing == NULL);
+
+  // Reset only touches the stored factors
+  nddata->data[3 * factorsize - 1] = 1.0;
+  ndlqr_ResetNdData(nddata);
+  mu_assert(nddata->data[3 * factorsize - 1] == 0.0);
+  mu_assert(ndlqr_FreeNdData(nddata) == 0);
+  return 1;
+}
+
+int NdDataOffsets() {
+  int nstates = 6;
+  int ninputs = 3;
+  NdData* nddata = ndlqr_NewNdData(nstates, ninputs, 8, nstates);
+  for (int i = 0; i < nddata->numfactors; ++i) {
+    size_t offset = ndlqr_GetNdDataOffset(nstates, ninputs, nstates, i);
+    mu_assert(nddata->factors[i].lambda.data == nddata->data + offset);
+  }
+  mu_assert(ndlqr_GetNdDataOffset(nstates, ninputs, nstates, nddata->numfactors) ==
+            (size_t)nddata->numfactors * 15 * 6);
+  ndlqr_FreeNdData(nddata);
+
+  // Matrix data for n = 100, m = 50 and N = 2^23, with 23 levels, well past 2^31 doubles
+  if (sizeof(size_t) >= 8) {
+    int numfactors = 23 << 23;
+    size_t datasize = (size_t)4823449600000ULL;
+    mu_assert(ndlqr_GetNdDataOffset(100, 50, 100, numfactors) == datasize);
+    mu_assert(ndlqr_GetNdDataOffset(100, 50, 100, numfactors - 1) == datasize - 25000);
+  }
+  return 1;
+}
+
 void AllTests() {
   mu_run_test(NewNdDataTest);
   mu_run_test(SetFactors);
   mu_run_test(SetSolutionFactors);
+  mu_run_test(CompactNdData);
+  mu_run_test(NdDataOffsets);
 }
 
 mu_test_main
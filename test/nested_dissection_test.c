@@ -7,6 +7,7 @@
 #include "solver.h"
 #include "test/minunit.h"
 #include "test/test_problem.h"
+#include "utils.h"
 
 int SolveLeaves() {
   LQRProblem* lqrprob = ndlqr_ReadTestLQRProblem();
@@ -61,12 +62,13 @@ int SolveLeaves() {
   mu_assert(MatrixNormedDifference(&F->input, &Bt) < 1e-6);
 
   ndlqr_GetNdFactor(solver->fact, k, 0, &F);
+  Matrix Qinv = NewMatrix(nstates, nstates);
+  MatrixSetConst(&Qinv, 0.0);
   Matrix* Q = &solver->diagonals[0];
   for (int i = 0; i < nstates; ++i) {
-    double x = *MatrixGetElement(Q, i, i);
-    MatrixSetElement(Q, i, i, -1 / (x * x));
+    MatrixSetElement(&Qinv, i, i, -1 / Q->data[i]);
   }
-  mu_assert(MatrixNormedDifference(&F->state, Q) < 1e-6);  // Check the Q \ -I  term
+  mu_assert(MatrixNormedDifference(&F->state, &Qinv) < 1e-6);  // Check the Q \ -I  term
 
   double zdata1[15] = {-1.5, -1.5, -1.5, -1.5, -1.5,  -1.5, 4.0,   2.4,
                        0.8,  -0.8, -2.4, -4.0, 200.0, -0.0, -200.0};
@@ -84,20 +86,18 @@ int SolveLeaves() {
   ndlqr_GetNdFactor(solver->fact, k, 1, &F);
   Q = &solver->diagonals[2 * k];
   for (int i = 0; i < nstates; ++i) {
-    double x = *MatrixGetElement(Q, i, i);
-    MatrixSetElement(Q, i, i, -1 / (x * x));
+    MatrixSetElement(&Qinv, i, i, -1 / Q->data[i]);
   }
-  mu_assert(MatrixNormedDifference(&F->state, Q) < 1e-6);  // Check the Q \ -I  term
+  mu_assert(MatrixNormedDifference(&F->state, &Qinv) < 1e-6);  // Check the Q \ -I  term
 
   ndlqr_GetNdFactor(solver->fact, k + 1, 0, &F);
   Q = &solver->diagonals[2 * (k + 1)];
   for (int i = 0; i < nstates; ++i) {
-    double x = *MatrixGetElement(Q, i, i);
-    MatrixSetElement(Q, i, i, -1 / (x * x));
+    MatrixSetElement(&Qinv, i, i, -1 / Q->data[i]);
   }
-  // PrintMatrix(Q);
+  // PrintMatrix(&Qinv);
   // PrintMatrix(&F->state);
-  mu_assert(MatrixNormedDifference(&F->state, Q) < 1e-6);  // Check the Q \ -I  term
+  mu_assert(MatrixNormedDifference(&F->state, &Qinv) < 1e-6);  // Check the Q \ -I  term
 
   // Check right-hand side vector
   Matrix b_ans = ReadMatrixJSONFile(SAMPLEPROBFILE, "b");
@@ -110,6 +110,7 @@ int SolveLeaves() {
   FreeMatrix(&Anull);
   FreeMatrix(&At);
   FreeMatrix(&Bt);
+  FreeMatrix(&Qinv);
   return 1;
 }
 
@@ -312,10 +313,486 @@ int SolveTwice() {
   return 1;
 }
 
+int SolveDenseCoupling() {
+  LQRProblem* lqrprob = ndlqr_ReadTestLQRProblem();
+  int nstates = lqrprob->lqrdata[0]->nstates;
+  int ninputs = lqrprob->lqrdata[0]->ninputs;
+  NdLqrSolver* solver = ndlqr_NewNdLqrSolver(nstates, ninputs, lqrprob->nhorizon);
+  solver->data->coupling_state = ndlqr_kDenseBlock;
+  solver->data->coupling_input = ndlqr_kDenseBlock;
+  ndlqr_InitializeWithLQRProblem(lqrprob, solver);
+
+  // Dense coupling blocks are stored explicitly
+  NdFactor* C;
+  ndlqr_GetNdFactor(solver->data, 1, 0, &C);
+  for (int i = 0; i < nstates; ++i) {
+    for (int j = 0; j < nstates; ++j) {
+      mu_assert(*MatrixGetElement(&C->state, i, j) == (i == j ? -1.0 : 0.0));
+    }
+  }
+
+  // And the solve should give the same answer as with the structured blocks
+  ndlqr_Solve(solver);
+  Matrix x_ans = ReadMatrixJSONFile(SAMPLEPROBFILE, "soln");
+  Matrix x = ndlqr_GetSolution(solver);
+  mu_assert(MatrixNormedDifference(&x, &x_ans) < 1e-6);
+
+  FreeMatrix(&x_ans);
+  ndlqr_FreeNdLqrSolver(solver);
+  ndlqr_FreeLQRProblem(lqrprob);
+  return 1;
+}
+
+int SparsityMap() {
+  LQRProblem* lqrprob = ndlqr_ReadTestLQRProblem();
+  int nstates = lqrprob->lqrdata[0]->nstates;
+  int ninputs = lqrprob->lqrdata[0]->ninputs;
+  int nhorizon = lqrprob->nhorizon;
+  NdLqrSolver* solver = ndlqr_NewNdLqrSolver(nstates, ninputs, nhorizon);
+  NdLqrSolver* dense = ndlqr_NewNdLqrSolver(nstates, ninputs, nhorizon);
+  ndlqr_InitializeWithLQRProblem(lqrprob, solver);
+  ndlqr_InitializeWithLQRProblem(lqrprob, dense);
+  mu_assert(solver->skipped_flops > 0);
+
+  // Solve without skipping any blocks
+  ndlqr_FreeSparsityMap(dense->fact);
+  ndlqr_Solve(solver);
+  ndlqr_Solve(dense);
+  mu_assert(solver->profile.skipped_flops == solver->skipped_flops);
+  Matrix x = ndlqr_GetSolution(solver);
+  Matrix xdense = ndlqr_GetSolution(dense);
+  mu_assert(MatrixNormedDifference(&x, &xdense) < 1e-10);
+
+  // Every block the map says is always zero is zero in the dense factorization
+  NdFactor* F;
+  for (int level = 0; level < solver->depth; ++level) {
+    for (int k = 0; k < nhorizon; ++k) {
+      ndlqr_GetNdFactor(dense->fact, k, level, &F);
+      Matrix blocks[3] = {F->lambda, F->state, F->input};
+      for (int b = ndlqr_kLambda; b <= ndlqr_kInput; ++b) {
+        if (ndlqr_IsBlockNonzero(solver->fact, k, level, b, ndlqr_kNeverNonzero)) continue;
+        for (int i = 0; i < MatrixNumElements(blocks + b); ++i) {
+          mu_assert(blocks[b].data[i] == 0.0);
+        }
+      }
+    }
+  }
+
+  ndlqr_FreeNdLqrSolver(solver);
+  ndlqr_FreeNdLqrSolver(dense);
+  ndlqr_FreeLQRProblem(lqrprob);
+  return 1;
+}
+
+/*
+ * Sets up the solver for one of the variants compared by SolveAndCompare(), using the
+ * public setters. Returns false if the variant should be skipped, e.g. because it needs
+ * a library that isn't available.
+ */
+typedef bool (*ConfigureSolverFn)(NdLqrSolver* solver, int variant);
+
+/*
+ * Solves the problem with the solver once for each variant, and checks that every
+ * solution matches the one from a solver with the default settings. The default linear
+ * algebra library is restored afterwards.
+ */
+static int SolveAndCompare(LQRProblem* lqrprob, NdLqrSolver* solver,
+                           ConfigureSolverFn configure, int num_variants) {
+  int nstates = lqrprob->lqrdata[0]->nstates;
+  int ninputs = lqrprob->lqrdata[0]->ninputs;
+  NdLqrSolver* reference = ndlqr_NewNdLqrSolver(nstates, ninputs, lqrprob->nhorizon);
+  ndlqr_InitializeWithLQRProblem(lqrprob, reference);
+  ndlqr_Solve(reference);
+  Matrix x = ndlqr_GetSolution(reference);
+  Matrix xsolver = ndlqr_GetSolution(solver);
+
+  enum MatrixLinearAlgebraLibrary default_lib = MatrixGetLinearAlgebraLibrary();
+  int matched = 1;
+  for (int variant = 0; variant < num_variants && matched; ++variant) {
+    if (!configure(solver, variant)) continue;
+    ndlqr_ResetNdData(solver->fact);
+    ndlqr_InitializeWithLQRProblem(lqrprob, solver);
+    ndlqr_Solve(solver);
+    double err = MatrixNormedDifference(&x, &xsolver);
+    if (!(err < 1e-10)) {
+      printf("Variant %d differs from the reference solve by %e\n", variant, err);
+      matched = 0;
+    }
+  }
+  MatrixSetLinearAlgebraLibrary(default_lib);
+  ndlqr_FreeNdLqrSolver(reference);
+  return matched;
+}
+
+static NdLqrSolver* NewProblemSolver(LQRProblem* lqrprob) {
+  int nstates = lqrprob->lqrdata[0]->nstates;
+  int ninputs = lqrprob->lqrdata[0]->ninputs;
+  return ndlqr_NewNdLqrSolver(nstates, ninputs, lqrprob->nhorizon);
+}
+
+// Solve with the current settings
+static bool KeepSettings(NdLqrSolver* solver, int variant) {
+  (void)solver;
+  (void)variant;
+  return true;
+}
+
+// Automatic thread counts, without and with batched execution
+static bool AutoThreadsAndBatch(NdLqrSolver* solver, int variant) {
+  ndlqr_SetBatchedExecution(solver, variant);
+  ndlqr_SetNumThreads(solver, ndlqr_kAutoThreads);
+  return true;
+}
+
+// Cached inverses (bit 0) and batched execution (bit 1) with a team of 4 threads
+static bool CacheAndBatch(NdLqrSolver* solver, int variant) {
+  ndlqr_SetInverseFactorCaching(solver, variant & 1);
+  ndlqr_SetBatchedExecution(solver, variant & 2);
+  ndlqr_SetNumThreads(solver, 4);
+  return true;
+}
+
+// Cached inverses (bit 0) with every library (the remaining bits) and 4 threads
+static bool CacheAndLibrary(NdLqrSolver* solver, int variant) {
+  ndlqr_SetInverseFactorCaching(solver, variant & 1);
+  ndlqr_SetNumThreads(solver, 4);
+  return MatrixSetLinearAlgebraLibrary(variant / 2) == 0;
+}
+
+// One thread with cached inverses, four threads sharing a single workspace, and four
+// threads without the cache
+static bool CacheWorkspaces(NdLqrSolver* solver, int variant) {
+  ndlqr_SetInverseFactorCaching(solver, variant < 2);
+  ndlqr_SetNumThreads(solver, variant == 0 ? 1 : 4);
+  if (variant == 1) {
+    // Threads without a workspace fall back to the Cholesky solves
+    ndlqr_EnableInverseCaching(solver->cholfacts, solver->nstates, 1);
+  }
+  return true;
+}
+
+int InverseCaching() {
+  LQRProblem* lqrprob = ndlqr_ReadTestLQRProblem();
+  NdLqrSolver* cached = NewProblemSolver(lqrprob);
+  mu_assert(ndlqr_SetInverseFactorCaching(cached, true) == 0);
+  mu_assert(SolveAndCompare(lqrprob, cached, CacheWorkspaces, 3));
+
+  // Every thread gets a workspace, unless the workspaces are replaced afterwards
+  Matrix* work;
+  ndlqr_SetInverseFactorCaching(cached, true);
+  ndlqr_SetNumThreads(cached, 4);
+  mu_assert(cached->cholfacts->num_workspaces >= 4);
+  ndlqr_EnableInverseCaching(cached->cholfacts, cached->nstates, 1);
+  ndlqr_GetInverseWorkspace(cached->cholfacts, 1, &work);
+  mu_assert(work == NULL);
+
+  // Disabling the cache frees the inverses
+  ndlqr_SetInverseFactorCaching(cached, false);
+  mu_assert(cached->cholfacts->inverses == NULL);
+
+  ndlqr_FreeNdLqrSolver(cached);
+  ndlqr_FreeLQRProblem(lqrprob);
+  return 1;
+}
+
+int BatchedExecution() {
+  LQRProblem* lqrprob = ndlqr_ReadTestLQRProblem();
+  NdLqrSolver* batched = NewProblemSolver(lqrprob);
+  mu_assert(!batched->batched);
+  mu_assert(ndlqr_SetBatchedExecution(batched, true) == 0);
+
+  // Every library, with and without cached inverses
+  mu_assert(SolveAndCompare(lqrprob, batched, CacheAndLibrary,
+                            2 * kNumLinearAlgebraLibraries));
+
+  // Dense coupling blocks add more terms to the inner products
+  ndlqr_SetInverseFactorCaching(batched, false);
+  batched->data->coupling_state = ndlqr_kDenseBlock;
+  batched->data->coupling_input = ndlqr_kDenseBlock;
+  ndlqr_SetNumThreads(batched, 1);
+  mu_assert(SolveAndCompare(lqrprob, batched, KeepSettings, 1));
+
+  ndlqr_FreeNdLqrSolver(batched);
+  ndlqr_FreeLQRProblem(lqrprob);
+  return 1;
+}
+
+int IntraBlockParallelism() {
+  LQRProblem* lqrprob = ndlqr_ReadTestLQRProblem();
+  int nstates = lqrprob->lqrdata[0]->nstates;
+  NdLqrSolver* split = NewProblemSolver(lqrprob);
+  mu_assert(split->intra_block_min_size == 0);
+  mu_assert(ndlqr_SetIntraBlockParallelism(split, -1) == -1);
+  mu_assert(ndlqr_SetIntraBlockParallelism(split, nstates + 1) == 0);
+  ndlqr_SetNumThreads(split, 4);
+  mu_assert(!ndlqr_UseIntraBlockParallelism(split, split->depth - 1));
+  mu_assert(ndlqr_SetIntraBlockParallelism(split, nstates) == 0);
+  mu_assert(ndlqr_UseIntraBlockParallelism(split, split->depth - 1));
+  mu_assert(ndlqr_UseIntraBlockParallelism(split, split->depth - 2));
+  mu_assert(!ndlqr_UseIntraBlockParallelism(split, split->depth - 3));
+
+  // Every library, with and without cached inverses, with a team larger than the number
+  // of leaves at the top levels
+  mu_assert(SolveAndCompare(lqrprob, split, CacheAndLibrary,
+                            2 * kNumLinearAlgebraLibraries));
+
+  ndlqr_FreeNdLqrSolver(split);
+  ndlqr_FreeLQRProblem(lqrprob);
+  return 1;
+}
+
+int AdaptiveThreads() {
+  LQRProblem* lqrprob = ndlqr_ReadTestLQRProblem();
+  int nhorizon = lqrprob->nhorizon;
+  NdLqrSolver* adaptive = NewProblemSolver(lqrprob);
+
+  // Teams larger than the work at the upper levels
+  mu_assert(ndlqr_SetNumThreads(adaptive, -1) == -1);
+  mu_assert(ndlqr_SetNumThreads(adaptive, 8) == 0);
+  mu_assert(!adaptive->auto_threads);
+  mu_assert(SolveAndCompare(lqrprob, adaptive, KeepSettings, 1));
+  NdLqrProfile* profile = &adaptive->profile;
+  int depth = adaptive->depth;
+  mu_assert(profile->num_levels == depth);
+  mu_assert(profile->leaf_threads == (nhorizon < 8 ? nhorizon : 8));
+  for (int level = 0; level < depth; ++level) {
+    int numleaves = PowerOfTwo(depth - level - 1);
+    for (int phase = 0; phase < ndlqr_kNumPhases; ++phase) {
+      int threads = profile->phase_threads[level][phase];
+      mu_assert(threads >= 1);
+      mu_assert(threads <= profile->num_threads);
+    }
+    mu_assert(profile->phase_threads[level][ndlqr_kCholeskyPhase] <= numleaves);
+    mu_assert(profile->phase_threads[level][ndlqr_kSolveProductsPhase] <= numleaves);
+  }
+  mu_assert(profile->phase_threads[depth - 1][ndlqr_kCholeskyPhase] == 1);
+  mu_assert(ndlqr_GetPhaseThreads(adaptive, ndlqr_kCholeskyPhase, depth) == -1);
+  mu_assert(ndlqr_GetPhaseThreads(adaptive, ndlqr_kNumPhases, 0) == -1);
+
+  // Automatic thread counts, with and without batched execution
+  mu_assert(ndlqr_SetNumThreads(adaptive, ndlqr_kAutoThreads) == 0);
+  mu_assert(adaptive->auto_threads);
+  mu_assert(SolveAndCompare(lqrprob, adaptive, AutoThreadsAndBatch, 2));
+  for (int level = 0; level < depth; ++level) {
+    for (int phase = 0; phase < ndlqr_kNumPhases; ++phase) {
+      mu_assert(profile->phase_threads[level][phase] <= profile->num_threads);
+    }
+  }
+  // The solve pass does too little work to split at the top level
+  mu_assert(profile->phase_threads[depth - 1][ndlqr_kSolveCholSolvePhase] == 1);
+
+  // The leaves only do diagonal solves, which are too cheap to split for this problem
+  mu_assert(profile->leaf_threads == 1);
+
+  ndlqr_FreeNdLqrSolver(adaptive);
+  ndlqr_FreeLQRProblem(lqrprob);
+  return 1;
+}
+
+int FusedPhases() {
+  LQRProblem* lqrprob = ndlqr_ReadTestLQRProblem();
+  NdLqrSolver* separate = NewProblemSolver(lqrprob);
+  NdLqrSolver* fused = NewProblemSolver(lqrprob);
+  int depth = fused->depth;
+  mu_assert(fused->fused_phases);
+  mu_assert(ndlqr_SetFusedPhases(separate, false) == 0);
+
+  // Separate phases synchronize after every phase
+  ndlqr_SetNumThreads(separate, 1);
+  mu_assert(SolveAndCompare(lqrprob, separate, KeepSettings, 1));
+  mu_assert(separate->profile.num_barriers == 2 + 7 * depth);
+
+  // Fused levels only synchronize once per pass
+  ndlqr_SetNumThreads(fused, 1);
+  mu_assert(SolveAndCompare(lqrprob, fused, KeepSettings, 1));
+  mu_assert(fused->profile.num_barriers == 2 + 2 * depth);
+
+  // Levels with fewer leaves than threads keep the separate phases
+  ndlqr_SetNumThreads(fused, 4);
+  mu_assert(ndlqr_UseFusedPhases(fused, depth - 3));
+  mu_assert(!ndlqr_UseFusedPhases(fused, depth - 2));
+  mu_assert(SolveAndCompare(lqrprob, fused, CacheAndBatch, 4));
+  if (fused->num_threads == 4) {
+    mu_assert(fused->profile.num_barriers == 2 + 2 * (depth - 2) + 7 * 2);
+  }
+
+  ndlqr_FreeNdLqrSolver(separate);
+  ndlqr_FreeNdLqrSolver(fused);
+  ndlqr_FreeLQRProblem(lqrprob);
+  return 1;
+}
+
+int SinglePassSolve() {
+  LQRProblem* lqrprob = ndlqr_ReadTestLQRProblem();
+  NdLqrSolver* single = NewProblemSolver(lqrprob);
+  int depth = single->depth;
+  mu_assert(!single->single_pass);
+  mu_assert(ndlqr_SetSinglePassSolve(single, true) == 0);
+
+  // Half the barriers of the two-pass solve
+  ndlqr_SetNumThreads(single, 1);
+  for (int fused = 0; fused < 2; ++fused) {
+    ndlqr_SetFusedPhases(single, fused);
+    mu_assert(SolveAndCompare(lqrprob, single, KeepSettings, 1));
+    mu_assert(single->profile.num_barriers == 2 + (fused ? 1 : 4) * depth);
+  }
+
+  // Fused and separate levels, batched, and with cached inverses
+  mu_assert(SolveAndCompare(lqrprob, single, CacheAndBatch, 4));
+
+  ndlqr_FreeNdLqrSolver(single);
+  ndlqr_FreeLQRProblem(lqrprob);
+  return 1;
+}
+
+int PartialSolution() {
+  LQRProblem* lqrprob = ndlqr_ReadTestLQRProblem();
+  int nhorizon = lqrprob->nhorizon;
+  NdLqrSolver* solver = NewProblemSolver(lqrprob);
+  NdLqrSolver* partial = NewProblemSolver(lqrprob);
+  ndlqr_InitializeWithLQRProblem(lqrprob, solver);
+  ndlqr_Solve(solver);
+
+  int bad[2] = {0, nhorizon};
+  mu_assert(ndlqr_SetPartialSolution(partial, bad, 2) == -1);
+  mu_assert(ndlqr_SetPartialSolution(partial, NULL, 1) == -1);
+  mu_assert(partial->partial_knots == NULL);
+
+  // First control and next state, the last knot point, and a few in the middle
+  int mpc[2] = {0, 1};
+  int last[1] = {nhorizon - 1};
+  int middle[2] = {3, 4};
+  const int* requests[3] = {mpc, last, middle};
+  int num_requested[3] = {2, 1, 2};
+  for (int r = 0; r < 3; ++r) {
+    for (int batched = 0; batched < 2; ++batched) {
+      for (int single_pass = 0; single_pass < 2; ++single_pass) {
+        mu_assert(ndlqr_SetPartialSolution(partial, requests[r], num_requested[r]) == 0);
+        ndlqr_SetBatchedExecution(partial, batched);
+        ndlqr_SetSinglePassSolve(partial, single_pass);
+        ndlqr_ResetNdData(partial->fact);
+        ndlqr_InitializeWithLQRProblem(lqrprob, partial);
+        ndlqr_Solve(partial);
+        for (int i = 0; i < num_requested[r]; ++i) {
+          NdFactor* z;
+          NdFactor* zpartial;
+          ndlqr_GetNdFactor(solver->soln, requests[r][i], 0, &z);
+          ndlqr_GetNdFactor(partial->soln, requests[r][i], 0, &zpartial);
+          mu_assert(MatrixNormedDifference(&z->lambda, &zpartial->lambda) < 1e-10);
+          mu_assert(MatrixNormedDifference(&z->state, &zpartial->state) < 1e-10);
+          mu_assert(MatrixNormedDifference(&z->input, &zpartial->input) < 1e-10);
+        }
+      }
+    }
+  }
+
+  // Only the requested knot points are updated at the top level
+  ndlqr_SetPartialSolution(partial, mpc, 2);
+  bool* top_knots = partial->partial_knots + (partial->depth - 1) * nhorizon;
+  int num_updated = 0;
+  for (int k = 0; k < nhorizon; ++k) {
+    num_updated += top_knots[k];
+  }
+  mu_assert(num_updated == 2);
+  mu_assert(top_knots[0] && top_knots[1]);
+
+  // Back to the full solution
+  mu_assert(ndlqr_SetPartialSolution(partial, NULL, 0) == 0);
+  mu_assert(partial->partial_knots == NULL);
+  ndlqr_ResetNdData(partial->fact);
+  ndlqr_InitializeWithLQRProblem(lqrprob, partial);
+  ndlqr_Solve(partial);
+  Matrix x = ndlqr_GetSolution(solver);
+  Matrix xpartial = ndlqr_GetSolution(partial);
+  mu_assert(MatrixNormedDifference(&x, &xpartial) < 1e-10);
+
+  ndlqr_FreeNdLqrSolver(solver);
+  ndlqr_FreeNdLqrSolver(partial);
+  ndlqr_FreeLQRProblem(lqrprob);
+  return 1;
+}
+
+int UpdateRightHandSide() {
+  LQRProblem* lqrprob = ndlqr_ReadTestLQRProblem();
+  int nstates = lqrprob->lqrdata[0]->nstates;
+  int nhorizon = lqrprob->nhorizon;
+  NdLqrSolver* solver = NewProblemSolver(lqrprob);
+  NdLqrSolver* updated = NewProblemSolver(lqrprob);
+  Matrix x = ndlqr_GetSolution(solver);
+  Matrix xupdated = ndlqr_GetSolution(updated);
+  ndlqr_InitializeWithLQRProblem(lqrprob, updated);
+  ndlqr_Solve(updated);
+
+  int bad[1] = {nhorizon};
+  mu_assert(ndlqr_UpdateRightHandSide(updated, lqrprob, bad, 1) == -1);
+  mu_assert(ndlqr_UpdateRightHandSide(updated, lqrprob, NULL, 0) == 0);
+
+  // Change the initial state, then the costs and dynamics at a few knot points
+  int first[1] = {0};
+  int waypoints[3] = {2, 3, nhorizon - 1};
+  const int* changes[2] = {first, waypoints};
+  int num_changes[2] = {1, 3};
+  for (int c = 0; c < 2; ++c) {
+    for (int batched = 0; batched < 2; ++batched) {
+      for (int i = 0; i < num_changes[c]; ++i) {
+        int k = changes[c][i];
+        for (int j = 0; j < nstates; ++j) {
+          if (k == 0) {
+            lqrprob->x0[j] += 0.5 * (j + 1);
+          } else {
+            lqrprob->lqrdata[k - 1]->d[j] -= 0.1 * j;
+          }
+          lqrprob->lqrdata[k]->q[j] += 0.3;
+        }
+      }
+      ndlqr_SetBatchedExecution(updated, batched);
+      mu_assert(ndlqr_UpdateRightHandSide(updated, lqrprob, changes[c], num_changes[c]) ==
+                0);
+      ndlqr_ResetNdData(solver->fact);
+      ndlqr_InitializeWithLQRProblem(lqrprob, solver);
+      ndlqr_Solve(solver);
+      mu_assert(MatrixNormedDifference(&x, &xupdated) < 1e-10);
+    }
+  }
+
+  // Only the first control and next state
+  int mpc[2] = {0, 1};
+  ndlqr_SetPartialSolution(updated, mpc, 2);
+  lqrprob->x0[0] -= 1.0;
+  mu_assert(ndlqr_UpdateRightHandSide(updated, lqrprob, first, 1) == 0);
+  ndlqr_ResetNdData(solver->fact);
+  ndlqr_InitializeWithLQRProblem(lqrprob, solver);
+  ndlqr_Solve(solver);
+  for (int k = 0; k < 2; ++k) {
+    NdFactor* z;
+    NdFactor* zupdated;
+    ndlqr_GetNdFactor(solver->soln, k, 0, &z);
+    ndlqr_GetNdFactor(updated->soln, k, 0, &zupdated);
+    mu_assert(MatrixNormedDifference(&z->lambda, &zupdated->lambda) < 1e-10);
+    mu_assert(MatrixNormedDifference(&z->state, &zupdated->state) < 1e-10);
+    mu_assert(MatrixNormedDifference(&z->input, &zupdated->input) < 1e-10);
+  }
+
+  ndlqr_FreeNdLqrSolver(solver);
+  ndlqr_FreeNdLqrSolver(updated);
+  ndlqr_FreeLQRProblem(lqrprob);
+  return 1;
+}
+
 void AllTests() {
   mu_run_test(SolveLeaves);
   mu_run_test(RunSolve);
   mu_run_test(SolveTwice);
+  mu_run_test(SolveDenseCoupling);
+  mu_run_test(SparsityMap);
+  mu_run_test(InverseCaching);
+  mu_run_test(BatchedExecution);
+  mu_run_test(IntraBlockParallelism);
+  mu_run_test(AdaptiveThreads);
+  mu_run_test(FusedPhases);
+  mu_run_test(SinglePassSolve);
+  mu_run_test(PartialSolution);
+  mu_run_test(UpdateRightHandSide);
   mu_run_test(FactorInnerProduct);
   mu_run_test(ShurCompliment);
 }
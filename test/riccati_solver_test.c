@@ -127,7 +127,7 @@ int RiccatiStepTest() {
     MatrixCopy(K, Qux);
     MatrixCopy(d, Qu);
 
-    CholeskyInfo cholinfo = {'L', 0, 'E', NULL, 0};
+    CholeskyInfo cholinfo = {'L', 0, 'E', NULL};
     MatrixCholeskyFactorizeWithInfo(Quu_tmp, &cholinfo);
     MatrixCholeskySolveWithInfo(Quu_tmp, K, &cholinfo);
     MatrixCholeskySolveWithInfo(Quu_tmp, d, &cholinfo);
@@ -402,6 +402,65 @@ int SolveLongProblem() {
   return 1;
 }
 
+// A double integrator with the same data at every knot point
+static LQRProblem* NewDoubleIntegratorProblem(int nhorizon) {
+  double h = 0.01;
+  double Q[2] = {1.0, 1.0};
+  double R[1] = {0.1};
+  double q[2] = {-1.0, 0.0};
+  double r[1] = {0.0};
+  double A[4] = {1.0, 0.0, h, 1.0};
+  double B[2] = {0.5 * h * h, h};
+  double d[2] = {0.0, 0.0};
+  LQRProblem* lqrprob = ndlqr_NewLQRProblem(2, 1, nhorizon);
+  for (int k = 0; k < nhorizon; ++k) {
+    ndlqr_InitializeLQRData(lqrprob->lqrdata[k], Q, R, q, r, 0.0, A, B, d);
+  }
+  lqrprob->x0[0] = 1.0;
+  lqrprob->x0[1] = 0.0;
+  return lqrprob;
+}
+
+int SolveVeryLongProblem() {
+  // A horizon of a few hundred thousand knot points
+  int nhorizon = 1 << 17;
+  LQRProblem* lqrprob = NewDoubleIntegratorProblem(nhorizon);
+  NdLqrSolver* solver = ndlqr_NewNdLqrSolver(2, 1, nhorizon);
+  mu_assert(solver != NULL);
+  ndlqr_InitializeWithLQRProblem(lqrprob, solver);
+  ndlqr_Solve(solver);
+  RiccatiSolver* riccati = ndlqr_NewRiccatiSolver(lqrprob);
+  ndlqr_SolveRiccati(riccati);
+
+  Matrix x_ndlqr = ndlqr_GetSolution(solver);
+  Matrix x_ric = ndlqr_GetRiccatiSolution(riccati);
+  mu_assert(x_ndlqr.rows == 5 * nhorizon - 1);
+  mu_assert(MatrixNormedDifference(&x_ndlqr, &x_ric) < 1e-6);
+  ndlqr_FreeRiccatiSolver(riccati);
+  ndlqr_FreeNdLqrSolver(solver);
+  ndlqr_FreeLQRProblem(lqrprob);
+  return 1;
+}
+
+int LargeProblemSizes() {
+  mu_assert(ndlqr_GetRiccatiDataSize(2, 1, 4) == 72);
+  LQRProblem* lqrprob = NewDoubleIntegratorProblem(4);
+  RiccatiSolver* solver = ndlqr_NewRiccatiSolver(lqrprob);
+  size_t dim_Q = 4 + 1 + 2 + 2 + 1;
+  mu_assert(solver->Qx[0].data == solver->data + 72 - 2 * dim_Q);
+  ndlqr_FreeRiccatiSolver(solver);
+  ndlqr_FreeLQRProblem(lqrprob);
+
+  // n = 100, m = 50 and N = 2^23 needs more than 2^31 doubles
+  if (sizeof(size_t) >= 8) {
+    mu_assert(ndlqr_GetRiccatiDataSize(100, 50, 1 << 23) == (size_t)129184593400ULL);
+  }
+
+  // Problems whose solution vector can't be indexed with an int are rejected up front
+  mu_assert(ndlqr_NewNdLqrSolver(100, 50, 8589935) == NULL);
+  return 1;
+}
+
 void AllTests() {
   mu_run_test(RiccatiSolverTest);
   mu_run_test(RiccatiStepTest);
@@ -409,8 +468,10 @@ void AllTests() {
   mu_run_test(ForwardPassTest);
   mu_run_test(RiccatiSolveTest);
   mu_run_test(RiccatiSolveTwiceTest);
+  mu_run_test(LargeProblemSizes);
   if (kRunFullTest) {
     mu_run_test(SolveLongProblem);
+    mu_run_test(SolveVeryLongProblem);
   }
 }
 
@@ -169,7 +169,7 @@ int main(int argc, char* argv[]) {
   // Print the summary
   PrintStats(stats);
   printf("Got the right answer? %d\n", right_answer);
-  printf("Using Eigen? %d\n", kUseEigen);
+  printf("Using Eigen? %d\n", MatrixGetLinearAlgebraLibrary() == libEigen);
 
   printf("\nRiccati Solver:\n");
   ndlqr_PrintRiccatiSummary(riccati);
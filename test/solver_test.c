@@ -13,6 +13,14 @@ int NewSolver() {
   mu_assert(level == 0);
   level = ndlqr_GetIndexLevel(&solver->tree, 3);
   mu_assert(level == 2);
+
+  // The matrix data only stores the levels of each knot point and the previous one
+  NdFactor* factor;
+  mu_assert(solver->data->numfactors == 2 * 7);
+  mu_assert(solver->fact->numfactors == 8 * 3);
+  mu_assert(ndlqr_GetNdFactor(solver->data, 3, 2, &factor) == 0);
+  mu_assert(ndlqr_GetNdFactor(solver->data, 4, 2, &factor) == 0);
+  mu_assert(ndlqr_GetNdFactor(solver->data, 5, 2, &factor) == -1);
   ndlqr_FreeNdLqrSolver(solver);
   return 1;
 }
@@ -24,12 +32,8 @@ int InitializeWithLQRProblem() {
   int nstates = solver->nstates;
   int ninputs = solver->ninputs;
 
-  // Create an identity matrix
-  Matrix minus_identity = NewMatrix(nstates, nstates);
-  MatrixSetConst(&minus_identity, 0);
-  for (int i = 0; i < nstates; ++i) {
-    MatrixSetElement(&minus_identity, i, i, -1);
-  }
+  Matrix zeros = NewMatrix(nstates, nstates);
+  MatrixSetConst(&zeros, 0);
 
   NdData* nddata = solver->data;
   NdData* rhs = solver->soln;
@@ -69,10 +73,12 @@ int InitializeWithLQRProblem() {
   mu_assert(MatrixNormedDifference(&yx, &q) < 1e-6);
   mu_assert(MatrixNormedDifference(&yu, &r) < 1e-6);
 
-  // Check the -I
+  // The -I coupling to the next time step is structural, and isn't stored
+  mu_assert(nddata->coupling_state == ndlqr_kMinusIdentityBlock);
+  mu_assert(nddata->coupling_input == ndlqr_kZeroBlock);
   ndlqr_GetNdFactor(nddata, 1, 0, &C);
   Cx = ndlqr_GetStateFactor(C);
-  mu_assert(MatrixNormedDifference(&minus_identity, &Cx) < 1e-6);
+  mu_assert(MatrixNormedDifference(&zeros, &Cx) < 1e-6);
 
   // Check the next step
   ndlqr_GetNdFactor(nddata, 1, 1, &C);
@@ -133,16 +139,15 @@ int InitializeWithLQRProblem() {
   yx = ndlqr_GetStateFactor(z);
   q.data = lqrprob->lqrdata[7]->q;
   MatrixScaleByConst(&q, -1);
-  mu_assert(MatrixNormedDifference(&minus_identity, &Cx) < 1e-6);
+  mu_assert(MatrixNormedDifference(&zeros, &Cx) < 1e-6);
   mu_assert(MatrixNormedDifference(&yx, &q) < 1e-6);
 
   int k = solver->nhorizon - 1;
   for (int i = 0; i < nstates; ++i) {
-    mu_assert(fabs(*MatrixGetElement(&solver->diagonals[2 * k], i, i) -
-                   lqrprob->lqrdata[k]->Q[i]) < 1e-6);
+    mu_assert(fabs(solver->diagonals[2 * k].data[i] - lqrprob->lqrdata[k]->Q[i]) < 1e-6);
   }
 
-  FreeMatrix(&minus_identity);
+  FreeMatrix(&zeros);
   FreeMatrix(&At);
   FreeMatrix(&Bt);
   ndlqr_FreeNdLqrSolver(solver);